@@ -11,6 +11,7 @@ extern "C" {
 #include <libuvc/libuvc_config.h>
 
 struct libusb_context;
+struct libusb_pollfd;
 struct libusb_device_handle;
 
 /** UVC error types, based on libusb errors
@@ -292,6 +293,39 @@ enum uvc_pu_ctrl_selector {
   UVC_PU_CONTRAST_AUTO_CONTROL = 0x13
 };
 
+/** Encoding unit control selector (UVC 1.5, A.9.6) */
+enum uvc_eu_ctrl_selector {
+  UVC_EU_CONTROL_UNDEFINED = 0x00,
+  UVC_EU_SELECT_LAYER_CONTROL = 0x01,
+  UVC_EU_PROFILE_TOOLSET_CONTROL = 0x02,
+  UVC_EU_VIDEO_RESOLUTION_CONTROL = 0x03,
+  UVC_EU_MIN_FRAME_INTERVAL_CONTROL = 0x04,
+  UVC_EU_SLICE_MODE_CONTROL = 0x05,
+  UVC_EU_RATE_CONTROL_MODE_CONTROL = 0x06,
+  UVC_EU_AVERAGE_BITRATE_CONTROL = 0x07,
+  UVC_EU_CPB_SIZE_CONTROL = 0x08,
+  UVC_EU_PEAK_BIT_RATE_CONTROL = 0x09,
+  UVC_EU_QUANTIZATION_PARAMS_CONTROL = 0x0a,
+  UVC_EU_SYNC_REF_FRAME_CONTROL = 0x0b,
+  UVC_EU_LTR_BUFFER_CONTROL = 0x0c,
+  UVC_EU_LTR_PICTURE_CONTROL = 0x0d,
+  UVC_EU_LTR_VALIDATION_CONTROL = 0x0e,
+  UVC_EU_LEVEL_IDC_LIMIT_CONTROL = 0x0f,
+  UVC_EU_SEI_PAYLOADTYPE_CONTROL = 0x10,
+  UVC_EU_QP_RANGE_CONTROL = 0x11,
+  UVC_EU_PRIORITY_CONTROL = 0x12,
+  UVC_EU_START_OR_STOP_LAYER_CONTROL = 0x13,
+  UVC_EU_ERROR_RESILIENCY_CONTROL = 0x14
+};
+
+/** Sync frame type for UVC_EU_SYNC_REF_FRAME_CONTROL (UVC 1.5, 4.2.2.4.11) */
+enum uvc_sync_frame_type {
+  UVC_SYNC_FRAME_RESET = 0x00,
+  UVC_SYNC_FRAME_IDR = 0x01,
+  UVC_SYNC_FRAME_GDR = 0x02,
+  UVC_SYNC_FRAME_SCENE_CUT = 0x03
+};
+
 /** USB terminal type (B.1) */
 enum uvc_term_type {
   UVC_TT_VENDOR_SPECIFIC = 0x0100,
@@ -400,6 +434,19 @@ typedef struct uvc_extension_unit {
   uint64_t bmControls;
 } uvc_extension_unit_t;
 
+/** Hardware encoder controls (UVC 1.5) */
+typedef struct uvc_encoding_unit {
+  struct uvc_encoding_unit *prev, *next;
+  /** Index of the encoding unit within the device */
+  uint8_t bUnitID;
+  /** Index of the unit or terminal feeding the encoder */
+  uint8_t bSourceID;
+  /** Encoding controls (bit n is selector n + 1 in {uvc_eu_ctrl_selector}) */
+  uint64_t bmControls;
+  /** Subset of bmControls that may be changed while streaming */
+  uint64_t bmControlsRuntime;
+} uvc_encoding_unit_t;
+
 enum uvc_status_class {
   UVC_STATUS_CLASS_CONTROL = 0x10,
   UVC_STATUS_CLASS_CONTROL_CAMERA = 0x11,
@@ -485,8 +532,94 @@ typedef struct uvc_frame {
   void *metadata;
   /** Size of metadata buffer */
   size_t metadata_bytes;
+  /** Stream buffer backing the image data of a frame passed to a callback.
+   * Use uvc_frame_borrow() to keep the data beyond the callback. */
+  struct uvc_frame_buffer *stream_buf;
+  /** Host (CLOCK_MONOTONIC) time at which the device sampled the image,
+   * recovered from the PTS and SCR in the payload headers. Unlike
+   * capture_time_finished it does not depend on USB scheduling. Zero when
+   * the device sends no usable PTS/SCR or too few samples were seen yet. */
+  struct timespec capture_time_device;
+  /** CLOCK_MONOTONIC time the first packet of the frame arrived; with
+   * capture_time_finished it brackets the USB transfer of the frame */
+  struct timespec capture_time_started;
+  /** Presentation time stamp from the payload headers, in dwClockFrequency
+   * ticks; 0 if the device sent none */
+  uint32_t pts;
+  /** Source clock (STC) of the last SCR in the payload headers; 0 if none */
+  uint32_t scr;
+  /** USB frame number (11 bits) at which scr was sampled */
+  uint16_t scr_sof;
+  /** Packets of this frame dropped for transfer errors, a set error bit or a
+   * bogus header; nonzero means the image may be damaged */
+  uint32_t packet_errors;
 } uvc_frame_t;
 
+/** Assembly buffer taken over from a stream with uvc_frame_borrow()
+ * @ingroup streaming
+ */
+typedef struct uvc_frame_buffer uvc_frame_buffer_t;
+
+/** Flags for uvc_stream_start()
+ * @ingroup streaming
+ */
+enum uvc_stream_flags {
+  /** Call the frame callback from the USB event thread as soon as a frame
+   * is complete, instead of queueing it for a dedicated callback thread.
+   * Saves a thread hop per frame, but the callback holds up all USB
+   * processing of the context while it runs: it must be quick, must treat
+   * the frame as read-only and must not stop or close streams. The frame
+   * may still be kept with uvc_frame_borrow(). */
+  UVC_STREAM_DIRECT_DISPATCH = 0x02
+};
+
+/** What a stream does with a completed frame when its queue is full
+ * @ingroup streaming
+ */
+typedef enum uvc_frame_overflow_policy {
+  /** Discard the frame that just completed */
+  UVC_FRAME_OVERFLOW_DROP_NEWEST = 0,
+  /** Discard the oldest queued frame to make room */
+  UVC_FRAME_OVERFLOW_DROP_OLDEST = 1,
+  /** Hold up USB processing until the consumer catches up */
+  UVC_FRAME_OVERFLOW_BLOCK = 2
+} uvc_frame_overflow_policy_t;
+
+/** Ways to revive a stream that stopped delivering frames, mildest first
+ * @ingroup streaming
+ */
+typedef enum uvc_stream_reset_level {
+  /** Nothing beyond restarting the stream, which resubmits every transfer */
+  UVC_STREAM_RESET_TRANSFERS = 0,
+  /** Clear a halt condition on the streaming endpoint */
+  UVC_STREAM_RESET_CLEAR_HALT = 1,
+  /** Drop to alternate setting 0 and commit the stream control again */
+  UVC_STREAM_RESET_COMMIT = 2,
+  /** Reset the device's USB port, then commit the stream control again */
+  UVC_STREAM_RESET_DEVICE = 3
+} uvc_stream_reset_level_t;
+
+/** Hooks supplying the memory a stream assembles frames into
+ * @ingroup streaming
+ *
+ * All hooks may be called from the USB event thread and from the thread
+ * returning borrowed frames, and must not call back into libuvc.
+ */
+typedef struct uvc_frame_allocator {
+  /** Return at least @a size writable bytes, storing an opaque handle for
+   * them in @a handle; NULL if no memory is available */
+  void *(*acquire)(size_t size, void **handle, void *user_ptr);
+  /** Take back memory returned by acquire or grow */
+  void (*release)(void *data, void *handle, void *user_ptr);
+  /** Optional: enlarge @a data to @a new_size keeping its first @a used
+   * bytes, updating @a handle; NULL leaves the buffer untouched. Without it
+   * libuvc acquires a bigger buffer and copies. */
+  void *(*grow)(void *data, size_t used, size_t new_size, void **handle, void *user_ptr);
+  /** Optional: called once the last buffer has been released */
+  void (*destroy)(void *user_ptr);
+  void *user_ptr;
+} uvc_frame_allocator_t;
+
 /** A callback function to handle incoming assembled UVC frames
  * @ingroup streaming
  */
@@ -532,6 +665,21 @@ typedef struct uvc_still_ctrl {
 uvc_error_t uvc_init(uvc_context_t **ctx, struct libusb_context *usb_ctx);
 void uvc_exit(uvc_context_t *ctx);
 
+/** Called when libusb starts watching a file descriptor (same signature
+ * as libusb_pollfd_added_cb) */
+typedef void(uvc_pollfd_added_cb_t)(int fd, short events, void *user_data);
+/** Called when libusb stops watching a file descriptor */
+typedef void(uvc_pollfd_removed_cb_t)(int fd, void *user_data);
+
+uvc_error_t uvc_set_external_events(uvc_context_t *ctx, int external);
+uvc_error_t uvc_handle_events_timeout(uvc_context_t *ctx, int timeout_ms);
+const struct libusb_pollfd **uvc_get_pollfds(uvc_context_t *ctx);
+void uvc_free_pollfds(const struct libusb_pollfd **pollfds);
+void uvc_set_pollfd_notifiers(uvc_context_t *ctx,
+    uvc_pollfd_added_cb_t *added_cb,
+    uvc_pollfd_removed_cb_t *removed_cb,
+    void *user_data);
+
 uvc_error_t uvc_get_device_list(
     uvc_context_t *ctx,
     uvc_device_t ***list);
@@ -588,6 +736,7 @@ const uvc_output_terminal_t *uvc_get_output_terminals(uvc_device_handle_t *devh)
 const uvc_selector_unit_t *uvc_get_selector_units(uvc_device_handle_t *devh);
 const uvc_processing_unit_t *uvc_get_processing_units(uvc_device_handle_t *devh);
 const uvc_extension_unit_t *uvc_get_extension_units(uvc_device_handle_t *devh);
+const uvc_encoding_unit_t *uvc_get_encoding_units(uvc_device_handle_t *devh);
 
 uvc_error_t uvc_get_stream_ctrl_format_size(
     uvc_device_handle_t *devh,
@@ -648,11 +797,38 @@ uvc_error_t uvc_stream_get_frame(
 );
 uvc_error_t uvc_stream_stop(uvc_stream_handle_t *strmh);
 void uvc_stream_close(uvc_stream_handle_t *strmh);
+uvc_error_t uvc_stream_set_frame_allocator(uvc_stream_handle_t *strmh,
+    const uvc_frame_allocator_t *allocator,
+    size_t buf_size);
+uvc_error_t uvc_stream_set_transfer_config(uvc_stream_handle_t *strmh,
+    int num_transfers,
+    int packets_per_transfer,
+    size_t max_bytes);
+void uvc_stream_get_transfer_config(uvc_stream_handle_t *strmh,
+    int *num_transfers,
+    size_t *transfer_size);
+uvc_error_t uvc_stream_set_frame_queue(uvc_stream_handle_t *strmh,
+    int depth,
+    uvc_frame_overflow_policy_t policy);
+uint32_t uvc_stream_get_dropped_frames(uvc_stream_handle_t *strmh);
+uvc_error_t uvc_stream_get_status(uvc_stream_handle_t *strmh);
+uint32_t uvc_stream_get_sequence(uvc_stream_handle_t *strmh);
+uvc_error_t uvc_stream_reset(uvc_stream_handle_t *strmh, uvc_stream_reset_level_t level);
+int uvc_stream_get_fd(uvc_stream_handle_t *strmh);
+uvc_frame_buffer_t *uvc_frame_borrow(uvc_frame_t *frame);
+void uvc_frame_return(uvc_frame_buffer_t *buf);
 
 int uvc_get_ctrl_len(uvc_device_handle_t *devh, uint8_t unit, uint8_t ctrl);
 int uvc_get_ctrl(uvc_device_handle_t *devh, uint8_t unit, uint8_t ctrl, void *data, int len, enum uvc_req_code req_code);
 int uvc_set_ctrl(uvc_device_handle_t *devh, uint8_t unit, uint8_t ctrl, void *data, int len);
 
+int uvc_has_encoding_ctrl(uvc_device_handle_t *devh, enum uvc_eu_ctrl_selector ctrl);
+int uvc_has_runtime_encoding_ctrl(uvc_device_handle_t *devh, enum uvc_eu_ctrl_selector ctrl);
+uvc_error_t uvc_set_sync_ref_frame(uvc_device_handle_t *devh, enum uvc_sync_frame_type type,
+                                   uint16_t sync_frame_interval, uint8_t gradual_decoder_refresh);
+uvc_error_t uvc_get_average_bitrate(uvc_device_handle_t *devh, uint32_t *bitrate, enum uvc_req_code req_code);
+uvc_error_t uvc_set_average_bitrate(uvc_device_handle_t *devh, uint32_t bitrate);
+
 uvc_error_t uvc_get_power_mode(uvc_device_handle_t *devh, enum uvc_device_power_mode *mode, enum uvc_req_code req_code);
 uvc_error_t uvc_set_power_mode(uvc_device_handle_t *devh, enum uvc_device_power_mode mode);
 
@@ -95,7 +95,8 @@ enum uvc_vc_desc_subtype {
   UVC_VC_OUTPUT_TERMINAL = 0x03,
   UVC_VC_SELECTOR_UNIT = 0x04,
   UVC_VC_PROCESSING_UNIT = 0x05,
-  UVC_VC_EXTENSION_UNIT = 0x06
+  UVC_VC_EXTENSION_UNIT = 0x06,
+  UVC_VC_ENCODING_UNIT = 0x07
 };
 
 /** UVC endpoint descriptor subtype (A.7) */
@@ -191,6 +192,7 @@ typedef struct uvc_control_interface {
   struct uvc_selector_unit *selector_unit_descs;
   struct uvc_processing_unit *processing_unit_descs;
   struct uvc_extension_unit *extension_unit_descs;
+  struct uvc_encoding_unit *encoding_unit_descs;
   uint16_t bcdUVC;
   uint32_t dwClockFrequency;
   uint8_t bEndpointAddress;
@@ -221,7 +223,8 @@ typedef struct uvc_device_info {
   transfers. A better approach may be to make the transfer thread FIFO
   scheduled (if we have root).
   Default number of transfer buffers can be overwritten by defining
-  this macro.
+  this macro, or per stream with uvc_stream_set_transfer_config(). It is
+  also the ceiling for counts derived from the bitrate.
  */
 #ifndef LIBUVC_NUM_TRANSFER_BUFS
 #if defined(__APPLE__) && defined(__MACH__)
@@ -231,8 +234,128 @@ typedef struct uvc_device_info {
 #endif
 #endif
 
+/* Fewest transfers a stream runs with, whatever the memory budget */
+#ifndef LIBUVC_MIN_TRANSFER_BUFS
+#define LIBUVC_MIN_TRANSFER_BUFS 2
+#endif
+
+/* Default cap on packets per isochronous transfer */
+#ifndef LIBUVC_ISO_PACKETS_PER_TRANSFER
+#define LIBUVC_ISO_PACKETS_PER_TRANSFER 32
+#endif
+
+/* Video buffered in flight when the transfer count is derived from the bitrate */
+#ifndef LIBUVC_TRANSFER_BUFFER_MS
+#define LIBUVC_TRANSFER_BUFFER_MS 100
+#endif
+
 #define LIBUVC_XFER_META_BUF_SIZE ( 4 * 1024 )
 
+/* Number of idle frame buffers a stream keeps around for reuse. Buffers
+ * returned by consumers beyond this are freed. */
+#ifndef LIBUVC_FRAME_POOL_MAX_FREE
+#define LIBUVC_FRAME_POOL_MAX_FREE 8
+#endif
+
+/* Completed frames a stream queues for its consumer by default */
+#ifndef LIBUVC_FRAME_QUEUE_DEPTH
+#define LIBUVC_FRAME_QUEUE_DEPTH 4
+#endif
+
+/* SCR samples a stream keeps for device clock recovery, one per frame */
+#ifndef LIBUVC_CLOCK_SAMPLES
+#define LIBUVC_CLOCK_SAMPLES 32
+#endif
+
+/* Fields written by different threads are kept this far apart */
+#ifndef LIBUVC_CACHELINE_SIZE
+#define LIBUVC_CACHELINE_SIZE 64
+#endif
+
+#define UVC_CACHE_ALIGNED __attribute__((aligned(LIBUVC_CACHELINE_SIZE)))
+
+/* Memory ordering for the lock-free frame queue */
+#define UVC_LOAD_ACQUIRE(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define UVC_STORE_RELEASE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define UVC_LOAD_SEQ_CST(p) __atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define UVC_STORE_SEQ_CST(p, v) __atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define UVC_CAS(p, expected, desired) \
+  __atomic_compare_exchange_n((p), (expected), (desired), 0, \
+                              __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+#define UVC_ATOMIC_INC(p) __atomic_fetch_add((p), 1, __ATOMIC_RELAXED)
+
+/** Wakes a thread sleeping in poll(): an eventfd on Linux, a pipe elsewhere */
+struct uvc_wakeup {
+  int read_fd;
+  int write_fd;
+};
+
+struct uvc_frame_pool;
+
+/** Frame assembly buffer. Handed to callbacks (and borrowed by consumers)
+ * without copying; returns to its pool when released. */
+struct uvc_frame_buffer {
+  struct uvc_frame_buffer *next;
+  struct uvc_frame_pool *pool;
+  uint8_t *data;
+  size_t size;
+  /** allocator's handle on @a data */
+  void *handle;
+};
+
+/** Recycles frame buffers of one stream. Reference counted so buffers
+ * borrowed by a consumer can be returned after the stream is closed. */
+struct uvc_frame_pool {
+  pthread_mutex_t mutex;
+  /** one reference for the stream plus one per buffer in existence */
+  int refcount;
+  /** set once the stream is closed: returned buffers are freed */
+  uint8_t closed;
+  size_t buf_size;
+  struct uvc_frame_buffer *free_bufs;
+  int num_free;
+  uvc_frame_allocator_t alloc;
+};
+
+/** Source clock reference from a payload header, with its arrival time */
+struct uvc_clock_sample {
+  /** device source clock (STC), unwrapped */
+  uint64_t stc;
+  /** USB frame number (1 ms) at which the STC was sampled, unwrapped */
+  uint64_t sof;
+  /** CLOCK_MONOTONIC time the packet carrying it was received, in ns */
+  int64_t host_ns;
+};
+
+/** Ring of recent SCR samples used to map PTS values to host time */
+struct uvc_clock {
+  struct uvc_clock_sample samples[LIBUVC_CLOCK_SAMPLES];
+  unsigned int head;
+  unsigned int count;
+  /* raw values of the newest sample, for unwrapping */
+  uint32_t last_stc;
+  uint16_t last_sof;
+};
+
+/** Completed frame waiting for the consumer. Each slot owns an assembly
+ * buffer even while empty, so queueing a frame is a buffer swap. */
+struct uvc_frame_slot {
+  /** set while the consumer reads the slot; the producer skips it */
+  uint8_t busy;
+  struct uvc_frame_buffer *buf;
+  size_t bytes;
+  uint32_t seq;
+  uint32_t pts;
+  uint32_t last_scr;
+  uint16_t last_sof;
+  uint32_t packet_errors;
+  struct timespec capture_time_finished;
+  struct timespec capture_time_device;
+  struct timespec capture_time_started;
+  uint8_t *meta;
+  size_t meta_bytes;
+};
+
 struct uvc_stream_handle {
   struct uvc_device_handle *devh;
   struct uvc_stream_handle *prev, *next;
@@ -243,29 +366,80 @@ struct uvc_stream_handle {
   /** Current control block */
   struct uvc_stream_ctrl cur_ctrl;
 
-  /* listeners may only access hold*, and only when holding a
-   * lock on cb_mutex (probably signaled with cb_cond) */
+  /* listeners may only access the frame queue; cb_mutex and cb_cond
+   * guard the transfer list */
   uint8_t fid;
-  uint32_t seq, hold_seq;
-  uint32_t pts, hold_pts;
-  uint32_t last_scr, hold_last_scr;
-  size_t got_bytes, hold_bytes;
-  uint8_t *outbuf, *holdbuf;
+  uint32_t seq;
+  uint32_t pts;
+  uint32_t last_scr;
+  uint16_t last_sof;
+  /* arrival time of the payload being processed and of last_scr, in ns */
+  int64_t payload_time_ns;
+  int64_t scr_time_ns;
+  /* arrival of the first image data of the frame being assembled */
+  int64_t frame_start_ns;
+  /* packets of the frame being assembled that had to be dropped */
+  uint32_t packet_errors;
+  /* time between isochronous packets on this device's bus speed */
+  int64_t packet_interval_ns;
+  struct uvc_clock clock;
+  size_t got_bytes;
+  struct uvc_frame_buffer *outbuf;
+  /* replaces outbuf when a directly dispatched frame is borrowed */
+  struct uvc_frame_buffer *spare_buf;
+  struct uvc_frame_pool *frame_pool;
+  /* completed frames, a single-producer single-consumer ring without
+   * locks. The transfer callback publishes at queue_tail, the callback
+   * thread or uvc_stream_get_frame() takes from queue_head. Indices run
+   * freely and are masked into queue_mask + 1 slots, one more than the
+   * depth so the slot the consumer is reading is never the next one
+   * written. */
+  struct uvc_frame_slot *queue;
+  uint32_t queue_depth;
+  uint32_t queue_mask;
+  uvc_frame_overflow_policy_t overflow_policy;
+  /* producer to consumer: a frame was queued */
+  struct uvc_wakeup frame_ready;
+  /* consumer to producer: a slot was freed */
+  struct uvc_wakeup queue_space;
   pthread_mutex_t cb_mutex;
   pthread_cond_t cb_cond;
   pthread_t cb_thread;
-  uint32_t last_polled_seq;
   uvc_frame_callback_t *user_cb;
   void *user_ptr;
-  struct libusb_transfer *transfers[LIBUVC_NUM_TRANSFER_BUFS];
-  uint8_t *transfer_bufs[LIBUVC_NUM_TRANSFER_BUFS];
-  struct uvc_frame frame;
+  /* user_cb runs in the USB event thread, see UVC_STREAM_DIRECT_DISPATCH */
+  uint8_t direct_dispatch;
+  /* frame_ready was handed out by uvc_stream_get_fd() and is signalled
+   * for every queued frame, not only when the consumer sleeps */
+  uint8_t frame_fd_exported;
+  /* transfer ring, sized when the stream starts */
+  struct libusb_transfer **transfers;
+  uint8_t **transfer_bufs;
+  int num_transfer_bufs;
+  size_t transfer_size;
+  /* ring shape requested with uvc_stream_set_transfer_config() */
+  int req_transfer_bufs;
+  int req_packets_per_transfer;
+  size_t max_transfer_mem;
   enum uvc_frame_format frame_format;
-  struct timespec capture_time_finished;
 
   /* raw metadata buffer if available */
-  uint8_t *meta_outbuf, *meta_holdbuf;
-  size_t meta_got_bytes, meta_hold_bytes;
+  uint8_t *meta_outbuf;
+  size_t meta_got_bytes;
+
+  /* set when a transfer finds the device gone, see uvc_stream_get_status() */
+  int device_lost;
+
+  /* written by the producer only */
+  uint32_t queue_tail UVC_CACHE_ALIGNED;
+  /* frames lost because the queue was full */
+  uint32_t frames_dropped;
+  uint8_t producer_waiting;
+
+  /* written by the consumer (and by the producer when evicting) */
+  uint32_t queue_head UVC_CACHE_ALIGNED;
+  uint8_t consumer_waiting;
+  struct uvc_frame frame;
 };
 
 /** Handle on an open UVC device
@@ -301,8 +475,14 @@ struct uvc_context {
   uint8_t own_usb_ctx;
   /** List of open devices in this context */
   uvc_device_handle_t *open_devices;
+  /** Guards open_devices and the handler thread's start and stop, so
+   * devices can be opened and closed from several threads */
+  pthread_mutex_t open_devices_lock;
   pthread_t handler_thread;
   int kill_handler_thread;
+  /** True iff the application runs libusb events itself, so no handler
+   * thread is spawned. See uvc_set_external_events(). */
+  uint8_t external_events;
 };
 
 uvc_error_t uvc_query_stream_ctrl(
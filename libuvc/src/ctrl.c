@@ -163,3 +163,134 @@ uvc_error_t uvc_set_power_mode(uvc_device_handle_t *devh, enum uvc_device_power_
 }
 
 /** @todo Request Error Code Control (UVC 1.5, 4.2.1.2) */
+
+/***** ENCODING UNIT CONTROLS *****/
+/**
+ * @brief Check whether the device's encoding unit advertises a control.
+ *
+ * @param devh UVC device handle
+ * @param ctrl Encoding unit control selector
+ * @return 1 if the first encoding unit supports @p ctrl, 0 otherwise
+ * @ingroup ctrl
+ */
+int uvc_has_encoding_ctrl(uvc_device_handle_t *devh, enum uvc_eu_ctrl_selector ctrl) {
+  const uvc_encoding_unit_t *unit = devh->info->ctrl_if.encoding_unit_descs;
+
+  if (!unit || ctrl == UVC_EU_CONTROL_UNDEFINED)
+    return 0;
+
+  return (unit->bmControls >> (ctrl - 1)) & 1;
+}
+
+/**
+ * @brief Check whether an encoding unit control may be set while streaming.
+ *
+ * Controls that are supported but not runtime-capable only take effect
+ * when set before the stream starts.
+ *
+ * @param devh UVC device handle
+ * @param ctrl Encoding unit control selector
+ * @return 1 if the first encoding unit can change @p ctrl on the fly, 0 otherwise
+ * @ingroup ctrl
+ */
+int uvc_has_runtime_encoding_ctrl(uvc_device_handle_t *devh, enum uvc_eu_ctrl_selector ctrl) {
+  const uvc_encoding_unit_t *unit = devh->info->ctrl_if.encoding_unit_descs;
+
+  if (!unit || ctrl == UVC_EU_CONTROL_UNDEFINED)
+    return 0;
+
+  return (unit->bmControlsRuntime >> (ctrl - 1)) & 1;
+}
+
+/**
+ * @brief Ask the encoder to emit a synchronisation frame (UVC 1.5, 4.2.2.4.11).
+ *
+ * With UVC_SYNC_FRAME_IDR and a zero interval the next encoded frame is an
+ * IDR picture; this is the standard way to request a keyframe mid-stream.
+ *
+ * @param devh UVC device handle
+ * @param type Kind of sync frame to generate
+ * @param sync_frame_interval Period between sync frames in ms, 0 for a single one
+ * @param gradual_decoder_refresh Number of frames a GDR spans, 0 otherwise
+ * @return UVC_ERROR_NOT_SUPPORTED if the device has no such control
+ * @ingroup ctrl
+ */
+uvc_error_t uvc_set_sync_ref_frame(uvc_device_handle_t *devh, enum uvc_sync_frame_type type,
+                                   uint16_t sync_frame_interval, uint8_t gradual_decoder_refresh) {
+  const uvc_encoding_unit_t *unit = devh->info->ctrl_if.encoding_unit_descs;
+  uint8_t data[4];
+  uvc_error_t ret;
+
+  if (!uvc_has_encoding_ctrl(devh, UVC_EU_SYNC_REF_FRAME_CONTROL))
+    return UVC_ERROR_NOT_SUPPORTED;
+
+  data[0] = type;
+  SHORT_TO_SW(sync_frame_interval, data + 1);
+  data[3] = gradual_decoder_refresh;
+
+  ret = uvc_set_ctrl(devh, unit->bUnitID, UVC_EU_SYNC_REF_FRAME_CONTROL,
+                     data, sizeof(data));
+
+  if (ret == sizeof(data))
+    return UVC_SUCCESS;
+  else
+    return ret;
+}
+
+/**
+ * @brief Read the encoder's average bitrate (UVC 1.5, 4.2.2.4.7).
+ *
+ * @param devh UVC device handle
+ * @param[out] bitrate Average bitrate in bits per second
+ * @param req_code UVC_GET_* request to execute
+ * @return UVC_ERROR_NOT_SUPPORTED if the device has no such control
+ * @ingroup ctrl
+ */
+uvc_error_t uvc_get_average_bitrate(uvc_device_handle_t *devh, uint32_t *bitrate, enum uvc_req_code req_code) {
+  const uvc_encoding_unit_t *unit = devh->info->ctrl_if.encoding_unit_descs;
+  uint8_t data[4];
+  uvc_error_t ret;
+
+  if (!uvc_has_encoding_ctrl(devh, UVC_EU_AVERAGE_BITRATE_CONTROL))
+    return UVC_ERROR_NOT_SUPPORTED;
+
+  ret = uvc_get_ctrl(devh, unit->bUnitID, UVC_EU_AVERAGE_BITRATE_CONTROL,
+                     data, sizeof(data), req_code);
+
+  if (ret == sizeof(data)) {
+    *bitrate = DW_TO_INT(data);
+    return UVC_SUCCESS;
+  } else {
+    return ret;
+  }
+}
+
+/**
+ * @brief Set the encoder's average bitrate (UVC 1.5, 4.2.2.4.7).
+ *
+ * Unless uvc_has_runtime_encoding_ctrl() says otherwise, the new bitrate
+ * only applies to streams started afterwards.
+ *
+ * @param devh UVC device handle
+ * @param bitrate Average bitrate in bits per second
+ * @return UVC_ERROR_NOT_SUPPORTED if the device has no such control
+ * @ingroup ctrl
+ */
+uvc_error_t uvc_set_average_bitrate(uvc_device_handle_t *devh, uint32_t bitrate) {
+  const uvc_encoding_unit_t *unit = devh->info->ctrl_if.encoding_unit_descs;
+  uint8_t data[4];
+  uvc_error_t ret;
+
+  if (!uvc_has_encoding_ctrl(devh, UVC_EU_AVERAGE_BITRATE_CONTROL))
+    return UVC_ERROR_NOT_SUPPORTED;
+
+  INT_TO_DW(bitrate, data);
+
+  ret = uvc_set_ctrl(devh, unit->bUnitID, UVC_EU_AVERAGE_BITRATE_CONTROL,
+                     data, sizeof(data));
+
+  if (ret == sizeof(data))
+    return UVC_SUCCESS;
+  else
+    return ret;
+}
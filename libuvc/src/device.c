@@ -67,6 +67,10 @@ uvc_error_t uvc_parse_vc_processing_unit(uvc_device_t *dev,
 					 uvc_device_info_t *info,
 					 const unsigned char *block,
 					 size_t block_size);
+uvc_error_t uvc_parse_vc_encoding_unit(uvc_device_t *dev,
+				       uvc_device_info_t *info,
+				       const unsigned char *block,
+				       size_t block_size);
 
 uvc_error_t uvc_scan_streaming(uvc_device_t *dev,
 			       uvc_device_info_t *info,
@@ -106,13 +110,18 @@ void LIBUSB_CALL _uvc_status_callback(struct libusb_transfer *transfer);
  */
 int uvc_already_open(uvc_context_t *ctx, struct libusb_device *usb_dev) {
   uvc_device_handle_t *devh;
+  int found = 0;
 
+  pthread_mutex_lock(&ctx->open_devices_lock);
   DL_FOREACH(ctx->open_devices, devh) {
-    if (usb_dev == devh->dev->usb_dev)
-      return 1;
+    if (usb_dev == devh->dev->usb_dev) {
+      found = 1;
+      break;
+    }
   }
+  pthread_mutex_unlock(&ctx->open_devices_lock);
 
-  return 0;
+  return found;
 }
 
 /** @brief Finds a camera identified by vendor, product and/or serial number
@@ -388,12 +397,14 @@ static uvc_error_t uvc_open_internal(
     }
   }
 
+  pthread_mutex_lock(&dev->ctx->open_devices_lock);
   if (dev->ctx->own_usb_ctx && dev->ctx->open_devices == NULL) {
     /* Since this is our first device, we need to spawn the event handler thread */
     uvc_start_handler_thread(dev->ctx);
   }
 
   DL_APPEND(dev->ctx->open_devices, internal_devh);
+  pthread_mutex_unlock(&dev->ctx->open_devices_lock);
   *devh = internal_devh;
 
   UVC_EXIT(ret);
@@ -467,6 +478,7 @@ void uvc_free_device_info(uvc_device_info_t *info) {
   uvc_input_terminal_t *input_term, *input_term_tmp;
   uvc_processing_unit_t *proc_unit, *proc_unit_tmp;
   uvc_extension_unit_t *ext_unit, *ext_unit_tmp;
+  uvc_encoding_unit_t *enc_unit, *enc_unit_tmp;
 
   uvc_streaming_interface_t *stream_if, *stream_if_tmp;
   uvc_format_desc_t *format, *format_tmp;
@@ -491,6 +503,11 @@ void uvc_free_device_info(uvc_device_info_t *info) {
     free(ext_unit);
   }
 
+  DL_FOREACH_SAFE(info->ctrl_if.encoding_unit_descs, enc_unit, enc_unit_tmp) {
+    DL_DELETE(info->ctrl_if.encoding_unit_descs, enc_unit);
+    free(enc_unit);
+  }
+
   DL_FOREACH_SAFE(info->stream_ifs, stream_if, stream_if_tmp) {
     DL_FOREACH_SAFE(stream_if->format_descs, format, format_tmp) {
       DL_FOREACH_SAFE(format->frame_descs, frame, frame_tmp) {
@@ -929,6 +946,21 @@ const uvc_extension_unit_t *uvc_get_extension_units(uvc_device_handle_t *devh) {
   return devh->info->ctrl_if.extension_unit_descs;
 }
 
+/**
+ * @brief Get encoding unit descriptors for the open device.
+ *
+ * Only UVC 1.5 devices with an on-board encoder expose these.
+ *
+ * @note Do not modify the returned structure.
+ * @note The returned structure is part of a linked list. Iterate through
+ *       it by using the 'next' pointers.
+ *
+ * @param devh Device handle to an open UVC device
+ */
+const uvc_encoding_unit_t *uvc_get_encoding_units(uvc_device_handle_t *devh) {
+  return devh->info->ctrl_if.encoding_unit_descs;
+}
+
 /**
  * @brief Increment the reference count for a device
  * @ingroup device
@@ -1268,6 +1300,43 @@ uvc_error_t uvc_parse_vc_extension_unit(uvc_device_t *dev,
   return UVC_SUCCESS;
 }
 
+/** @internal
+ * @brief Parse a VideoControl encoding unit (UVC 1.5, 3.7.2.6).
+ * @ingroup device
+ */
+uvc_error_t uvc_parse_vc_encoding_unit(uvc_device_t *dev,
+				       uvc_device_info_t *info,
+				       const unsigned char *block, size_t block_size) {
+  uvc_encoding_unit_t *unit;
+  int size_of_controls;
+  int i;
+
+  UVC_ENTER();
+
+  if (block_size < 7 || block_size < 7 + 2 * (size_t) block[6]) {
+    UVC_EXIT(UVC_ERROR_INVALID_DEVICE);
+    return UVC_ERROR_INVALID_DEVICE;
+  }
+
+  unit = calloc(1, sizeof(*unit));
+  unit->bUnitID = block[3];
+  unit->bSourceID = block[4];
+
+  size_of_controls = block[6];
+  if (size_of_controls > 8)
+    size_of_controls = 8;
+
+  for (i = size_of_controls - 1; i >= 0; --i) {
+    unit->bmControls = block[7 + i] + (unit->bmControls << 8);
+    unit->bmControlsRuntime = block[7 + block[6] + i] + (unit->bmControlsRuntime << 8);
+  }
+
+  DL_APPEND(info->ctrl_if.encoding_unit_descs, unit);
+
+  UVC_EXIT(UVC_SUCCESS);
+  return UVC_SUCCESS;
+}
+
 /** @internal
  * Process a single VideoControl descriptor block
  * @ingroup device
@@ -1306,6 +1375,9 @@ uvc_error_t uvc_parse_vc(
   case UVC_VC_EXTENSION_UNIT:
     ret = uvc_parse_vc_extension_unit(dev, info, block, block_size);
     break;
+  case UVC_VC_ENCODING_UNIT:
+    ret = uvc_parse_vc_encoding_unit(dev, info, block, block_size);
+    break;
   default:
     ret = UVC_ERROR_INVALID_DEVICE;
   }
@@ -1733,17 +1805,23 @@ void uvc_close(uvc_device_handle_t *devh) {
   /* If we are managing the libusb context and this is the last open device,
    * then we need to cancel the handler thread. When we call libusb_close,
    * it'll cause a return from the thread's libusb_handle_events call, after
-   * which the handler thread will check the flag we set and then exit. */
-  if (ctx->own_usb_ctx && ctx->open_devices == devh && devh->next == NULL) {
+   * which the handler thread will check the flag we set and then exit.
+   * Only the last device waits for that with the list locked; closing any
+   * other one does not hold up opens elsewhere in the context. */
+  pthread_mutex_lock(&ctx->open_devices_lock);
+  if (ctx->own_usb_ctx && !ctx->external_events &&
+      ctx->open_devices == devh && devh->next == NULL) {
     ctx->kill_handler_thread = 1;
     libusb_close(devh->usb_devh);
     pthread_join(ctx->handler_thread, NULL);
+    DL_DELETE(ctx->open_devices, devh);
+    pthread_mutex_unlock(&ctx->open_devices_lock);
   } else {
+    DL_DELETE(ctx->open_devices, devh);
+    pthread_mutex_unlock(&ctx->open_devices_lock);
     libusb_close(devh->usb_devh);
   }
 
-  DL_DELETE(ctx->open_devices, devh);
-
   uvc_unref_device(devh->dev);
 
   uvc_free_devh(devh);
@@ -1761,9 +1839,11 @@ size_t uvc_num_devices(uvc_context_t *ctx) {
 
   UVC_ENTER();
 
+  pthread_mutex_lock(&ctx->open_devices_lock);
   DL_FOREACH(ctx->open_devices, devh) {
     count++;
   }
+  pthread_mutex_unlock(&ctx->open_devices_lock);
 
   UVC_EXIT((int) count);
   return count;
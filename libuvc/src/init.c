@@ -117,8 +117,10 @@ uvc_error_t uvc_init(uvc_context_t **pctx, struct libusb_context *usb_ctx) {
     ctx->usb_ctx = usb_ctx;
   }
 
-  if (ctx != NULL)
+  if (ctx != NULL) {
+    pthread_mutex_init(&ctx->open_devices_lock, NULL);
     *pctx = ctx;
+  }
 
   return ret;
 }
@@ -145,6 +147,7 @@ void uvc_exit(uvc_context_t *ctx) {
   if (ctx->own_usb_ctx)
     libusb_exit(ctx->usb_ctx);
 
+  pthread_mutex_destroy(&ctx->open_devices_lock);
   free(ctx);
 }
 
@@ -157,7 +160,82 @@ void uvc_exit(uvc_context_t *ctx) {
  * are already open (and being handled).
  */
 void uvc_start_handler_thread(uvc_context_t *ctx) {
-  if (ctx->own_usb_ctx)
+  /* a context whose last device was closed earlier is reused */
+  ctx->kill_handler_thread = 0;
+
+  if (ctx->own_usb_ctx && !ctx->external_events)
     pthread_create(&ctx->handler_thread, NULL, _uvc_handle_events, (void*) ctx);
 }
 
+/** @brief Let the application run libusb event handling itself
+ * @ingroup init
+ *
+ * By default a context that owns its USB context spawns a thread that
+ * handles libusb events while any device is open. With external events
+ * enabled no such thread is started; the application must instead call
+ * uvc_handle_events_timeout() whenever one of the descriptors returned by
+ * uvc_get_pollfds() becomes ready, typically from the same poll loop that
+ * waits on uvc_stream_get_fd().
+ *
+ * @param ctx UVC context
+ * @param external Nonzero to handle events externally
+ * @return UVC_ERROR_BUSY if devices are already open in this context
+ */
+uvc_error_t uvc_set_external_events(uvc_context_t *ctx, int external) {
+  if (ctx->open_devices)
+    return UVC_ERROR_BUSY;
+
+  ctx->external_events = external ? 1 : 0;
+  return UVC_SUCCESS;
+}
+
+/** @brief Handle pending USB events, waiting at most timeout_ms for one
+ * @ingroup init
+ *
+ * Completes transfers and so drives frame assembly for every stream in the
+ * context. Only needed with uvc_set_external_events() or a caller-provided
+ * USB context.
+ *
+ * @param ctx UVC context
+ * @param timeout_ms Maximum time to block; 0 handles what is ready and returns
+ */
+uvc_error_t uvc_handle_events_timeout(uvc_context_t *ctx, int timeout_ms) {
+  struct timeval tv;
+
+  tv.tv_sec = timeout_ms / 1000;
+  tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+  return libusb_handle_events_timeout_completed(ctx->usb_ctx, &tv, NULL);
+}
+
+/** @brief Get the file descriptors libusb needs watched
+ * @ingroup init
+ *
+ * @param ctx UVC context
+ * @return NULL-terminated list, to be freed with uvc_free_pollfds()
+ */
+const struct libusb_pollfd **uvc_get_pollfds(uvc_context_t *ctx) {
+  return libusb_get_pollfds(ctx->usb_ctx);
+}
+
+/** @brief Free a list returned by uvc_get_pollfds()
+ * @ingroup init
+ */
+void uvc_free_pollfds(const struct libusb_pollfd **pollfds) {
+  libusb_free_pollfds(pollfds);
+}
+
+/** @brief Be told when the set of descriptors from uvc_get_pollfds() changes
+ * @ingroup init
+ *
+ * @param ctx UVC context
+ * @param added_cb Called for every new descriptor, or NULL
+ * @param removed_cb Called for every descriptor no longer in use, or NULL
+ * @param user_data Passed to both callbacks
+ */
+void uvc_set_pollfd_notifiers(uvc_context_t *ctx,
+    uvc_pollfd_added_cb_t *added_cb,
+    uvc_pollfd_removed_cb_t *removed_cb,
+    void *user_data) {
+  libusb_set_pollfd_notifiers(ctx->usb_ctx, added_cb, removed_cb, user_data);
+}
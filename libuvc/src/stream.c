@@ -39,6 +39,12 @@
 #include "libuvc/libuvc.h"
 #include "libuvc/libuvc_internal.h"
 #include "errno.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #ifdef _MSC_VER
 
@@ -71,7 +77,9 @@ uvc_frame_desc_t *uvc_find_frame_desc_stream(uvc_stream_handle_t *strmh,
 uvc_frame_desc_t *uvc_find_frame_desc(uvc_device_handle_t *devh,
     uint16_t format_id, uint16_t frame_id);
 void *_uvc_user_caller(void *arg);
-void _uvc_populate_frame(uvc_stream_handle_t *strmh);
+void _uvc_populate_frame(uvc_stream_handle_t *strmh, struct uvc_frame_slot *slot);
+static void _uvc_frame_set_format(uvc_stream_handle_t *strmh, uvc_frame_t *frame);
+static void _uvc_clock_frame_time(uvc_stream_handle_t *strmh, struct timespec *ts);
 
 static uvc_streaming_interface_t *_uvc_get_stream_if(uvc_device_handle_t *devh, int interface_idx);
 static uvc_stream_handle_t *_uvc_get_stream_by_interface(uvc_device_handle_t *devh, int interface_idx);
@@ -652,38 +660,656 @@ uvc_error_t uvc_probe_still_ctrl(
 }
 
 /** @internal
- * @brief Swap the working buffer with the presented buffer and notify consumers
+ * @brief Default frame allocator: plain heap memory */
+static void *_uvc_heap_acquire(size_t size, void **handle, void *user_ptr) {
+  *handle = NULL;
+  return malloc(size);
+}
+
+static void _uvc_heap_release(void *data, void *handle, void *user_ptr) {
+  free(data);
+}
+
+static void *_uvc_heap_grow(void *data, size_t used, size_t new_size,
+                            void **handle, void *user_ptr) {
+  return realloc(data, new_size);
+}
+
+static const uvc_frame_allocator_t _uvc_heap_allocator = {
+  _uvc_heap_acquire, _uvc_heap_release, _uvc_heap_grow, NULL, NULL
+};
+
+/** @internal
+ * @brief Create a pool of frame buffers of the given size
+ * @param allocator Where buffer memory comes from, NULL for the heap
  */
-void _uvc_swap_buffers(uvc_stream_handle_t *strmh) {
-  uint8_t *tmp_buf;
+static struct uvc_frame_pool *_uvc_frame_pool_new(size_t buf_size,
+                                                  const uvc_frame_allocator_t *allocator) {
+  struct uvc_frame_pool *pool = calloc(1, sizeof(*pool));
 
-  pthread_mutex_lock(&strmh->cb_mutex);
+  if (!pool)
+    return NULL;
 
-  (void)clock_gettime(CLOCK_MONOTONIC, &strmh->capture_time_finished);
+  pthread_mutex_init(&pool->mutex, NULL);
+  pool->refcount = 1;
+  pool->buf_size = buf_size;
+  pool->alloc = allocator ? *allocator : _uvc_heap_allocator;
 
-  /* swap the buffers */
-  tmp_buf = strmh->holdbuf;
-  strmh->hold_bytes = strmh->got_bytes;
-  strmh->holdbuf = strmh->outbuf;
-  strmh->outbuf = tmp_buf;
-  strmh->hold_last_scr = strmh->last_scr;
-  strmh->hold_pts = strmh->pts;
-  strmh->hold_seq = strmh->seq;
-  
-  /* swap metadata buffer */
-  tmp_buf = strmh->meta_holdbuf;
-  strmh->meta_holdbuf = strmh->meta_outbuf;
-  strmh->meta_outbuf = tmp_buf;
-  strmh->meta_hold_bytes = strmh->meta_got_bytes;
+  return pool;
+}
 
-  pthread_cond_broadcast(&strmh->cb_cond);
-  pthread_mutex_unlock(&strmh->cb_mutex);
+/** @internal
+ * @brief Drop a reference on the pool, destroying it with the last one
+ * must be called with the pool mutex held; releases it
+ */
+static void _uvc_frame_pool_unref_locked(struct uvc_frame_pool *pool) {
+  int last = (--pool->refcount == 0);
+
+  pthread_mutex_unlock(&pool->mutex);
+
+  if (last) {
+    if (pool->alloc.destroy)
+      pool->alloc.destroy(pool->alloc.user_ptr);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+  }
+}
+
+/** @internal
+ * @brief Free a buffer and its memory; the caller drops its pool reference
+ */
+static void _uvc_frame_buffer_free(struct uvc_frame_buffer *buf) {
+  struct uvc_frame_pool *pool = buf->pool;
+
+  pool->alloc.release(buf->data, buf->handle, pool->alloc.user_ptr);
+  free(buf);
+}
+
+/** @internal
+ * @brief Take an idle buffer from the pool, allocating one if none is left
+ */
+static struct uvc_frame_buffer *_uvc_frame_pool_acquire(struct uvc_frame_pool *pool) {
+  struct uvc_frame_buffer *buf;
+
+  pthread_mutex_lock(&pool->mutex);
+
+  buf = pool->free_bufs;
+  if (buf) {
+    pool->free_bufs = buf->next;
+    pool->num_free--;
+    pthread_mutex_unlock(&pool->mutex);
+    buf->next = NULL;
+    return buf;
+  }
+
+  pool->refcount++;
+  pthread_mutex_unlock(&pool->mutex);
+
+  buf = calloc(1, sizeof(*buf));
+  if (buf)
+    buf->data = pool->alloc.acquire(pool->buf_size, &buf->handle, pool->alloc.user_ptr);
+
+  if (!buf || !buf->data) {
+    free(buf);
+    pthread_mutex_lock(&pool->mutex);
+    _uvc_frame_pool_unref_locked(pool);
+    return NULL;
+  }
+
+  buf->pool = pool;
+  buf->size = pool->buf_size;
+
+  return buf;
+}
+
+/** @internal
+ * @brief Give a buffer back to its pool, freeing it if the pool is full or closed
+ */
+static void _uvc_frame_pool_release(struct uvc_frame_buffer *buf) {
+  struct uvc_frame_pool *pool = buf->pool;
+
+  pthread_mutex_lock(&pool->mutex);
+
+  if (!pool->closed && pool->num_free < LIBUVC_FRAME_POOL_MAX_FREE) {
+    buf->next = pool->free_bufs;
+    pool->free_bufs = buf;
+    pool->num_free++;
+    pthread_mutex_unlock(&pool->mutex);
+    return;
+  }
+
+  pthread_mutex_unlock(&pool->mutex);
+  _uvc_frame_buffer_free(buf);
+
+  pthread_mutex_lock(&pool->mutex);
+  _uvc_frame_pool_unref_locked(pool);
+}
+
+/** @internal
+ * @brief Free the idle buffers and drop the stream's reference on the pool
+ *
+ * Buffers still borrowed by the consumer keep the pool alive until returned.
+ */
+static void _uvc_frame_pool_close(struct uvc_frame_pool *pool) {
+  struct uvc_frame_buffer *buf, *next;
+
+  pthread_mutex_lock(&pool->mutex);
+
+  pool->closed = 1;
+  buf = pool->free_bufs;
+  pool->free_bufs = NULL;
+  pool->num_free = 0;
+
+  pthread_mutex_unlock(&pool->mutex);
+
+  for (; buf; buf = next) {
+    next = buf->next;
+    _uvc_frame_buffer_free(buf);
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->refcount--;
+    pthread_mutex_unlock(&pool->mutex);
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  _uvc_frame_pool_unref_locked(pool);
+}
+
+/** @internal
+ * @brief Enlarge a buffer, keeping the first @a used bytes
+ * @return UVC_SUCCESS, or UVC_ERROR_NO_MEM if the buffer kept its old size
+ */
+static uvc_error_t _uvc_frame_buffer_grow(struct uvc_frame_buffer *buf,
+                                          size_t used, size_t new_size) {
+  struct uvc_frame_pool *pool = buf->pool;
+  void *handle = buf->handle;
+  uint8_t *data;
+
+  if (pool->alloc.grow) {
+    data = pool->alloc.grow(buf->data, used, new_size, &handle, pool->alloc.user_ptr);
+  } else {
+    data = pool->alloc.acquire(new_size, &handle, pool->alloc.user_ptr);
+    if (data) {
+      memcpy(data, buf->data, used);
+      pool->alloc.release(buf->data, buf->handle, pool->alloc.user_ptr);
+    }
+  }
+
+  if (!data)
+    return UVC_ERROR_NO_MEM;
+
+  buf->data = data;
+  buf->size = new_size;
+  buf->handle = handle;
+
+  return UVC_SUCCESS;
+}
+
+/** @internal
+ * @brief Open a wakeup channel
+ */
+static uvc_error_t _uvc_wakeup_init(struct uvc_wakeup *w) {
+#ifdef __linux__
+  w->read_fd = w->write_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (w->read_fd < 0)
+    return UVC_ERROR_OTHER;
+#else
+  int fds[2];
+
+  if (pipe(fds) < 0)
+    return UVC_ERROR_OTHER;
+
+  fcntl(fds[0], F_SETFL, O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, O_NONBLOCK);
+  fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+  fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+  w->read_fd = fds[0];
+  w->write_fd = fds[1];
+#endif
+
+  return UVC_SUCCESS;
+}
+
+static void _uvc_wakeup_close(struct uvc_wakeup *w) {
+  if (w->write_fd >= 0 && w->write_fd != w->read_fd)
+    close(w->write_fd);
+  if (w->read_fd >= 0)
+    close(w->read_fd);
+  w->read_fd = w->write_fd = -1;
+}
+
+static void _uvc_wakeup_signal(struct uvc_wakeup *w) {
+  uint64_t one = 1;
+
+  /* a full pipe is already signalled */
+  if (write(w->write_fd, &one, sizeof(one)) < 0)
+    return;
+}
+
+static void _uvc_wakeup_clear(struct uvc_wakeup *w) {
+  uint64_t buf[8];
+
+  while (read(w->read_fd, buf, sizeof(buf)) > 0)
+    ;
+}
+
+/** @internal
+ * @brief Sleep until the channel is signalled
+ * @param timeout_ms -1 to wait indefinitely
+ * @return >0 if signalled, 0 on timeout
+ */
+static int _uvc_wakeup_wait(struct uvc_wakeup *w, int timeout_ms) {
+  struct pollfd pfd;
+  int ret;
+
+  pfd.fd = w->read_fd;
+  pfd.events = POLLIN;
+  pfd.revents = 0;
+
+  do {
+    ret = poll(&pfd, 1, timeout_ms);
+  } while (ret < 0 && errno == EINTR);
+
+  if (ret > 0)
+    _uvc_wakeup_clear(w);
+
+  return ret;
+}
+
+/** @internal
+ * @brief Free a frame queue and give its buffers back to their pool
+ */
+static void _uvc_frame_queue_free(struct uvc_frame_slot *queue, uint32_t slots) {
+  uint32_t i;
+
+  for (i = 0; i < slots; i++) {
+    if (queue[i].buf)
+      _uvc_frame_pool_release(queue[i].buf);
+    free(queue[i].meta);
+  }
+
+  free(queue);
+}
+
+/** @internal
+ * @brief Number of slots backing a queue of @a depth frames, a power of two
+ */
+static uint32_t _uvc_frame_queue_slots(uint32_t depth) {
+  uint32_t slots = 1;
+
+  while (slots < depth + 1)
+    slots <<= 1;
+
+  return slots;
+}
+
+/** @internal
+ * @brief Allocate a frame queue whose slots hold buffers from @a pool
+ */
+static struct uvc_frame_slot *_uvc_frame_queue_new(struct uvc_frame_pool *pool, uint32_t slots) {
+  struct uvc_frame_slot *queue = calloc(slots, sizeof(*queue));
+  uint32_t i;
+
+  if (!queue)
+    return NULL;
+
+  for (i = 0; i < slots; i++) {
+    queue[i].buf = _uvc_frame_pool_acquire(pool);
+    queue[i].meta = malloc(LIBUVC_XFER_META_BUF_SIZE);
+    if (!queue[i].buf || !queue[i].meta) {
+      _uvc_frame_queue_free(queue, slots);
+      return NULL;
+    }
+  }
+
+  return queue;
+}
+
+/** @internal
+ * @brief Take the oldest frame off the queue
+ *
+ * The slot stays marked busy, and is left alone by the producer, until it is
+ * handed back with _uvc_frame_queue_release().
+ *
+ * @return The claimed slot, or NULL if the queue is empty
+ */
+static struct uvc_frame_slot *_uvc_frame_queue_claim(uvc_stream_handle_t *strmh) {
+  struct uvc_frame_slot *slot;
+  uint32_t head, tail;
+
+  do {
+    head = UVC_LOAD_ACQUIRE(&strmh->queue_head);
+    tail = UVC_LOAD_SEQ_CST(&strmh->queue_tail);
+    if (head == tail)
+      return NULL;
+
+    /* mark the slot before claiming it, so a producer that evicts past it
+     * afterwards can see it is still in use */
+    slot = &strmh->queue[head & strmh->queue_mask];
+    UVC_STORE_SEQ_CST(&slot->busy, 1);
+    if (UVC_CAS(&strmh->queue_head, &head, head + 1))
+      return slot;
+
+    /* the producer dropped this frame meanwhile */
+    UVC_STORE_RELEASE(&slot->busy, 0);
+  } while (1);
+}
+
+/** @internal
+ * @brief Give a claimed slot back to the producer
+ */
+static void _uvc_frame_queue_release(uvc_stream_handle_t *strmh,
+                                     struct uvc_frame_slot *slot) {
+  UVC_STORE_SEQ_CST(&slot->busy, 0);
+
+  if (UVC_LOAD_SEQ_CST(&strmh->producer_waiting))
+    _uvc_wakeup_signal(&strmh->queue_space);
+}
+
+/** @internal
+ * @brief Wait for a frame to be queued and claim it
+ *
+ * @param timeout_us >0: Wait at most N microseconds; 0: Wait indefinitely; -1: return immediately
+ * @return The claimed slot, or NULL on timeout, when the stream stops or
+ *         once the device is gone
+ */
+static struct uvc_frame_slot *_uvc_frame_queue_wait(uvc_stream_handle_t *strmh,
+                                                    int32_t timeout_us) {
+  struct uvc_frame_slot *slot;
+  struct timespec now, deadline;
+  int timeout_ms = -1;
+
+  /* an exported descriptor stays readable exactly while frames are queued:
+   * clear it before looking, every frame queued afterwards sets it again */
+  if (strmh->frame_fd_exported)
+    _uvc_wakeup_clear(&strmh->frame_ready);
+
+  slot = _uvc_frame_queue_claim(strmh);
+  if (slot || timeout_us == -1)
+    return slot;
+
+  if (timeout_us > 0) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_us / 1000000;
+    deadline.tv_nsec += (timeout_us % 1000000) * 1000;
+    deadline.tv_sec += deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+  }
+
+  /* announce the wait before looking at the queue again, so a frame
+   * published in between either is seen here or signals frame_ready */
+  UVC_STORE_SEQ_CST(&strmh->consumer_waiting, 1);
+
+  while (strmh->running) {
+    slot = _uvc_frame_queue_claim(strmh);
+    if (slot || UVC_LOAD_ACQUIRE(&strmh->device_lost))
+      break;
+
+    if (timeout_us > 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      timeout_ms = (deadline.tv_sec - now.tv_sec) * 1000 +
+                   (deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+      if (timeout_ms <= 0)
+        break;
+    }
+
+    _uvc_wakeup_wait(&strmh->frame_ready, timeout_ms);
+  }
+
+  UVC_STORE_SEQ_CST(&strmh->consumer_waiting, 0);
+
+  return slot;
+}
+
+/** @internal
+ * @brief Queue the working buffer for consumers and notify them
+ *
+ * Runs in the USB event thread and never waits on the consumer unless the
+ * stream's overflow policy asks for it. When the queue is full the policy
+ * decides which frame is lost; every loss is counted in frames_dropped.
+ */
+static void _uvc_queue_frame(uvc_stream_handle_t *strmh) {
+  struct uvc_frame_slot *slot = NULL;
+  struct uvc_frame_buffer *tmp_buf;
+  uint8_t *tmp_meta;
+  uint32_t tail = strmh->queue_tail;
+  uint32_t head = UVC_LOAD_ACQUIRE(&strmh->queue_head);
+
+  if (tail - head >= strmh->queue_depth) {
+    switch (strmh->overflow_policy) {
+    case UVC_FRAME_OVERFLOW_BLOCK:
+      UVC_STORE_SEQ_CST(&strmh->producer_waiting, 1);
+      while (strmh->running) {
+        head = UVC_LOAD_SEQ_CST(&strmh->queue_head);
+        if (tail - head < strmh->queue_depth)
+          break;
+        _uvc_wakeup_wait(&strmh->queue_space, -1);
+      }
+      UVC_STORE_SEQ_CST(&strmh->producer_waiting, 0);
+      break;
+    case UVC_FRAME_OVERFLOW_DROP_OLDEST:
+      /* evict the oldest frame, unless the consumer just took it */
+      if (UVC_CAS(&strmh->queue_head, &head, head + 1)) {
+        UVC_DEBUG("frame queue full, dropping frame %u",
+                  strmh->queue[head & strmh->queue_mask].seq);
+        UVC_ATOMIC_INC(&strmh->frames_dropped);
+      }
+      break;
+    default:
+      break;
+    }
+
+    head = UVC_LOAD_ACQUIRE(&strmh->queue_head);
+  }
+
+  if (tail - head < strmh->queue_depth) {
+    slot = &strmh->queue[tail & strmh->queue_mask];
+    /* after evictions the consumer may still be reading this slot */
+    if (UVC_LOAD_ACQUIRE(&slot->busy))
+      slot = NULL;
+  }
+
+  if (slot) {
+    (void)clock_gettime(CLOCK_MONOTONIC, &slot->capture_time_finished);
+    _uvc_clock_frame_time(strmh, &slot->capture_time_device);
+    slot->capture_time_started.tv_sec = strmh->frame_start_ns / 1000000000;
+    slot->capture_time_started.tv_nsec = strmh->frame_start_ns % 1000000000;
+
+    /* swap the buffers */
+    tmp_buf = slot->buf;
+    slot->buf = strmh->outbuf;
+    strmh->outbuf = tmp_buf;
+    slot->bytes = strmh->got_bytes;
+    slot->last_scr = strmh->last_scr;
+    slot->last_sof = strmh->last_sof;
+    slot->pts = strmh->pts;
+    slot->packet_errors = strmh->packet_errors;
+    slot->seq = strmh->seq;
+
+    /* swap metadata buffer */
+    tmp_meta = slot->meta;
+    slot->meta = strmh->meta_outbuf;
+    strmh->meta_outbuf = tmp_meta;
+    slot->meta_bytes = strmh->meta_got_bytes;
+
+    UVC_STORE_SEQ_CST(&strmh->queue_tail, tail + 1);
+
+    /* only pay for a wakeup when the consumer is idle, or when it polls
+     * the descriptor from uvc_stream_get_fd() */
+    if (strmh->frame_fd_exported || UVC_LOAD_SEQ_CST(&strmh->consumer_waiting))
+      _uvc_wakeup_signal(&strmh->frame_ready);
+  } else {
+    UVC_DEBUG("frame queue full, dropping frame %u", strmh->seq);
+    UVC_ATOMIC_INC(&strmh->frames_dropped);
+  }
+}
+
+/** @internal
+ * @brief Hand the working buffer straight to the user callback
+ *
+ * Used by streams started with UVC_STREAM_DIRECT_DISPATCH, in place of the
+ * frame queue and the callback thread. The callback may borrow the buffer;
+ * a spare is kept ready so assembly carries on without waiting for it.
+ */
+static void _uvc_dispatch_frame(uvc_stream_handle_t *strmh) {
+  uvc_frame_t *frame = &strmh->frame;
+
+  _uvc_frame_set_format(strmh, frame);
+  frame->sequence = strmh->seq;
+  (void)clock_gettime(CLOCK_MONOTONIC, &frame->capture_time_finished);
+  _uvc_clock_frame_time(strmh, &frame->capture_time_device);
+  frame->capture_time_started.tv_sec = strmh->frame_start_ns / 1000000000;
+  frame->capture_time_started.tv_nsec = strmh->frame_start_ns % 1000000000;
+  frame->pts = strmh->pts;
+  frame->scr = strmh->last_scr;
+  frame->scr_sof = strmh->last_sof;
+  frame->packet_errors = strmh->packet_errors;
+
+  if (!strmh->spare_buf)
+    strmh->spare_buf = _uvc_frame_pool_acquire(strmh->frame_pool);
+
+  frame->data = strmh->outbuf->data;
+  frame->data_bytes = strmh->got_bytes;
+  frame->library_owns_data = 0;
+  /* without a spare the buffer cannot be given away */
+  frame->stream_buf = strmh->spare_buf ? strmh->outbuf : NULL;
+
+  if (strmh->meta_got_bytes > 0)
+  {
+      if (frame->metadata_bytes < strmh->meta_got_bytes)
+      {
+          frame->metadata = realloc(frame->metadata, strmh->meta_got_bytes);
+      }
+      frame->metadata_bytes = strmh->meta_got_bytes;
+      memcpy(frame->metadata, strmh->meta_outbuf, frame->metadata_bytes);
+  }
+
+  strmh->user_cb(frame, strmh->user_ptr);
+
+  if (strmh->spare_buf && !frame->stream_buf) {
+    /* borrowed by the callback */
+    strmh->outbuf = strmh->spare_buf;
+    strmh->spare_buf = NULL;
+  }
+
+  frame->stream_buf = NULL;
+  frame->data = NULL;
+  frame->data_bytes = 0;
+}
+
+/** @internal
+ * @brief Record the SCR of the frame just completed for clock recovery
+ *
+ * The STC and SOF counters are unwrapped against the previous sample. The
+ * SOF counter wraps every 2048 ms, so after a longer gap the ring restarts.
+ */
+static void _uvc_clock_add_sample(uvc_stream_handle_t *strmh) {
+  struct uvc_clock *clock = &strmh->clock;
+  struct uvc_clock_sample *prev, *sample;
+
+  if (!strmh->last_scr)
+    return;
+
+  prev = &clock->samples[(clock->head + LIBUVC_CLOCK_SAMPLES - 1) % LIBUVC_CLOCK_SAMPLES];
+
+  if (clock->count > 0) {
+    /* devices repeat the SCR of the first packet in every header */
+    if (strmh->last_scr == clock->last_stc)
+      return;
+    if (strmh->scr_time_ns - prev->host_ns > 1000000000LL)
+      clock->count = 0;
+  }
+
+  sample = &clock->samples[clock->head];
+  if (clock->count > 0) {
+    sample->stc = prev->stc + (uint32_t)(strmh->last_scr - clock->last_stc);
+    sample->sof = prev->sof + ((strmh->last_sof - clock->last_sof) & 0x7ff);
+  } else {
+    sample->stc = strmh->last_scr;
+    sample->sof = strmh->last_sof;
+  }
+  sample->host_ns = strmh->scr_time_ns;
+
+  clock->last_stc = strmh->last_scr;
+  clock->last_sof = strmh->last_sof;
+  clock->head = (clock->head + 1) % LIBUVC_CLOCK_SAMPLES;
+  if (clock->count < LIBUVC_CLOCK_SAMPLES)
+    clock->count++;
+}
+
+/** @internal
+ * @brief Convert the PTS of the frame just completed into host time
+ *
+ * Each SCR pairs the device clock with the SOF it was sampled at, so the
+ * device clock is first mapped onto USB frames, exactly. The host time of
+ * a USB frame is its arrival time minus the transfer delay; taking the
+ * smallest arrival offset over the sample ring removes USB scheduling and
+ * thread wakeup jitter from it.
+ *
+ * @param[out] ts Host time, or zero if it cannot be recovered
+ */
+static void _uvc_clock_frame_time(uvc_stream_handle_t *strmh, struct timespec *ts) {
+  struct uvc_clock *clock = &strmh->clock;
+  uint32_t freq = strmh->cur_ctrl.dwClockFrequency;
+  const struct uvc_clock_sample *first, *last;
+  int64_t offset = INT64_MAX;
+  int64_t pts, host_ns;
+  double ns_per_tick, rate;
+  unsigned int i;
+
+  ts->tv_sec = 0;
+  ts->tv_nsec = 0;
+
+  if (!strmh->pts || !freq || clock->count < 2)
+    return;
+
+  first = &clock->samples[(clock->head + LIBUVC_CLOCK_SAMPLES - clock->count) % LIBUVC_CLOCK_SAMPLES];
+  last = &clock->samples[(clock->head + LIBUVC_CLOCK_SAMPLES - 1) % LIBUVC_CLOCK_SAMPLES];
+  if (last->stc == first->stc)
+    return;
+
+  for (i = 0; i < clock->count; i++) {
+    const struct uvc_clock_sample *s =
+        &clock->samples[(clock->head + LIBUVC_CLOCK_SAMPLES - clock->count + i) % LIBUVC_CLOCK_SAMPLES];
+    if (s->host_ns - (int64_t)s->sof * 1000000 < offset)
+      offset = s->host_ns - (int64_t)s->sof * 1000000;
+  }
+
+  /* a device clock running more than 1% off its declared frequency means
+   * the SCRs are not usable */
+  ns_per_tick = (double)(last->sof - first->sof) * 1e6 / (double)(last->stc - first->stc);
+  rate = ns_per_tick * freq / 1e9;
+  if (rate < 0.99 || rate > 1.01) {
+    UVC_DEBUG("device clock rate %f off nominal, no device timestamps", rate);
+    return;
+  }
+
+  pts = (int64_t)last->stc + (int32_t)(strmh->pts - (uint32_t)last->stc);
+  host_ns = (int64_t)last->sof * 1000000 + offset +
+            (int64_t)((double)(pts - (int64_t)last->stc) * ns_per_tick);
+
+  ts->tv_sec = host_ns / 1000000000;
+  ts->tv_nsec = host_ns % 1000000000;
+}
+
+/** @internal
+ * @brief Pass the completed working buffer on and start the next frame
+ */
+void _uvc_swap_buffers(uvc_stream_handle_t *strmh) {
+  _uvc_clock_add_sample(strmh);
+
+  if (strmh->direct_dispatch)
+    _uvc_dispatch_frame(strmh);
+  else
+    _uvc_queue_frame(strmh);
 
   strmh->seq++;
   strmh->got_bytes = 0;
   strmh->meta_got_bytes = 0;
   strmh->last_scr = 0;
+  strmh->last_sof = 0;
   strmh->pts = 0;
+  strmh->packet_errors = 0;
 }
 
 /** @internal
@@ -730,6 +1356,7 @@ void _uvc_process_payload(uvc_stream_handle_t *strmh, uint8_t *payload, size_t p
 
     if (header_len > payload_len) {
       UVC_DEBUG("bogus packet: actual_len=%zd, header_len=%zd\n", payload_len, header_len);
+      strmh->packet_errors++;
       return;
     }
 
@@ -749,6 +1376,7 @@ void _uvc_process_payload(uvc_stream_handle_t *strmh, uint8_t *payload, size_t p
 
     if (header_info & 0x40) {
       UVC_DEBUG("bad packet: error bit set");
+      strmh->packet_errors++;
       return;
     }
 
@@ -767,8 +1395,9 @@ void _uvc_process_payload(uvc_stream_handle_t *strmh, uint8_t *payload, size_t p
     }
 
     if (header_info & (1 << 3)) {
-      /** @todo read the SOF token counter */
       strmh->last_scr = DW_TO_INT(payload + variable_offset);
+      strmh->last_sof = SW_TO_SHORT(payload + variable_offset + 4) & 0x7ff;
+      strmh->scr_time_ns = strmh->payload_time_ns;
       variable_offset += 6;
     }
 
@@ -783,9 +1412,21 @@ void _uvc_process_payload(uvc_stream_handle_t *strmh, uint8_t *payload, size_t p
   }
 
   if (data_len > 0) {
-    if (strmh->got_bytes + data_len > strmh->cur_ctrl.dwMaxVideoFrameSize)
-      data_len = strmh->cur_ctrl.dwMaxVideoFrameSize - strmh->got_bytes; /* Avoid overflow. */
-    memcpy(strmh->outbuf + strmh->got_bytes, payload + header_len, data_len);
+    if (strmh->got_bytes == 0)
+      strmh->frame_start_ns = strmh->payload_time_ns;
+    if (strmh->got_bytes + data_len > strmh->outbuf->size) {
+      /* Buffers from an allocator may start out smaller than the largest frame */
+      size_t new_size = strmh->outbuf->size * 2;
+      if (new_size < strmh->got_bytes + data_len)
+        new_size = strmh->got_bytes + data_len;
+      if (new_size > strmh->cur_ctrl.dwMaxVideoFrameSize)
+        new_size = strmh->cur_ctrl.dwMaxVideoFrameSize;
+      if (new_size > strmh->outbuf->size)
+        _uvc_frame_buffer_grow(strmh->outbuf, strmh->got_bytes, new_size);
+    }
+    if (strmh->got_bytes + data_len > strmh->outbuf->size)
+      data_len = strmh->outbuf->size - strmh->got_bytes; /* Avoid overflow. */
+    memcpy(strmh->outbuf->data + strmh->got_bytes, payload + header_len, data_len);
     strmh->got_bytes += data_len;
     if (header_info & (1 << 1) || strmh->got_bytes == strmh->cur_ctrl.dwMaxVideoFrameSize) {
       /* The EOF bit is set, so publish the complete frame */
@@ -794,6 +1435,21 @@ void _uvc_process_payload(uvc_stream_handle_t *strmh, uint8_t *payload, size_t p
   }
 }
 
+/** @internal
+ * @brief Note that the device has gone away
+ *
+ * The transfers die with it and no further frames will come; wake anyone
+ * waiting for one so they can find out from uvc_stream_get_status().
+ */
+static void _uvc_stream_lost(uvc_stream_handle_t *strmh) {
+  if (UVC_LOAD_ACQUIRE(&strmh->device_lost))
+    return;
+
+  UVC_DEBUG("device lost");
+  UVC_STORE_RELEASE(&strmh->device_lost, 1);
+  _uvc_wakeup_signal(&strmh->frame_ready);
+}
+
 /** @internal
  * @brief Stream transfer callback
  *
@@ -804,13 +1460,19 @@ void _uvc_process_payload(uvc_stream_handle_t *strmh, uint8_t *payload, size_t p
  */
 void LIBUSB_CALL _uvc_stream_callback(struct libusb_transfer *transfer) {
   uvc_stream_handle_t *strmh = transfer->user_data;
+  struct timespec now;
+  int64_t now_ns;
 
   int resubmit = 1;
 
   switch (transfer->status) {
   case LIBUSB_TRANSFER_COMPLETED:
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    now_ns = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+
     if (transfer->num_iso_packets == 0) {
       /* This is a bulk mode transfer, so it just has one payload transfer */
+      strmh->payload_time_ns = now_ns;
       _uvc_process_payload(strmh, transfer->buffer, transfer->actual_length);
     } else {
       /* This is an isochronous mode transfer, so each packet has a payload transfer */
@@ -824,11 +1486,15 @@ void LIBUSB_CALL _uvc_stream_callback(struct libusb_transfer *transfer) {
 
         if (pkt->status != 0) {
           UVC_DEBUG("bad packet (isochronous transfer); status: %d", pkt->status);
+          strmh->packet_errors++;
           continue;
         }
 
         pktbuf = libusb_get_iso_packet_buffer_simple(transfer, packet_id);
 
+        /* earlier packets of the transfer arrived one interval apart */
+        strmh->payload_time_ns = now_ns - strmh->packet_interval_ns *
+            (transfer->num_iso_packets - 1 - packet_id);
         _uvc_process_payload(strmh, pktbuf, pkt->actual_length);
 
       }
@@ -839,10 +1505,12 @@ void LIBUSB_CALL _uvc_stream_callback(struct libusb_transfer *transfer) {
   case LIBUSB_TRANSFER_NO_DEVICE: {
     int i;
     UVC_DEBUG("not retrying transfer, status = %d", transfer->status);
+    if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE)
+      _uvc_stream_lost(strmh);
     pthread_mutex_lock(&strmh->cb_mutex);
 
     /* Mark transfer as deleted. */
-    for(i=0; i < LIBUVC_NUM_TRANSFER_BUFS; i++) {
+    for(i=0; i < strmh->num_transfer_bufs; i++) {
       if(strmh->transfers[i] == transfer) {
         UVC_DEBUG("Freeing transfer %d (%p)", i, transfer);
         free(transfer->buffer);
@@ -851,7 +1519,7 @@ void LIBUSB_CALL _uvc_stream_callback(struct libusb_transfer *transfer) {
         break;
       }
     }
-    if(i == LIBUVC_NUM_TRANSFER_BUFS ) {
+    if(i == strmh->num_transfer_bufs ) {
       UVC_DEBUG("transfer %p not found; not freeing!", transfer);
     }
 
@@ -875,10 +1543,12 @@ void LIBUSB_CALL _uvc_stream_callback(struct libusb_transfer *transfer) {
       if (libusbRet < 0)
       {
         int i;
+        if (libusbRet == LIBUSB_ERROR_NO_DEVICE)
+          _uvc_stream_lost(strmh);
         pthread_mutex_lock(&strmh->cb_mutex);
 
         /* Mark transfer as deleted. */
-        for (i = 0; i < LIBUVC_NUM_TRANSFER_BUFS; i++) {
+        for (i = 0; i < strmh->num_transfer_bufs; i++) {
           if (strmh->transfers[i] == transfer) {
             UVC_DEBUG("Freeing failed transfer %d (%p)", i, transfer);
             free(transfer->buffer);
@@ -887,7 +1557,7 @@ void LIBUSB_CALL _uvc_stream_callback(struct libusb_transfer *transfer) {
             break;
           }
         }
-        if (i == LIBUVC_NUM_TRANSFER_BUFS) {
+        if (i == strmh->num_transfer_bufs) {
           UVC_DEBUG("failed transfer %p not found; not freeing!", transfer);
         }
 
@@ -899,7 +1569,7 @@ void LIBUSB_CALL _uvc_stream_callback(struct libusb_transfer *transfer) {
       pthread_mutex_lock(&strmh->cb_mutex);
 
       /* Mark transfer as deleted. */
-      for(i=0; i < LIBUVC_NUM_TRANSFER_BUFS; i++) {
+      for(i=0; i < strmh->num_transfer_bufs; i++) {
         if(strmh->transfers[i] == transfer) {
           UVC_DEBUG("Freeing orphan transfer %d (%p)", i, transfer);
           free(transfer->buffer);
@@ -908,7 +1578,7 @@ void LIBUSB_CALL _uvc_stream_callback(struct libusb_transfer *transfer) {
           break;
         }
       }
-      if(i == LIBUVC_NUM_TRANSFER_BUFS ) {
+      if(i == strmh->num_transfer_bufs ) {
         UVC_DEBUG("orphan transfer %p not found; not freeing!", transfer);
       }
 
@@ -1021,14 +1691,21 @@ uvc_error_t uvc_stream_open_ctrl(uvc_device_handle_t *devh, uvc_stream_handle_t
     goto fail;
   }
 
-  strmh = calloc(1, sizeof(*strmh));
-  if (!strmh) {
+  /* keep the producer and consumer ends of the frame queue on their own
+   * cache lines */
+  if (posix_memalign((void **) &strmh, LIBUVC_CACHELINE_SIZE, sizeof(*strmh))) {
+    strmh = NULL;
     ret = UVC_ERROR_NO_MEM;
     goto fail;
   }
+  memset(strmh, 0, sizeof(*strmh));
+  strmh->frame_ready.read_fd = strmh->frame_ready.write_fd = -1;
+  strmh->queue_space.read_fd = strmh->queue_space.write_fd = -1;
   strmh->devh = devh;
   strmh->stream_if = stream_if;
   strmh->frame.library_owns_data = 1;
+  strmh->req_transfer_bufs = LIBUVC_NUM_TRANSFER_BUFS;
+  strmh->req_packets_per_transfer = LIBUVC_ISO_PACKETS_PER_TRANSFER;
 
   ret = uvc_claim_if(strmh->devh, strmh->stream_if->bInterfaceNumber);
   if (ret != UVC_SUCCESS)
@@ -1041,11 +1718,31 @@ uvc_error_t uvc_stream_open_ctrl(uvc_device_handle_t *devh, uvc_stream_handle_t
   // Set up the streaming status and data space
   strmh->running = 0;
 
-  strmh->outbuf = malloc( ctrl->dwMaxVideoFrameSize );
-  strmh->holdbuf = malloc( ctrl->dwMaxVideoFrameSize );
+  strmh->frame_pool = _uvc_frame_pool_new( ctrl->dwMaxVideoFrameSize, NULL );
+  if (!strmh->frame_pool) {
+    ret = UVC_ERROR_NO_MEM;
+    goto fail;
+  }
+
+  strmh->queue_depth = LIBUVC_FRAME_QUEUE_DEPTH;
+  strmh->queue_mask = _uvc_frame_queue_slots(strmh->queue_depth) - 1;
+  strmh->overflow_policy = UVC_FRAME_OVERFLOW_DROP_OLDEST;
+
+  strmh->outbuf = _uvc_frame_pool_acquire( strmh->frame_pool );
+  strmh->queue = _uvc_frame_queue_new( strmh->frame_pool, strmh->queue_mask + 1 );
+  if (!strmh->outbuf || !strmh->queue) {
+    ret = UVC_ERROR_NO_MEM;
+    goto fail;
+  }
+
+  ret = _uvc_wakeup_init(&strmh->frame_ready);
+  if (ret != UVC_SUCCESS)
+    goto fail;
+  ret = _uvc_wakeup_init(&strmh->queue_space);
+  if (ret != UVC_SUCCESS)
+    goto fail;
 
   strmh->meta_outbuf = malloc( LIBUVC_XFER_META_BUF_SIZE );
-  strmh->meta_holdbuf = malloc( LIBUVC_XFER_META_BUF_SIZE );
    
   pthread_mutex_init(&strmh->cb_mutex, NULL);
   pthread_cond_init(&strmh->cb_cond, NULL);
@@ -1058,19 +1755,339 @@ uvc_error_t uvc_stream_open_ctrl(uvc_device_handle_t *devh, uvc_stream_handle_t
   return UVC_SUCCESS;
 
 fail:
-  if(strmh)
+  if(strmh) {
+    if (strmh->outbuf)
+      _uvc_frame_pool_release(strmh->outbuf);
+    if (strmh->queue)
+      _uvc_frame_queue_free(strmh->queue, strmh->queue_mask + 1);
+    if (strmh->frame_pool)
+      _uvc_frame_pool_close(strmh->frame_pool);
+    _uvc_wakeup_close(&strmh->frame_ready);
+    _uvc_wakeup_close(&strmh->queue_space);
     free(strmh);
+  }
   UVC_EXIT(ret);
   return ret;
 }
 
+/** @brief Assemble frames in memory supplied by the caller
+ * @ingroup streaming
+ *
+ * Replaces the heap buffers the stream assembles frames into. Payload data
+ * is written straight into buffers from @a allocator, which reach the frame
+ * callback (and uvc_frame_borrow()) without a copy. Idle buffers are kept by
+ * the stream for reuse, so the allocator is only called while the stream
+ * warms up or when the consumer holds on to many frames.
+ *
+ * @param strmh UVC stream, must not be running
+ * @param allocator Allocator hooks, copied; NULL restores heap allocation
+ * @param buf_size Initial buffer size, or 0 for dwMaxVideoFrameSize. Smaller
+ *        buffers are grown while a frame is assembled if needed.
+ * @return UVC_SUCCESS, after which the stream owns @a allocator's user_ptr
+ *         until it calls destroy; on any error destroy is never called and
+ *         user_ptr stays with the caller
+ */
+uvc_error_t uvc_stream_set_frame_allocator(uvc_stream_handle_t *strmh,
+                                           const uvc_frame_allocator_t *allocator,
+                                           size_t buf_size) {
+  struct uvc_frame_pool *pool;
+  struct uvc_frame_buffer *outbuf;
+  struct uvc_frame_slot *queue;
+
+  if (strmh->running)
+    return UVC_ERROR_BUSY;
+
+  if (allocator && (!allocator->acquire || !allocator->release))
+    return UVC_ERROR_INVALID_PARAM;
+
+  if (buf_size == 0 || buf_size > strmh->cur_ctrl.dwMaxVideoFrameSize)
+    buf_size = strmh->cur_ctrl.dwMaxVideoFrameSize;
+
+  pool = _uvc_frame_pool_new(buf_size, allocator);
+  if (!pool)
+    return UVC_ERROR_NO_MEM;
+
+  outbuf = _uvc_frame_pool_acquire(pool);
+  queue = _uvc_frame_queue_new(pool, strmh->queue_mask + 1);
+  if (!outbuf || !queue) {
+    if (outbuf)
+      _uvc_frame_pool_release(outbuf);
+    if (queue)
+      _uvc_frame_queue_free(queue, strmh->queue_mask + 1);
+    /* user_ptr is still the caller's */
+    pool->alloc.destroy = NULL;
+    _uvc_frame_pool_close(pool);
+    return UVC_ERROR_NO_MEM;
+  }
+
+  _uvc_frame_pool_release(strmh->outbuf);
+  if (strmh->spare_buf) {
+    _uvc_frame_pool_release(strmh->spare_buf);
+    strmh->spare_buf = NULL;
+  }
+  _uvc_frame_queue_free(strmh->queue, strmh->queue_mask + 1);
+  _uvc_frame_pool_close(strmh->frame_pool);
+
+  strmh->frame_pool = pool;
+  strmh->outbuf = outbuf;
+  strmh->queue = queue;
+  strmh->queue_head = 0;
+  strmh->queue_tail = 0;
+  strmh->got_bytes = 0;
+
+  return UVC_SUCCESS;
+}
+
+/** @brief Set how many completed frames a stream queues for its consumer
+ * @ingroup streaming
+ *
+ * Frames wait in the queue while the callback thread (or the caller of
+ * uvc_stream_get_frame()) is busy, so short stalls in the consumer cost
+ * latency instead of frames. When the queue is full, @a policy picks the
+ * frame to lose, or holds up USB processing until there is room; the count
+ * of lost frames is available from uvc_stream_get_dropped_frames().
+ *
+ * @param strmh UVC stream, must not be running
+ * @param depth Frames queued, at least 1
+ * @param policy What to do with a completed frame when the queue is full
+ */
+uvc_error_t uvc_stream_set_frame_queue(uvc_stream_handle_t *strmh,
+                                       int depth,
+                                       uvc_frame_overflow_policy_t policy) {
+  struct uvc_frame_slot *queue;
+  uint32_t slots;
+
+  if (strmh->running)
+    return UVC_ERROR_BUSY;
+
+  if (depth < 1 || policy < UVC_FRAME_OVERFLOW_DROP_NEWEST ||
+      policy > UVC_FRAME_OVERFLOW_BLOCK)
+    return UVC_ERROR_INVALID_PARAM;
+
+  slots = _uvc_frame_queue_slots(depth);
+  if (slots != strmh->queue_mask + 1) {
+    queue = _uvc_frame_queue_new(strmh->frame_pool, slots);
+    if (!queue)
+      return UVC_ERROR_NO_MEM;
+
+    _uvc_frame_queue_free(strmh->queue, strmh->queue_mask + 1);
+    strmh->queue = queue;
+    strmh->queue_mask = slots - 1;
+  }
+
+  strmh->queue_depth = depth;
+  strmh->queue_head = 0;
+  strmh->queue_tail = 0;
+
+  strmh->overflow_policy = policy;
+
+  return UVC_SUCCESS;
+}
+
+/** @brief Get the number of frames lost to a full frame queue
+ * @ingroup streaming
+ *
+ * Counts frames discarded since the stream was opened. Gaps also show up
+ * in uvc_frame_t::sequence.
+ *
+ * @param strmh UVC stream
+ */
+uint32_t uvc_stream_get_dropped_frames(uvc_stream_handle_t *strmh) {
+  return UVC_LOAD_ACQUIRE(&strmh->frames_dropped);
+}
+
+/** @brief Check whether a running stream can still deliver frames
+ * @ingroup streaming
+ *
+ * Once the device is unplugged (or drops off the bus) its transfers fail
+ * and the stream goes quiet without stopping. Poll this while no frames
+ * arrive; the stream then has to be closed and the device reopened.
+ *
+ * @param strmh UVC stream
+ * @return UVC_SUCCESS, or UVC_ERROR_NO_DEVICE once the device is gone
+ */
+uvc_error_t uvc_stream_get_status(uvc_stream_handle_t *strmh) {
+  return UVC_LOAD_ACQUIRE(&strmh->device_lost) ? UVC_ERROR_NO_DEVICE : UVC_SUCCESS;
+}
+
+/** @brief Get the number the next completed frame will carry
+ * @ingroup streaming
+ *
+ * Changes whenever a frame completes, including frames later lost to a
+ * full queue, so a watchdog can tell a silent device from a slow consumer.
+ * Starts over at 1 with every uvc_stream_start().
+ *
+ * @param strmh UVC stream
+ */
+uint32_t uvc_stream_get_sequence(uvc_stream_handle_t *strmh) {
+  return UVC_LOAD_ACQUIRE(&strmh->seq);
+}
+
+/** @brief Try to revive a stream that stopped delivering frames
+ * @ingroup streaming
+ *
+ * Devices can wedge without going away: transfers keep timing out, or the
+ * endpoint halts. Stop the stream, call this with the mildest level not
+ * tried yet, and start the stream again. UVC_STREAM_RESET_DEVICE may make
+ * the device re-enumerate, in which case it has to be reopened.
+ *
+ * @param strmh UVC stream, must not be running
+ * @param level What to reset
+ * @return UVC_SUCCESS, UVC_ERROR_NO_DEVICE if the device has to be reopened,
+ *         or another error if the reset failed
+ */
+uvc_error_t uvc_stream_reset(uvc_stream_handle_t *strmh, uvc_stream_reset_level_t level) {
+  libusb_device_handle *usb_devh = strmh->devh->usb_devh;
+  uvc_stream_ctrl_t ctrl;
+  int ret;
+
+  if (strmh->running)
+    return UVC_ERROR_BUSY;
+
+  switch (level) {
+  case UVC_STREAM_RESET_TRANSFERS:
+    return UVC_SUCCESS;
+  case UVC_STREAM_RESET_CLEAR_HALT:
+    ret = libusb_clear_halt(usb_devh, strmh->stream_if->bEndpointAddress);
+    UVC_DEBUG("clear halt: %d", ret);
+    return ret < 0 ? (uvc_error_t)ret : UVC_SUCCESS;
+  case UVC_STREAM_RESET_DEVICE:
+    ret = libusb_reset_device(usb_devh);
+    UVC_DEBUG("device reset: %d", ret);
+    if (ret == LIBUSB_ERROR_NOT_FOUND || ret == LIBUSB_ERROR_NO_DEVICE)
+      return UVC_ERROR_NO_DEVICE;
+    if (ret < 0)
+      return (uvc_error_t)ret;
+    /* the device forgot its stream settings; libusb kept the interface claims */
+    /* fall through */
+  case UVC_STREAM_RESET_COMMIT:
+    ret = libusb_set_interface_alt_setting(usb_devh, strmh->stream_if->bInterfaceNumber, 0);
+    UVC_DEBUG("alt setting 0: %d", ret);
+    if (ret == LIBUSB_ERROR_NO_DEVICE)
+      return UVC_ERROR_NO_DEVICE;
+    ctrl = strmh->cur_ctrl;
+    return uvc_stream_ctrl(strmh, &ctrl);
+  }
+
+  return UVC_ERROR_INVALID_PARAM;
+}
+
+/** @brief Size the USB transfer ring of a stream
+ * @ingroup streaming
+ *
+ * More transfers ride out longer scheduling delays on busy hosts at the cost
+ * of memory: each one holds dwMaxPayloadTransferSize bytes on bulk
+ * endpoints, or @a packets_per_transfer packets on isochronous ones. Takes
+ * effect on the next uvc_stream_start().
+ *
+ * @param strmh UVC stream, must not be running
+ * @param num_transfers Transfers kept in flight, or 0 to derive the count
+ *        from the negotiated bitrate, buffering LIBUVC_TRANSFER_BUFFER_MS
+ *        worth of data
+ * @param packets_per_transfer Upper bound on packets per isochronous
+ *        transfer, or 0 for the default
+ * @param max_bytes Upper bound on the memory held by the ring, or 0 for no
+ *        limit. The ring never shrinks below LIBUVC_MIN_TRANSFER_BUFS.
+ */
+uvc_error_t uvc_stream_set_transfer_config(uvc_stream_handle_t *strmh,
+                                           int num_transfers,
+                                           int packets_per_transfer,
+                                           size_t max_bytes) {
+  if (strmh->running)
+    return UVC_ERROR_BUSY;
+
+  if (num_transfers < 0 || packets_per_transfer < 0)
+    return UVC_ERROR_INVALID_PARAM;
+
+  strmh->req_transfer_bufs = num_transfers;
+  strmh->req_packets_per_transfer = packets_per_transfer > 0 ?
+    packets_per_transfer : LIBUVC_ISO_PACKETS_PER_TRANSFER;
+  strmh->max_transfer_mem = max_bytes;
+
+  return UVC_SUCCESS;
+}
+
+/** @brief Get the shape of the transfer ring of a running stream
+ * @ingroup streaming
+ *
+ * @param strmh UVC stream
+ * @param[out] num_transfers Transfers allocated by the last uvc_stream_start()
+ * @param[out] transfer_size Bytes per transfer
+ */
+void uvc_stream_get_transfer_config(uvc_stream_handle_t *strmh,
+                                    int *num_transfers,
+                                    size_t *transfer_size) {
+  if (num_transfers)
+    *num_transfers = strmh->num_transfer_bufs;
+  if (transfer_size)
+    *transfer_size = strmh->transfer_size;
+}
+
+/** @internal
+ * @brief Work out the transfer count for a stream and allocate the ring
+ *
+ * @param frame_desc Negotiated frame descriptor, used for the bitrate
+ * @param transfer_size Bytes per transfer
+ */
+static uvc_error_t _uvc_stream_alloc_transfers(uvc_stream_handle_t *strmh,
+                                               uvc_frame_desc_t *frame_desc,
+                                               size_t transfer_size) {
+  size_t count = strmh->req_transfer_bufs;
+
+  if (count == 0) {
+    /* Enough transfers to hold LIBUVC_TRANSFER_BUFFER_MS of video at the
+     * highest rate the format may produce */
+    uint64_t bytes_per_sec = frame_desc->dwMaxBitRate / 8;
+
+    if (bytes_per_sec == 0 && strmh->cur_ctrl.dwFrameInterval)
+      bytes_per_sec = (uint64_t) strmh->cur_ctrl.dwMaxVideoFrameSize *
+        10000000 / strmh->cur_ctrl.dwFrameInterval;
+
+    if (bytes_per_sec == 0)
+      count = LIBUVC_NUM_TRANSFER_BUFS;
+    else
+      count = (bytes_per_sec * LIBUVC_TRANSFER_BUFFER_MS / 1000 +
+               transfer_size - 1) / transfer_size;
+
+    if (count > LIBUVC_NUM_TRANSFER_BUFS)
+      count = LIBUVC_NUM_TRANSFER_BUFS;
+  }
+
+  if (strmh->max_transfer_mem && count * transfer_size > strmh->max_transfer_mem)
+    count = strmh->max_transfer_mem / transfer_size;
+
+  if (count < LIBUVC_MIN_TRANSFER_BUFS)
+    count = LIBUVC_MIN_TRANSFER_BUFS;
+
+  UVC_DEBUG("using %zu transfers of %zu bytes", count, transfer_size);
+
+  free(strmh->transfers);
+  free(strmh->transfer_bufs);
+  strmh->num_transfer_bufs = 0;
+
+  strmh->transfers = calloc(count, sizeof(*strmh->transfers));
+  strmh->transfer_bufs = calloc(count, sizeof(*strmh->transfer_bufs));
+  if (!strmh->transfers || !strmh->transfer_bufs) {
+    free(strmh->transfers);
+    free(strmh->transfer_bufs);
+    strmh->transfers = NULL;
+    strmh->transfer_bufs = NULL;
+    return UVC_ERROR_NO_MEM;
+  }
+
+  strmh->num_transfer_bufs = count;
+  strmh->transfer_size = transfer_size;
+
+  return UVC_SUCCESS;
+}
+
 /** Begin streaming video from the stream into the callback function.
  * @ingroup streaming
  *
  * @param strmh UVC stream
  * @param cb   User callback function. See {uvc_frame_callback_t} for restrictions.
- * @param flags Stream setup flags, currently undefined. Set this to zero. The lower bit
- * is reserved for backward compatibility.
+ * @param flags Stream setup flags, a combination of ::uvc_stream_flags or zero. The
+ * lower bit is reserved for backward compatibility.
  */
 uvc_error_t uvc_stream_start(
     uvc_stream_handle_t *strmh,
@@ -1104,7 +2121,21 @@ uvc_error_t uvc_stream_start(
   strmh->seq = 1;
   strmh->fid = 0;
   strmh->pts = 0;
+  /* drop whatever was half assembled when the stream last stopped */
+  strmh->got_bytes = 0;
+  strmh->meta_got_bytes = 0;
   strmh->last_scr = 0;
+  strmh->last_sof = 0;
+  strmh->packet_errors = 0;
+  strmh->device_lost = 0;
+  memset(&strmh->clock, 0, sizeof(strmh->clock));
+  strmh->packet_interval_ns =
+      libusb_get_device_speed(libusb_get_device(strmh->devh->usb_devh)) >= LIBUSB_SPEED_HIGH ?
+      125000 : 1000000;
+  strmh->queue_head = 0;
+  strmh->queue_tail = 0;
+  _uvc_wakeup_clear(&strmh->frame_ready);
+  _uvc_wakeup_clear(&strmh->queue_space);
 
   frame_desc = uvc_find_frame_desc_stream(strmh, ctrl->bFormatIndex, ctrl->bFrameIndex);
   if (!frame_desc) {
@@ -1182,8 +2213,8 @@ uvc_error_t uvc_stream_start(
                                 endpoint_bytes_per_packet - 1) / endpoint_bytes_per_packet;
 
         /* But keep a reasonable limit: Otherwise we start dropping data */
-        if (packets_per_transfer > 32)
-          packets_per_transfer = 32;
+        if (packets_per_transfer > strmh->req_packets_per_transfer)
+          packets_per_transfer = strmh->req_packets_per_transfer;
         
         total_transfer_size = packets_per_transfer * endpoint_bytes_per_packet;
         break;
@@ -1205,8 +2236,12 @@ uvc_error_t uvc_stream_start(
       goto fail;
     }
 
+    ret = _uvc_stream_alloc_transfers(strmh, frame_desc, total_transfer_size);
+    if (ret != UVC_SUCCESS)
+      goto fail;
+
     /* Set up the transfers */
-    for (transfer_id = 0; transfer_id < LIBUVC_NUM_TRANSFER_BUFS; ++transfer_id) {
+    for (transfer_id = 0; transfer_id < strmh->num_transfer_bufs; ++transfer_id) {
       transfer = libusb_alloc_transfer(packets_per_transfer);
       strmh->transfers[transfer_id] = transfer;      
       strmh->transfer_bufs[transfer_id] = malloc(total_transfer_size);
@@ -1219,7 +2254,12 @@ uvc_error_t uvc_stream_start(
       libusb_set_iso_packet_lengths(transfer, endpoint_bytes_per_packet);
     }
   } else {
-    for (transfer_id = 0; transfer_id < LIBUVC_NUM_TRANSFER_BUFS;
+    ret = _uvc_stream_alloc_transfers(strmh, frame_desc,
+        strmh->cur_ctrl.dwMaxPayloadTransferSize);
+    if (ret != UVC_SUCCESS)
+      goto fail;
+
+    for (transfer_id = 0; transfer_id < strmh->num_transfer_bufs;
         ++transfer_id) {
       transfer = libusb_alloc_transfer(0);
       strmh->transfers[transfer_id] = transfer;
@@ -1235,15 +2275,16 @@ uvc_error_t uvc_stream_start(
 
   strmh->user_cb = cb;
   strmh->user_ptr = user_ptr;
+  strmh->direct_dispatch = cb && (flags & UVC_STREAM_DIRECT_DISPATCH);
 
   /* If the user wants it, set up a thread that calls the user's function
    * with the contents of each frame.
    */
-  if (cb) {
+  if (cb && !strmh->direct_dispatch) {
     pthread_create(&strmh->cb_thread, NULL, _uvc_user_caller, (void*) strmh);
   }
 
-  for (transfer_id = 0; transfer_id < LIBUVC_NUM_TRANSFER_BUFS;
+  for (transfer_id = 0; transfer_id < strmh->num_transfer_bufs;
       transfer_id++) {
     ret = libusb_submit_transfer(strmh->transfers[transfer_id]);
     if (ret != UVC_SUCCESS) {
@@ -1253,7 +2294,7 @@ uvc_error_t uvc_stream_start(
   }
 
   if ( ret != UVC_SUCCESS && transfer_id >= 0 ) {
-    for ( ; transfer_id < LIBUVC_NUM_TRANSFER_BUFS; transfer_id++) {
+    for ( ; transfer_id < strmh->num_transfer_bufs; transfer_id++) {
       free ( strmh->transfers[transfer_id]->buffer );
       libusb_free_transfer ( strmh->transfers[transfer_id]);
       strmh->transfers[transfer_id] = 0;
@@ -1295,38 +2336,46 @@ uvc_error_t uvc_stream_start_iso(
  */
 void *_uvc_user_caller(void *arg) {
   uvc_stream_handle_t *strmh = (uvc_stream_handle_t *) arg;
-
-  uint32_t last_seq = 0;
+  struct uvc_frame_slot *slot;
 
   do {
-    pthread_mutex_lock(&strmh->cb_mutex);
-
-    while (strmh->running && last_seq == strmh->hold_seq) {
-      pthread_cond_wait(&strmh->cb_cond, &strmh->cb_mutex);
-    }
+    slot = _uvc_frame_queue_wait(strmh, 0);
 
     if (!strmh->running) {
-      pthread_mutex_unlock(&strmh->cb_mutex);
+      if (slot)
+        _uvc_frame_queue_release(strmh, slot);
       break;
     }
+
+    if (!slot) {
+      /* the device is gone: nothing to do until the stream is stopped */
+      if (UVC_LOAD_ACQUIRE(&strmh->device_lost))
+        _uvc_wakeup_wait(&strmh->frame_ready, -1);
+      continue;
+    }
     
-    last_seq = strmh->hold_seq;
-    _uvc_populate_frame(strmh);
+    _uvc_populate_frame(strmh, slot);
+    _uvc_frame_queue_release(strmh, slot);
     
-    pthread_mutex_unlock(&strmh->cb_mutex);
-    
-    strmh->user_cb(&strmh->frame, strmh->user_ptr);
+    if (strmh->frame.data)
+      strmh->user_cb(&strmh->frame, strmh->user_ptr);
+
+    /* recycle the frame buffer unless the callback borrowed it */
+    if (strmh->frame.stream_buf) {
+      _uvc_frame_pool_release(strmh->frame.stream_buf);
+      strmh->frame.stream_buf = NULL;
+    }
+    strmh->frame.data = NULL;
+    strmh->frame.data_bytes = 0;
   } while(1);
 
   return NULL; // return value ignored
 }
 
 /** @internal
- * @brief Populate the fields of a frame to be handed to user code
- * must be called with stream cb lock held!
+ * @brief Fill in the format and geometry of a frame from the current control
  */
-void _uvc_populate_frame(uvc_stream_handle_t *strmh) {
-  uvc_frame_t *frame = &strmh->frame;
+static void _uvc_frame_set_format(uvc_stream_handle_t *strmh, uvc_frame_t *frame) {
   uvc_frame_desc_t *frame_desc;
 
   /** @todo this stuff that hits the main config cache should really happen
@@ -1365,25 +2414,50 @@ void _uvc_populate_frame(uvc_stream_handle_t *strmh) {
     frame->step = 0;
     break;
   }
+}
 
-  frame->sequence = strmh->hold_seq;
-  frame->capture_time_finished = strmh->capture_time_finished;
-
-  /* copy the image data from the hold buffer to the frame (unnecessary extra buf?) */
-  if (frame->data_bytes < strmh->hold_bytes) {
-    frame->data = realloc(frame->data, strmh->hold_bytes);
+/** @internal
+ * @brief Populate the fields of a frame to be handed to user code
+ * @param slot Queue slot claimed by the caller, which is the only consumer
+ */
+void _uvc_populate_frame(uvc_stream_handle_t *strmh, struct uvc_frame_slot *slot) {
+  uvc_frame_t *frame = &strmh->frame;
+  struct uvc_frame_buffer *idle;
+
+  _uvc_frame_set_format(strmh, frame);
+
+  frame->sequence = slot->seq;
+  frame->capture_time_finished = slot->capture_time_finished;
+  frame->capture_time_device = slot->capture_time_device;
+  frame->capture_time_started = slot->capture_time_started;
+  frame->pts = slot->pts;
+  frame->scr = slot->last_scr;
+  frame->scr_sof = slot->last_sof;
+  frame->packet_errors = slot->packet_errors;
+
+  /* hand the slot's buffer itself to the consumer and put an idle one in
+   * its place, so the frame is never copied */
+  idle = _uvc_frame_pool_acquire(strmh->frame_pool);
+  if (idle) {
+    frame->stream_buf = slot->buf;
+    frame->data = slot->buf->data;
+    frame->data_bytes = slot->bytes;
+    frame->library_owns_data = 0;
+    slot->buf = idle;
+  } else {
+    UVC_DEBUG("out of frame buffers, dropping frame %u", slot->seq);
+    frame->data = NULL;
+    frame->data_bytes = 0;
   }
-  frame->data_bytes = strmh->hold_bytes;
-  memcpy(frame->data, strmh->holdbuf, frame->data_bytes);
 
-  if (strmh->meta_hold_bytes > 0)
+  if (slot->meta_bytes > 0)
   {
-      if (frame->metadata_bytes < strmh->meta_hold_bytes)
+      if (frame->metadata_bytes < slot->meta_bytes)
       {
-          frame->metadata = realloc(frame->metadata, strmh->meta_hold_bytes);
+          frame->metadata = realloc(frame->metadata, slot->meta_bytes);
       }
-      frame->metadata_bytes = strmh->meta_hold_bytes;
-      memcpy(frame->metadata, strmh->meta_holdbuf, frame->metadata_bytes);
+      frame->metadata_bytes = slot->meta_bytes;
+      memcpy(frame->metadata, slot->meta, frame->metadata_bytes);
   }
 }
 
@@ -1397,9 +2471,7 @@ void _uvc_populate_frame(uvc_stream_handle_t *strmh) {
 uvc_error_t uvc_stream_get_frame(uvc_stream_handle_t *strmh,
 			  uvc_frame_t **frame,
 			  int32_t timeout_us) {
-  time_t add_secs;
-  time_t add_nsecs;
-  struct timespec ts;
+  struct uvc_frame_slot *slot;
 
   if (!strmh->running)
     return UVC_ERROR_INVALID_PARAM;
@@ -1407,64 +2479,75 @@ uvc_error_t uvc_stream_get_frame(uvc_stream_handle_t *strmh,
   if (strmh->user_cb)
     return UVC_ERROR_CALLBACK_EXISTS;
 
-  pthread_mutex_lock(&strmh->cb_mutex);
+  /* the previous frame is only valid until this call, unless borrowed */
+  if (strmh->frame.stream_buf) {
+    _uvc_frame_pool_release(strmh->frame.stream_buf);
+    strmh->frame.stream_buf = NULL;
+  }
 
-  if (strmh->last_polled_seq < strmh->hold_seq) {
-    _uvc_populate_frame(strmh);
-    *frame = &strmh->frame;
-    strmh->last_polled_seq = strmh->hold_seq;
-  } else if (timeout_us != -1) {
-    if (timeout_us == 0) {
-      pthread_cond_wait(&strmh->cb_cond, &strmh->cb_mutex);
-    } else {
-      add_secs = timeout_us / 1000000;
-      add_nsecs = (timeout_us % 1000000) * 1000;
-      ts.tv_sec = 0;
-      ts.tv_nsec = 0;
+  do {
+    slot = _uvc_frame_queue_wait(strmh, timeout_us);
+    if (!slot) {
+      *frame = NULL;
+      if (UVC_LOAD_ACQUIRE(&strmh->device_lost))
+        return UVC_ERROR_NO_DEVICE;
+      return timeout_us > 0 && strmh->running ? UVC_ERROR_TIMEOUT : UVC_SUCCESS;
+    }
 
-#if _POSIX_TIMERS > 0
-      clock_gettime(CLOCK_REALTIME, &ts);
-#else
-      struct timeval tv;
-      gettimeofday(&tv, NULL);
-      ts.tv_sec = tv.tv_sec;
-      ts.tv_nsec = tv.tv_usec * 1000;
-#endif
+    _uvc_populate_frame(strmh, slot);
+    _uvc_frame_queue_release(strmh, slot);
+  } while (!strmh->frame.data);
 
-      ts.tv_sec += add_secs;
-      ts.tv_nsec += add_nsecs;
+  *frame = &strmh->frame;
 
-      /* pthread_cond_timedwait FAILS with EINVAL if ts.tv_nsec > 1000000000 (1 billion)
-       * Since we are just adding values to the timespec, we have to increment the seconds if nanoseconds is greater than 1 billion,
-       * and then re-adjust the nanoseconds in the correct range.
-       * */
-      ts.tv_sec += ts.tv_nsec / 1000000000;
-      ts.tv_nsec = ts.tv_nsec % 1000000000;
+  return UVC_SUCCESS;
+}
 
-      int err = pthread_cond_timedwait(&strmh->cb_cond, &strmh->cb_mutex, &ts);
+/** @brief Get a descriptor that is readable while polled frames are queued
+ * @ingroup streaming
+ *
+ * Lets an application wait for frames in its own poll/epoll loop, next to
+ * the descriptors from uvc_get_pollfds(), instead of blocking in
+ * uvc_stream_get_frame(). Once readable, drain the stream with
+ * uvc_stream_get_frame(strmh, &frame, -1) until it yields no frame; that
+ * also makes the descriptor unreadable again. Never read from it directly.
+ *
+ * @param strmh UVC stream handle, opened but used without a callback
+ * @return File descriptor owned by the stream, valid until it is closed
+ */
+int uvc_stream_get_fd(uvc_stream_handle_t *strmh) {
+  strmh->frame_fd_exported = 1;
+  return strmh->frame_ready.read_fd;
+}
 
-      //TODO: How should we handle EINVAL?
-      if (err) {
-        *frame = NULL;
-        pthread_mutex_unlock(&strmh->cb_mutex);
-        return err == ETIMEDOUT ? UVC_ERROR_TIMEOUT : UVC_ERROR_OTHER;
-      }
-    }
-    
-    if (strmh->last_polled_seq < strmh->hold_seq) {
-      _uvc_populate_frame(strmh);
-      *frame = &strmh->frame;
-      strmh->last_polled_seq = strmh->hold_seq;
-    } else {
-      *frame = NULL;
-    }
-  } else {
-    *frame = NULL;
-  }
+/** @brief Take ownership of the image data of a frame
+ * @ingroup streaming
+ *
+ * Frames handed to a callback or returned by uvc_stream_get_frame() point
+ * straight into the stream's assembly buffer, which is recycled once the
+ * callback returns or on the next poll. Borrowing it keeps
+ * frame->data valid until the buffer is given back with uvc_frame_return(),
+ * from any thread and even after the stream is closed.
+ *
+ * @param frame Frame received by a uvc_frame_callback_t or polled
+ * @return Buffer handle to pass to uvc_frame_return(), or NULL if the frame
+ *         is not backed by a stream buffer (e.g. converted frames)
+ */
+uvc_frame_buffer_t *uvc_frame_borrow(uvc_frame_t *frame) {
+  uvc_frame_buffer_t *buf = frame->stream_buf;
 
-  pthread_mutex_unlock(&strmh->cb_mutex);
+  frame->stream_buf = NULL;
+  return buf;
+}
 
-  return UVC_SUCCESS;
+/** @brief Give back a buffer taken with uvc_frame_borrow()
+ * @ingroup streaming
+ *
+ * @param buf Borrowed buffer; the frame data it backed must no longer be used
+ */
+void uvc_frame_return(uvc_frame_buffer_t *buf) {
+  if (buf)
+    _uvc_frame_pool_release(buf);
 }
 
 /** @brief Stop streaming video
@@ -1497,33 +2580,37 @@ uvc_error_t uvc_stream_stop(uvc_stream_handle_t *strmh) {
 
   strmh->running = 0;
 
+  /* Release a transfer callback waiting for room in the frame queue */
+  _uvc_wakeup_signal(&strmh->queue_space);
+
   pthread_mutex_lock(&strmh->cb_mutex);
 
   /* Attempt to cancel any running transfers, we can't free them just yet because they aren't
    *   necessarily completed but they will be free'd in _uvc_stream_callback().
    */
-  for(i=0; i < LIBUVC_NUM_TRANSFER_BUFS; i++) {
+  for(i=0; i < strmh->num_transfer_bufs; i++) {
     if(strmh->transfers[i] != NULL)
       libusb_cancel_transfer(strmh->transfers[i]);
   }
 
   /* Wait for transfers to complete/cancel */
   do {
-    for(i=0; i < LIBUVC_NUM_TRANSFER_BUFS; i++) {
+    for(i=0; i < strmh->num_transfer_bufs; i++) {
       if(strmh->transfers[i] != NULL)
         break;
     }
-    if(i == LIBUVC_NUM_TRANSFER_BUFS )
+    if(i == strmh->num_transfer_bufs )
       break;
     pthread_cond_wait(&strmh->cb_cond, &strmh->cb_mutex);
   } while(1);
-  // Kick the user thread awake
-  pthread_cond_broadcast(&strmh->cb_cond);
   pthread_mutex_unlock(&strmh->cb_mutex);
 
+  // Kick the user thread awake
+  _uvc_wakeup_signal(&strmh->frame_ready);
+
   /** @todo stop the actual stream, camera side? */
 
-  if (strmh->user_cb) {
+  if (strmh->user_cb && !strmh->direct_dispatch) {
     /* wait for the thread to stop (triggered by
      * LIBUSB_TRANSFER_CANCELLED transfer) */
     pthread_join(strmh->cb_thread, NULL);
@@ -1545,14 +2632,24 @@ void uvc_stream_close(uvc_stream_handle_t *strmh) {
 
   uvc_release_if(strmh->devh, strmh->stream_if->bInterfaceNumber);
 
-  if (strmh->frame.data)
+  if (strmh->frame.data && strmh->frame.library_owns_data)
     free(strmh->frame.data);
+  if (strmh->frame.stream_buf)
+    _uvc_frame_pool_release(strmh->frame.stream_buf);
 
-  free(strmh->outbuf);
-  free(strmh->holdbuf);
+  _uvc_frame_pool_release(strmh->outbuf);
+  if (strmh->spare_buf)
+    _uvc_frame_pool_release(strmh->spare_buf);
+  _uvc_frame_queue_free(strmh->queue, strmh->queue_mask + 1);
+  _uvc_frame_pool_close(strmh->frame_pool);
 
   free(strmh->meta_outbuf);
-  free(strmh->meta_holdbuf);
+
+  _uvc_wakeup_close(&strmh->frame_ready);
+  _uvc_wakeup_close(&strmh->queue_space);
+
+  free(strmh->transfers);
+  free(strmh->transfer_bufs);
 
   pthread_cond_destroy(&strmh->cb_cond);
   pthread_mutex_destroy(&strmh->cb_mutex);
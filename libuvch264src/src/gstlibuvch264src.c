@@ -2,24 +2,43 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <fcntl.h>
-#include <sys/select.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
 #include <libusb-1.0/libusb.h>
 #include "gstlibuvch264src.h"
 #include <gst/gst.h>
+#include <gst/video/video.h>
 #include <libuvc/libuvc.h>
 
 GST_DEBUG_CATEGORY_STATIC(gst_libuvc_h264_src_debug);
 #define GST_CAT_DEFAULT gst_libuvc_h264_src_debug
 
-typedef struct {
-    int type;
-    unsigned char *ptr;
-    int len;
-} nal_unit_t;
 
 enum {
   PROP_0,
   PROP_INDEX,
+  PROP_TRANSFER_COUNT,
+  PROP_PACKETS_PER_TRANSFER,
+  PROP_TRANSFER_MEMORY,
+  PROP_DIRECT_DISPATCH,
+  PROP_EVENT_LOOP,
+  PROP_TIMESTAMP_MODE,
+  PROP_TIMESTAMP_ESTIMATOR,
+  PROP_STATS,
+  PROP_MAX_QUEUE_TIME,
+  PROP_MAX_QUEUE_BUFFERS,
+  PROP_STALL_TIMEOUT,
+  PROP_STALL_ACTION,
+  PROP_RECONNECT_TIMEOUT,
+  PROP_WATCHDOG_TIMEOUT,
+  PROP_KEYFRAME_METHOD,
+  PROP_KEYFRAME_INTERVAL,
+  PROP_KEYFRAME_XU_REQUEST,
+  PROP_BITRATE,
+  PROP_QUALITY,
+  PROP_FAST_START,
   PROP_LAST
 };
 
@@ -28,10 +47,84 @@ static GstStaticPadTemplate src_template = GST_STATIC_PAD_TEMPLATE(
   GST_PAD_SRC,
   GST_PAD_ALWAYS,
   GST_STATIC_CAPS("video/x-h264, "
-                  "stream-format=(string)byte-stream, "
+                  "stream-format=(string){ byte-stream, avc }, "
                   "alignment=(string)au")
 );
 
+// Set on a queued IDR whose parameter sets changed the caps: a structure of
+// the fields to replace. create() puts the new caps out before the buffer.
+static GQuark caps_update_quark;
+
+#define GST_TYPE_LIBUVC_H264_SRC_TIMESTAMP_MODE (gst_libuvc_h264_src_timestamp_mode_get_type())
+static GType gst_libuvc_h264_src_timestamp_mode_get_type(void) {
+  static gsize type = 0;
+  static const GEnumValue values[] = {
+    { GST_LIBUVC_H264_SRC_TIMESTAMP_HOST, "Host arrival time, smoothed", "host" },
+    { GST_LIBUVC_H264_SRC_TIMESTAMP_DEVICE, "Device clock from the UVC payload PTS/SCR", "device" },
+    { 0, NULL, NULL }
+  };
+
+  if (g_once_init_enter(&type)) {
+    GType t = g_enum_register_static("GstLibuvcH264SrcTimestampMode", values);
+    g_once_init_leave(&type, t);
+  }
+  return type;
+}
+
+#define GST_TYPE_LIBUVC_H264_SRC_TIMESTAMP_ESTIMATOR (gst_libuvc_h264_src_timestamp_estimator_get_type())
+static GType gst_libuvc_h264_src_timestamp_estimator_get_type(void) {
+  static gsize type = 0;
+  static const GEnumValue values[] = {
+    { TS_ESTIMATOR_RAW, "Capture time unchanged", "raw" },
+    { TS_ESTIMATOR_SMOOTHED, "Least-squares fit over recent frames", "smoothed" },
+    { TS_ESTIMATOR_LOCKED, "Nominal frame rate, phase-locked to the capture times", "locked" },
+    { 0, NULL, NULL }
+  };
+
+  if (g_once_init_enter(&type)) {
+    GType t = g_enum_register_static("GstLibuvcH264SrcTimestampEstimator", values);
+    g_once_init_leave(&type, t);
+  }
+  return type;
+}
+
+#define GST_TYPE_LIBUVC_H264_SRC_STALL_ACTION (gst_libuvc_h264_src_stall_action_get_type())
+static GType gst_libuvc_h264_src_stall_action_get_type(void) {
+  static gsize type = 0;
+  static const GEnumValue values[] = {
+    { GST_LIBUVC_H264_SRC_STALL_WARNING, "Post a warning message", "warning" },
+    { GST_LIBUVC_H264_SRC_STALL_GAP, "Post a warning and push gap events", "gap" },
+    { 0, NULL, NULL }
+  };
+
+  if (g_once_init_enter(&type)) {
+    GType t = g_enum_register_static("GstLibuvcH264SrcStallAction", values);
+    g_once_init_leave(&type, t);
+  }
+  return type;
+}
+
+#define GST_TYPE_LIBUVC_H264_SRC_KEYFRAME_METHOD (gst_libuvc_h264_src_keyframe_method_get_type())
+static GType gst_libuvc_h264_src_keyframe_method_get_type(void) {
+  static gsize type = 0;
+  static const GEnumValue values[] = {
+    { GST_LIBUVC_H264_SRC_KEYFRAME_NONE, "Wait for the next IDR", "none" },
+    { GST_LIBUVC_H264_SRC_KEYFRAME_AUTO, "Encoding unit or extension unit request", "auto" },
+    { GST_LIBUVC_H264_SRC_KEYFRAME_RESTART, "Restart the stream", "restart" },
+    { 0, NULL, NULL }
+  };
+
+  if (g_once_init_enter(&type)) {
+    GType t = g_enum_register_static("GstLibuvcH264SrcKeyframeMethod", values);
+    g_once_init_leave(&type, t);
+  }
+  return type;
+}
+
+// Pushed into the frame queue to wake create() up from unlock()
+static gchar queue_wakeup;
+#define QUEUE_WAKEUP ((gpointer)&queue_wakeup)
+
 G_DEFINE_TYPE_WITH_CODE(GstLibuvcH264Src, gst_libuvc_h264_src, GST_TYPE_PUSH_SRC,
   GST_DEBUG_CATEGORY_INIT(gst_libuvc_h264_src_debug, "libuvch264src", 0, "libuvch264src element"));
 
@@ -42,16 +135,39 @@ static void gst_libuvc_h264_src_get_property(GObject *object, guint prop_id,
                                              GValue *value, GParamSpec *pspec);
 static gboolean gst_libuvc_h264_src_start(GstBaseSrc *src);
 static gboolean gst_libuvc_h264_src_stop(GstBaseSrc *src);
+static gboolean gst_libuvc_h264_src_unlock(GstBaseSrc *src);
+static gboolean gst_libuvc_h264_src_unlock_stop(GstBaseSrc *src);
 static GstFlowReturn gst_libuvc_h264_src_create(GstPushSrc *src, GstBuffer **buf);
+static uvc_error_t gst_libuvc_h264_src_run_stream(GstLibuvcH264Src *self, gboolean resume);
+static GstFlowReturn gst_libuvc_h264_src_apply_encoder(GstLibuvcH264Src *self, gboolean force);
+static gboolean gst_libuvc_h264_src_start_session(GstLibuvcH264Src *self);
+static gboolean gst_libuvc_h264_src_query(GstBaseSrc *src, GstQuery *query);
+static gboolean gst_libuvc_h264_src_event(GstBaseSrc *src, GstEvent *event);
 static void gst_libuvc_h264_src_finalize(GObject *object);
+static GstStateChangeReturn gst_libuvc_h264_src_change_state(GstElement *element,
+                                                             GstStateChange transition);
 
 // Forward declarations for control functions
 static gpointer gst_libuvc_h264_src_control_thread(gpointer data);
+void frame_callback(uvc_frame_t *frame, void *ptr);
 static char* gst_libuvc_h264_src_process_control_command(GstLibuvcH264Src *self, const char *command);
 
 // USB device management functions
 static void gst_libuvc_h264_src_force_usb_release(GstLibuvcH264Src *self);
 
+static void gst_libuvc_h264_src_flush_queue(GstLibuvcH264Src *self);
+
+// Elements share one libuvc context, and with it one libusb event thread,
+// unless they run their own event loop. The lock covers the context's
+// reference count and the cached device list only: opening and closing a
+// device, which can take a while, is left to libuvc's own locking so one
+// element's teardown does not hold up the others.
+static GMutex shared_ctx_lock;
+static uvc_context_t *shared_ctx = NULL;
+static guint shared_ctx_refs = 0;
+static uvc_device_t **shared_dev_list = NULL;
+static gint64 shared_dev_list_time = 0;
+
 static void gst_libuvc_h264_src_class_init(GstLibuvcH264SrcClass *klass) {
   GObjectClass *gobject_class = G_OBJECT_CLASS(klass);
   GstElementClass *element_class = GST_ELEMENT_CLASS(klass);
@@ -59,6 +175,7 @@ static void gst_libuvc_h264_src_class_init(GstLibuvcH264SrcClass *klass) {
   GstPushSrcClass *push_src_class = GST_PUSH_SRC_CLASS(klass);
 
   base_src_class->negotiate = GST_DEBUG_FUNCPTR(gst_libuvc_h264_negotiate);
+  caps_update_quark = g_quark_from_static_string("libuvch264src-caps-update");
   gobject_class->set_property = gst_libuvc_h264_src_set_property;
   gobject_class->get_property = gst_libuvc_h264_src_get_property;
 
@@ -66,6 +183,146 @@ static void gst_libuvc_h264_src_class_init(GstLibuvcH264SrcClass *klass) {
     g_param_spec_string("index", "Index", "Device location, e.g., '0'",
                         DEFAULT_DEVICE_INDEX, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+  g_object_class_install_property(gobject_class, PROP_TRANSFER_COUNT,
+    g_param_spec_int("transfer-count", "Transfer count",
+                     "USB transfers kept in flight (0 = derive from the negotiated bitrate)",
+                     0, MAX_TRANSFER_COUNT, DEFAULT_TRANSFER_COUNT,
+                     G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_PACKETS_PER_TRANSFER,
+    g_param_spec_int("packets-per-transfer", "Packets per transfer",
+                     "Upper bound on packets per isochronous transfer (0 = libuvc default)",
+                     0, MAX_PACKETS_PER_TRANSFER, DEFAULT_PACKETS_PER_TRANSFER,
+                     G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_TRANSFER_MEMORY,
+    g_param_spec_uint64("transfer-memory", "Transfer memory",
+                        "Upper bound in bytes on memory held by USB transfers (0 = unlimited)",
+                        0, G_MAXUINT64, DEFAULT_TRANSFER_MEMORY,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_DIRECT_DISPATCH,
+    g_param_spec_boolean("direct-dispatch", "Direct dispatch",
+                         "Split frames in the USB event thread instead of a separate "
+                         "callback thread; lower latency, but a slow pipeline stalls USB",
+                         DEFAULT_DIRECT_DISPATCH,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_TIMESTAMP_MODE,
+    g_param_spec_enum("timestamp-mode", "Timestamp mode",
+                      "Timestamp frames by host arrival or by the camera's own clock",
+                      GST_TYPE_LIBUVC_H264_SRC_TIMESTAMP_MODE, DEFAULT_TIMESTAMP_MODE,
+                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_TIMESTAMP_ESTIMATOR,
+    g_param_spec_enum("timestamp-estimator", "Timestamp estimator",
+                      "How capture times are turned into buffer timestamps",
+                      GST_TYPE_LIBUVC_H264_SRC_TIMESTAMP_ESTIMATOR, DEFAULT_TIMESTAMP_ESTIMATOR,
+                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_STATS,
+    g_param_spec_boxed("stats", "Statistics",
+                       "Timestamp estimator statistics: frames, resyncs, skew-ppm, "
+                       "error-mean, error-rms and error-max (ns, capture time minus timestamp); "
+                       "frames and GOPs dropped by the queue bounds: dropped-frames, dropped-gops; "
+                       "camera reconnects and how long the last one took: reconnects, "
+                       "reconnect-time (ns); watchdog recovery steps and how long the last "
+                       "recovery took: recoveries-resubmit, recoveries-clear-halt, "
+                       "recoveries-commit, recoveries-reset, recovery-time (ns); "
+                       "keyframes asked of the camera: keyframe-requests; time from start to "
+                       "the first IDR pushed, 0 until then: first-idr-time (ns)",
+                       GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_EVENT_LOOP,
+    g_param_spec_boolean("event-loop", "Event loop",
+                         "Handle USB events, frame pickup and the control socket in one "
+                         "thread instead of three (direct-dispatch is then ignored)",
+                         DEFAULT_EVENT_LOOP,
+                         G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_MAX_QUEUE_TIME,
+    g_param_spec_uint64("max-queue-time", "Max queue time",
+                        "Most video (ns) waiting to be pushed before the rest of the GOP "
+                        "is dropped (0 = unlimited)",
+                        0, G_MAXUINT64, DEFAULT_MAX_QUEUE_TIME,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_MAX_QUEUE_BUFFERS,
+    g_param_spec_uint("max-queue-buffers", "Max queue buffers",
+                      "Most frames waiting to be pushed before the rest of the GOP "
+                      "is dropped (0 = unlimited)",
+                      0, G_MAXUINT, DEFAULT_MAX_QUEUE_BUFFERS,
+                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_STALL_TIMEOUT,
+    g_param_spec_uint64("stall-timeout", "Stall timeout",
+                        "How long (ns) the camera may send nothing before stall-action "
+                        "is taken (0 = never)",
+                        0, G_MAXUINT64, DEFAULT_STALL_TIMEOUT,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_STALL_ACTION,
+    g_param_spec_enum("stall-action", "Stall action",
+                      "What to do when the camera stalls",
+                      GST_TYPE_LIBUVC_H264_SRC_STALL_ACTION, DEFAULT_STALL_ACTION,
+                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_RECONNECT_TIMEOUT,
+    g_param_spec_uint64("reconnect-timeout", "Reconnect timeout",
+                        "How long (ns) to wait for a disconnected camera to come back "
+                        "before failing with an error (0 = fail at once)",
+                        0, G_MAXUINT64, DEFAULT_RECONNECT_TIMEOUT,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_WATCHDOG_TIMEOUT,
+    g_param_spec_uint64("watchdog-timeout", "Watchdog timeout",
+                        "How long (ns) a stream may go without frames before it is "
+                        "restarted, escalating from resubmitting transfers to a USB port "
+                        "reset (0 = no watchdog)",
+                        0, G_MAXUINT64, DEFAULT_WATCHDOG_TIMEOUT,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_KEYFRAME_METHOD,
+    g_param_spec_enum("keyframe-method", "Keyframe method",
+                      "How to get an IDR from the camera when downstream asks for a "
+                      "key unit",
+                      GST_TYPE_LIBUVC_H264_SRC_KEYFRAME_METHOD, DEFAULT_KEYFRAME_METHOD,
+                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_KEYFRAME_INTERVAL,
+    g_param_spec_uint64("keyframe-interval", "Keyframe interval",
+                        "Least time (ns) between two keyframe requests to the camera; "
+                        "requests in between are answered by the next IDR",
+                        0, G_MAXUINT64, DEFAULT_KEYFRAME_INTERVAL,
+                        G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_KEYFRAME_XU_REQUEST,
+    g_param_spec_string("keyframe-xu-request", "Keyframe XU request",
+                        "Vendor extension unit SET_CUR that makes the camera send an "
+                        "IDR, as unit:selector:hexdata, e.g. '4:2:01'; used by "
+                        "keyframe-method=auto on cameras without an encoding unit",
+                        NULL, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_BITRATE,
+    g_param_spec_uint("bitrate", "Bitrate",
+                      "Average bitrate (bits/s) for the camera's encoder, changed while "
+                      "streaming where the camera allows (0 = camera default)",
+                      0, G_MAXUINT, DEFAULT_BITRATE,
+                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_QUALITY,
+    g_param_spec_uint("quality", "Quality",
+                      "Compression quality asked of the camera, 1-10000; changing it "
+                      "restarts the stream (0 = negotiated default)",
+                      0, MAX_QUALITY, DEFAULT_QUALITY,
+                      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property(gobject_class, PROP_FAST_START,
+    g_param_spec_boolean("fast-start", "Fast start",
+                         "Start streaming from the camera in PAUSED, with caps filled in "
+                         "from the cached SPS, and ask it for an IDR on going to PLAYING",
+                         DEFAULT_FAST_START, G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   gst_element_class_set_static_metadata(element_class,
     "UVC H.264 Video Source", "Source/Video",
     "Captures H.264 video from a UVC device", "Name");
@@ -73,8 +330,13 @@ static void gst_libuvc_h264_src_class_init(GstLibuvcH264SrcClass *klass) {
   gst_element_class_add_pad_template(element_class,
     gst_static_pad_template_get(&src_template));
 
+  element_class->change_state = gst_libuvc_h264_src_change_state;
+  base_src_class->query = GST_DEBUG_FUNCPTR(gst_libuvc_h264_src_query);
+  base_src_class->event = GST_DEBUG_FUNCPTR(gst_libuvc_h264_src_event);
   base_src_class->start = gst_libuvc_h264_src_start;
   base_src_class->stop = gst_libuvc_h264_src_stop;
+  base_src_class->unlock = gst_libuvc_h264_src_unlock;
+  base_src_class->unlock_stop = gst_libuvc_h264_src_unlock_stop;
   push_src_class->create = gst_libuvc_h264_src_create;
   gobject_class->finalize = gst_libuvc_h264_src_finalize;
 }
@@ -113,85 +375,361 @@ void create_hidden_directory(GstLibuvcH264Src *self) {
         GST_WARNING_OBJECT(self, "Warning: %s exists but is not a directory.\n", hidden_dir);
 }
 
-FILE *open_spspps_file(GstLibuvcH264Src *self, char mode) {
+// Cache file name for the open camera: VID/PID and serial, which unlike the
+// index stay with the camera across ports and reboots
+static gchar *spspps_file_name(GstLibuvcH264Src *self) {
+    if (!self->serial || !*self->serial) {
+        return g_strdup_printf("%04x-%04x", self->vendor_id, self->product_id);
+    }
+
+    gchar *serial = g_strcanon(g_strdup(self->serial),
+                               G_CSET_A_2_Z G_CSET_a_2_z G_CSET_DIGITS "-_", '_');
+    gchar *name = g_strdup_printf("%04x-%04x-%s", self->vendor_id, self->product_id, serial);
+    g_free(serial);
+    return name;
+}
+
+FILE *open_spspps_file(GstLibuvcH264Src *self, const char *name, char mode) {
     if (mode == 'w' || mode == 'a') {
         create_hidden_directory(self);
     }
 
     char m[3];
     sprintf(m, "%cb", mode);
-    char *file_name = get_spspps_path(self, self->index);
+    char *file_name = get_spspps_path(self, (char *)name);
+    if (!file_name) {
+        return NULL;
+    }
     FILE *fp = fopen(file_name, m);
     return fp;
 }
 
-int find_nal_unit(unsigned char *buf, int buflen, int start, int search, int *offset) {
-    if (buflen < (start + 5)) return -1;
+// The file written under the index before the cache was keyed by camera
+// still serves until the camera's own parameter sets have been stored.
+// Without either, sps and pps keep the built-in defaults, which only stand
+// in front of an IDR the camera sent without its own.
+void load_spspps(GstLibuvcH264Src *self) {
+    gchar *name = spspps_file_name(self);
+    FILE* fp = open_spspps_file(self, name, 'r');
+    g_free(name);
+    self->spspps_stored = fp != NULL;
+    g_mutex_lock(&self->spspps_lock);
+    self->sps_known = FALSE;
+    self->pps_known = FALSE;
+    g_mutex_unlock(&self->spspps_lock);
+    if (!fp) {
+        fp = open_spspps_file(self, self->index, 'r');
+    }
+    if (fp) {
+        unsigned char buf[SPSPPSBUFSZ*2];
+        gint read_bytes = fread(buf, 1, sizeof(buf), fp);
+        fclose(fp);
+
+        GArray *units = g_array_new(FALSE, FALSE, sizeof(nal_scan_unit_t));
+        nal_scan(units, buf, read_bytes);
 
-    int i = start;
-    do {
-        if (buf[i] == 0 && buf[i+1] == 0 && buf[i+2] == 0 && buf[i+3] == 1) {
-            if (offset) *offset = i;
-            return (buf[i+4] & 0x1F);
+        g_mutex_lock(&self->spspps_lock);
+        for (guint i = 0; i < units->len; i++) {
+            const nal_scan_unit_t *unit = &g_array_index(units, nal_scan_unit_t, i);
+            if (unit->size > SPSPPSBUFSZ) {
+                continue;
+            }
+            if (unit->type == 7) {
+                memcpy(self->sps, &buf[unit->offset], unit->size);
+                self->sps_length = unit->size;
+                self->sps_known = TRUE;
+            } else if (unit->type == 8) {
+                memcpy(self->pps, &buf[unit->offset], unit->size);
+                self->pps_length = unit->size;
+                self->pps_known = TRUE;
+            }
         }
-        i++;
-    } while (search && i < (buflen - 4));
+        g_mutex_unlock(&self->spspps_lock);
+        g_array_free(units, TRUE);
+    }
+}
 
-    return -1;
+// Length of the start code in front of a cached SPS or PPS
+static gint start_code_length(const unsigned char *nal, guint length) {
+    return (length > 3 && nal[2] == 1) ? 3 : 4;
 }
 
-int parse_nal_units(nal_unit_t *units, int max, unsigned char *buf, int buflen) {
-    int i = 0;
+// avcC (ISO/IEC 14496-15) for the cached SPS and PPS, with 4-byte lengths;
+// NULL until both are the camera's, the defaults describe some other stream
+static GstBuffer *build_codec_data(GstLibuvcH264Src *self) {
+    gint sps_skip = start_code_length(self->sps, self->sps_length);
+    gint pps_skip = start_code_length(self->pps, self->pps_length);
+    const guint8 *sps = self->sps + sps_skip;
+    const guint8 *pps = self->pps + pps_skip;
+    gint sps_len = (gint)self->sps_length - sps_skip;
+    gint pps_len = (gint)self->pps_length - pps_skip;
+
+    if (!self->sps_known || !self->pps_known || sps_len < 4 || pps_len < 1) {
+        return NULL;
+    }
+
+    gsize size = 11 + sps_len + pps_len;
+    guint8 *data = g_malloc(size);
+    data[0] = 1;      // configurationVersion
+    data[1] = sps[1]; // profile_idc
+    data[2] = sps[2]; // constraint flags
+    data[3] = sps[3]; // level_idc
+    data[4] = 0xFF;   // lengthSizeMinusOne = 3
+    data[5] = 0xE1;   // one SPS
+    GST_WRITE_UINT16_BE(data + 6, sps_len);
+    memcpy(data + 8, sps, sps_len);
+    data[8 + sps_len] = 1; // one PPS
+    GST_WRITE_UINT16_BE(data + 9 + sps_len, pps_len);
+    memcpy(data + 11 + sps_len, pps, pps_len);
+
+    return gst_buffer_new_wrapped(data, size);
+}
 
-    int nal_offset = 0;
-    int next_type = find_nal_unit(buf, buflen, 0, 0, &nal_offset);
-    while (next_type >= 0 && i < max) {
-        int type = next_type;
-        int start = nal_offset;
-        next_type = find_nal_unit(buf, buflen, nal_offset + 5, 1, &nal_offset);
-        int end = (next_type >= 0) ? nal_offset : buflen;
-        int length = end - start;
+// Rebuilds codec_data after the parameter sets were seen again; only a
+// real change is flagged for new caps. Called with spspps_lock held.
+static void update_codec_data(GstLibuvcH264Src *self) {
+    GstBuffer *codec_data = build_codec_data(self);
+    GstMapInfo map;
 
-        units[i].type = type;
-        units[i].len = length;
-        units[i].ptr = &buf[start];
+    if (!codec_data) {
+        return;
+    }
 
-        i++;
+    if (self->codec_data && gst_buffer_get_size(self->codec_data) == gst_buffer_get_size(codec_data) &&
+        gst_buffer_map(codec_data, &map, GST_MAP_READ)) {
+        gboolean same = gst_buffer_memcmp(self->codec_data, 0, map.data, map.size) == 0;
+        gst_buffer_unmap(codec_data, &map);
+        if (same) {
+            gst_buffer_unref(codec_data);
+            return;
+        }
     }
 
-    return i;
+    gst_buffer_replace(&self->codec_data, codec_data);
+    gst_buffer_unref(codec_data);
+    self->codec_data_changed = TRUE;
 }
 
-void load_spspps(GstLibuvcH264Src *self) {
-    FILE* fp = open_spspps_file(self, 'r');
-    if (fp) {
-        unsigned char buf[SPSPPSBUFSZ*2];
-        gint read_bytes = fread(buf, 1, sizeof(buf), fp);
-        fclose(fp);
+// VUI colour codes (ISO/IEC 23091-4) to what GStreamer calls them; codes it
+// has no name for come out unknown
+static GstVideoColorPrimaries sps_primaries(guint8 code) {
+    switch (code) {
+        case 1: return GST_VIDEO_COLOR_PRIMARIES_BT709;
+        case 4: return GST_VIDEO_COLOR_PRIMARIES_BT470M;
+        case 5: return GST_VIDEO_COLOR_PRIMARIES_BT470BG;
+        case 6: return GST_VIDEO_COLOR_PRIMARIES_SMPTE170M;
+        case 7: return GST_VIDEO_COLOR_PRIMARIES_SMPTE240M;
+        case 8: return GST_VIDEO_COLOR_PRIMARIES_FILM;
+        case 9: return GST_VIDEO_COLOR_PRIMARIES_BT2020;
+        default: return GST_VIDEO_COLOR_PRIMARIES_UNKNOWN;
+    }
+}
+
+static GstVideoTransferFunction sps_transfer(guint8 code) {
+    switch (code) {
+        case 1: case 6: case 14: return GST_VIDEO_TRANSFER_BT709;
+        case 4: return GST_VIDEO_TRANSFER_GAMMA22;
+        case 5: return GST_VIDEO_TRANSFER_GAMMA28;
+        case 7: return GST_VIDEO_TRANSFER_SMPTE240M;
+        case 8: return GST_VIDEO_TRANSFER_GAMMA10;
+        case 13: return GST_VIDEO_TRANSFER_SRGB;
+        case 15: return GST_VIDEO_TRANSFER_BT2020_12;
+        default: return GST_VIDEO_TRANSFER_UNKNOWN;
+    }
+}
+
+static GstVideoColorMatrix sps_matrix(guint8 code) {
+    switch (code) {
+        case 0: return GST_VIDEO_COLOR_MATRIX_RGB;
+        case 1: return GST_VIDEO_COLOR_MATRIX_BT709;
+        case 4: return GST_VIDEO_COLOR_MATRIX_FCC;
+        case 5: case 6: return GST_VIDEO_COLOR_MATRIX_BT601;
+        case 7: return GST_VIDEO_COLOR_MATRIX_SMPTE240M;
+        case 9: return GST_VIDEO_COLOR_MATRIX_BT2020;
+        default: return GST_VIDEO_COLOR_MATRIX_UNKNOWN;
+    }
+}
+
+// gst_structure_foreach() callback copying fields into the structure given
+static gboolean set_caps_field(GQuark field, const GValue *value, gpointer user_data) {
+    gst_structure_id_set_value(user_data, field, value);
+    return TRUE;
+}
 
-        #define MAX_UNITS_LOAD 2
-        nal_unit_t units[MAX_UNITS_LOAD];
-        int c = parse_nal_units(units, MAX_UNITS_LOAD, buf, read_bytes);
-
-        for (int i = 0; i < c; i++) {
-            if (units[i].type == 7) {
-                memcpy(self->sps, units[i].ptr, units[i].len);
-                self->sps_length = units[i].len;
-            } else if (units[i].type == 8) {
-                memcpy(self->pps, units[i].ptr, units[i].len);
-                self->pps_length = units[i].len;
+// The caps fields an SPS (and for avc the parameter sets) decide, to be
+// merged into the negotiated caps; for avc, called with spspps_lock held
+static GstStructure *build_caps_update(GstLibuvcH264Src *self, const h264_sps_t *sps,
+                                       gboolean avc) {
+    GstStructure *update = gst_structure_new_empty("video/x-h264");
+
+    if (sps->width > 0) {
+        const gchar *profile = h264_sps_profile(sps);
+        gchar *level = h264_sps_level(sps);
+
+        gst_structure_set(update,
+                          "width", G_TYPE_INT, sps->width,
+                          "height", G_TYPE_INT, sps->height,
+                          "pixel-aspect-ratio", GST_TYPE_FRACTION, sps->par_n, sps->par_d,
+                          "interlace-mode", G_TYPE_STRING, sps->interlaced ? "mixed" : "progressive",
+                          "level", G_TYPE_STRING, level,
+                          NULL);
+        if (profile) {
+            gst_structure_set(update, "profile", G_TYPE_STRING, profile, NULL);
+        }
+        // Two ticks to a frame (E.2.1); anything past 1000 fps is a bogus VUI
+        if (sps->timing_info && sps->time_scale / 2 / sps->num_units_in_tick <= 1000 &&
+            sps->num_units_in_tick <= G_MAXINT / 2 && sps->time_scale <= G_MAXINT) {
+            gst_structure_set(update, "framerate", GST_TYPE_FRACTION,
+                              (gint)sps->time_scale, (gint)sps->num_units_in_tick * 2, NULL);
+        }
+        if (sps->colour_description) {
+            GstVideoColorimetry cinfo = {
+                .range = sps->full_range ? GST_VIDEO_COLOR_RANGE_0_255 : GST_VIDEO_COLOR_RANGE_16_235,
+                .matrix = sps_matrix(sps->matrix_coefficients),
+                .transfer = sps_transfer(sps->transfer_characteristics),
+                .primaries = sps_primaries(sps->colour_primaries),
+            };
+            gchar *colorimetry = gst_video_colorimetry_to_string(&cinfo);
+            if (colorimetry) {
+                gst_structure_set(update, "colorimetry", G_TYPE_STRING, colorimetry, NULL);
             }
+            g_free(colorimetry);
+        }
+        g_free(level);
+    }
+    if (avc && self->codec_data) {
+        gst_structure_set(update, "codec_data", GST_TYPE_BUFFER, self->codec_data, NULL);
+    }
+
+    return update;
+}
+
+typedef struct {
+    gchar *name;
+    GBytes *data; // SPS and PPS, back to back
+} spspps_store_t;
+
+// Runs on spspps_writer: writes a temporary file and renames it over the
+// cache, so a crash or power cut leaves either the old or the new one
+static void spspps_store_job(gpointer data, gpointer user_data) {
+    GstLibuvcH264Src *self = user_data;
+    spspps_store_t *job = data;
+    gsize size;
+    const guint8 *bytes = g_bytes_get_data(job->data, &size);
+
+    create_hidden_directory(self);
+    char *file_name = get_spspps_path(self, job->name);
+    if (file_name) {
+        gchar *tmp_name = g_strconcat(file_name, ".tmp", NULL);
+        FILE *fp = fopen(tmp_name, "wb");
+        gboolean ok = fp != NULL;
+
+        if (fp) {
+            ok = fwrite(bytes, 1, size, fp) == size && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+            ok = fclose(fp) == 0 && ok;
+        }
+        if (ok && rename(tmp_name, file_name) == 0) {
+            GST_DEBUG_OBJECT(self, "Stored SPS/PPS in %s", file_name);
+        } else {
+            GST_WARNING_OBJECT(self, "Unable to store SPS/PPS in %s: %s", file_name, g_strerror(errno));
+            unlink(tmp_name);
         }
+        g_free(tmp_name);
     }
+
+    g_free(job->name);
+    g_bytes_unref(job->data);
+    g_free(job);
 }
 
+// Hands the current SPS and PPS to the writer; frame_callback() must not
+// wait for a file system that may take tens of milliseconds per write
 void store_spspps(GstLibuvcH264Src *self) {
-    FILE* fp = open_spspps_file(self, 'w');
-	if (fp) {
-		fwrite(self->sps, 1, self->sps_length, fp);
-		fwrite(self->pps, 1, self->pps_length, fp);
-		fclose(fp);
-	}
+    if (!self->spspps_writer) {
+        return;
+    }
+
+    guint8 *data = g_malloc(self->sps_length + self->pps_length);
+    memcpy(data, self->sps, self->sps_length);
+    memcpy(data + self->sps_length, self->pps, self->pps_length);
+
+    spspps_store_t *job = g_new(spspps_store_t, 1);
+    job->name = spspps_file_name(self);
+    job->data = g_bytes_new_take(data, self->sps_length + self->pps_length);
+    g_thread_pool_push(self->spspps_writer, job, NULL);
+    self->spspps_stored = TRUE;
+}
+
+static uvc_error_t shared_context_acquire(uvc_context_t **ctx) {
+    uvc_error_t res = UVC_SUCCESS;
+
+    g_mutex_lock(&shared_ctx_lock);
+    if (!shared_ctx) {
+        res = uvc_init(&shared_ctx, NULL);
+        if (res < 0) {
+            shared_ctx = NULL;
+        }
+    }
+    if (shared_ctx) {
+        shared_ctx_refs++;
+    }
+    *ctx = shared_ctx;
+    g_mutex_unlock(&shared_ctx_lock);
+
+    return res;
+}
+
+static void context_release(uvc_context_t *ctx) {
+    g_mutex_lock(&shared_ctx_lock);
+    if (ctx != shared_ctx) {
+        uvc_exit(ctx);
+    } else if (--shared_ctx_refs == 0) {
+        if (shared_dev_list) {
+            uvc_free_device_list(shared_dev_list, 1);
+            shared_dev_list = NULL;
+        }
+        uvc_exit(shared_ctx);
+        shared_ctx = NULL;
+    }
+    g_mutex_unlock(&shared_ctx_lock);
+}
+
+// Returns a new reference to the index-th UVC device. On the shared context
+// a recent enumeration is reused, so elements started at once scan the bus once
+static uvc_device_t *context_find_device(uvc_context_t *ctx, int index) {
+    uvc_device_t **dev_list = NULL;
+    uvc_device_t *dev = NULL;
+    gint64 now = g_get_monotonic_time();
+
+    g_mutex_lock(&shared_ctx_lock);
+    if (ctx == shared_ctx) {
+        if (shared_dev_list && now - shared_dev_list_time > DEVICE_LIST_MAX_AGE) {
+            uvc_free_device_list(shared_dev_list, 1);
+            shared_dev_list = NULL;
+        }
+        if (!shared_dev_list && uvc_find_devices(ctx, &shared_dev_list, 0, 0, NULL) < 0) {
+            shared_dev_list = NULL;
+        }
+        shared_dev_list_time = now;
+        dev_list = shared_dev_list;
+    } else if (uvc_find_devices(ctx, &dev_list, 0, 0, NULL) < 0) {
+        dev_list = NULL;
+    }
+
+    for (int i = 0; dev_list && dev_list[i] != NULL; ++i) {
+        if (i == index) {
+            dev = dev_list[i];
+            uvc_ref_device(dev);
+            break;
+        }
+    }
+
+    if (dev_list && dev_list != shared_dev_list) {
+        uvc_free_device_list(dev_list, 1);
+    }
+    g_mutex_unlock(&shared_ctx_lock);
+
+    return dev;
 }
 
 static void gst_libuvc_h264_src_init(GstLibuvcH264Src *self) {
@@ -200,15 +738,85 @@ static void gst_libuvc_h264_src_init(GstLibuvcH264Src *self) {
   self->uvc_dev = NULL;
   self->uvc_devh = NULL;
   self->frame_queue = g_async_queue_new();
+  self->nal_units = g_array_new(FALSE, FALSE, sizeof(nal_scan_unit_t));
+  self->max_queue_time = DEFAULT_MAX_QUEUE_TIME;
+  self->max_queue_buffers = DEFAULT_MAX_QUEUE_BUFFERS;
+  self->queued_time = 0;
+  self->drop_until_idr = FALSE;
+  self->dropped_frames = 0;
+  self->dropped_gops = 0;
+  self->flushing = FALSE;
+  self->stall_timeout = DEFAULT_STALL_TIMEOUT;
+  self->stall_action = DEFAULT_STALL_ACTION;
+  self->stalled = FALSE;
+  self->gap_position = GST_CLOCK_TIME_NONE;
+  self->vendor_id = 0;
+  self->product_id = 0;
+  self->serial = NULL;
+  self->disconnect_time = 0;
+  self->reconnect_timeout = DEFAULT_RECONNECT_TIMEOUT;
+  self->reconnects = 0;
+  self->reconnect_time = 0;
+  self->watchdog_timeout = DEFAULT_WATCHDOG_TIMEOUT;
+  self->watchdog_armed = FALSE;
+  self->watchdog_level = 0;
+  self->watchdog_silence = 0;
+  memset(self->recoveries, 0, sizeof(self->recoveries));
+  self->recovery_time = 0;
+  self->bitrate = DEFAULT_BITRATE;
+  self->quality = DEFAULT_QUALITY;
+  self->encoder_changed = FALSE;
+  self->keyframe_method = DEFAULT_KEYFRAME_METHOD;
+  self->keyframe_interval = DEFAULT_KEYFRAME_INTERVAL;
+  self->keyframe_xu_request = NULL;
+  self->keyframe_pending = FALSE;
+  self->keyframe_announce = FALSE;
+  self->keyframe_all_headers = FALSE;
+  self->keyframe_count = 0;
+  self->keyframe_headers = FALSE;
+  self->keyframe_request_time = 0;
+  self->keyframe_requests = 0;
+  self->fast_start = DEFAULT_FAST_START;
+  self->start_time = 0;
+  self->first_idr_time = 0;
   self->streaming = FALSE;
+  self->playing = FALSE;
   self->uvc_start_time = G_MAXUINT64;
   self->prev_pts = G_MAXUINT64;
+  self->last_sequence = -1;
+  self->pending_gap = 0;
+  self->latency_peak = 0;
+  self->latency = 0;
+  self->spspps_stored = FALSE;
+  self->spspps_writer = NULL;
+  self->spspps_mem = NULL;
+  self->spspps_mem_avc = FALSE;
+  self->avc = FALSE;
+  self->codec_data = NULL;
+  self->codec_data_changed = FALSE;
+  self->sps_known = FALSE;
+  self->pps_known = FALSE;
+  self->sps_info_changed = FALSE;
+  self->caps_need_sps = FALSE;
+  self->uvc_strmh = NULL;
+  self->frame_pool = NULL;
+  self->transfer_count = DEFAULT_TRANSFER_COUNT;
+  self->packets_per_transfer = DEFAULT_PACKETS_PER_TRANSFER;
+  self->transfer_memory = DEFAULT_TRANSFER_MEMORY;
+  self->direct_dispatch = DEFAULT_DIRECT_DISPATCH;
+  self->event_loop = DEFAULT_EVENT_LOOP;
+  self->timestamp_mode = DEFAULT_TIMESTAMP_MODE;
+  self->timestamp_estimator = DEFAULT_TIMESTAMP_ESTIMATOR;
+  ts_estimator_init(&self->ts_est, self->timestamp_estimator, 0);
+  self->frame_fd = -1;
+  self->usb_pollfds_changed = 0;
   
   // Control socket initialization
   self->control_socket = -1;
   self->control_thread = NULL;
   self->control_running = FALSE;
   g_mutex_init(&self->control_mutex);
+  g_mutex_init(&self->spspps_lock);
 
   gchar sps[] = { 0x00, 0x00, 0x00, 0x01, 0x67, 0x64, 0x00, 0x34, 0xAC, 0x4D, 0x00, 0xF0, 0x04, 0x4F, 0xCB, 0x35, 0x01, 0x01, 0x01, 0x40, 0x00, 0x00, 0xFA, 0x00, 0x00, 0x3A, 0x98, 0x03, 0xC7, 0x0C, 0xA8 };
   self->sps_length = sizeof(sps);
@@ -281,19 +889,25 @@ static void gst_libuvc_h264_src_force_usb_release(GstLibuvcH264Src *self) {
     // Note: uvc_close() will fail if we call it now, but that's OK
 }
 
-// Control socket thread function
-static gpointer gst_libuvc_h264_src_control_thread(gpointer data) {
-    GstLibuvcH264Src *self = (GstLibuvcH264Src *)data;
+// libusb changed the descriptors it needs watched; the event loop
+// fetches the new set before its next poll
+static void usb_pollfd_added(int fd G_GNUC_UNUSED, short events G_GNUC_UNUSED, void *user_data) {
+    GstLibuvcH264Src *self = (GstLibuvcH264Src *)user_data;
+    g_atomic_int_set(&self->usb_pollfds_changed, 1);
+}
+
+static void usb_pollfd_removed(int fd G_GNUC_UNUSED, void *user_data) {
+    GstLibuvcH264Src *self = (GstLibuvcH264Src *)user_data;
+    g_atomic_int_set(&self->usb_pollfds_changed, 1);
+}
+
+static gboolean gst_libuvc_h264_src_open_control_socket(GstLibuvcH264Src *self) {
     struct sockaddr_un addr;
-    int client_fd;
-    char buffer[256];
-    fd_set read_fds;
-    struct timeval timeout;
-    
+
     self->control_socket = socket(AF_UNIX, SOCK_STREAM, 0);
     if (self->control_socket < 0) {
         GST_ERROR_OBJECT(self, "Failed to create control socket");
-        return NULL;
+        return FALSE;
     }
     
     int flags = fcntl(self->control_socket, F_GETFL, 0);
@@ -309,28 +923,96 @@ static gpointer gst_libuvc_h264_src_control_thread(gpointer data) {
         GST_ERROR_OBJECT(self, "Failed to bind control socket");
         close(self->control_socket);
         self->control_socket = -1;
-        return NULL;
+        return FALSE;
     }
     
     if (listen(self->control_socket, 5) < 0) {
         GST_ERROR_OBJECT(self, "Failed to listen on control socket");
         close(self->control_socket);
         self->control_socket = -1;
-        return NULL;
+        return FALSE;
     }
     
     GST_INFO_OBJECT(self, "Control socket listening on /tmp/libuvc_control");
+    return TRUE;
+}
+
+// Control socket thread function. With event-loop set it also replaces
+// libuvc's USB event thread and the stream callback thread: one poll()
+// covers the control socket, libusb's descriptors and the frame queue
+static gpointer gst_libuvc_h264_src_control_thread(gpointer data) {
+    GstLibuvcH264Src *self = (GstLibuvcH264Src *)data;
+    int client_fd;
+    char buffer[256];
+    struct pollfd fds[MAX_EVENT_LOOP_FDS];
+    const struct libusb_pollfd **usb_fds = NULL;
+    
+    // Without the socket the loop is still needed to drive USB
+    if (!gst_libuvc_h264_src_open_control_socket(self) && !self->event_loop) {
+        return NULL;
+    }
     
     while (self->control_running) {
-        FD_ZERO(&read_fds);
-        FD_SET(self->control_socket, &read_fds);
-        
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        
-        int result = select(self->control_socket + 1, &read_fds, NULL, NULL, &timeout);
-        
-        if (result > 0 && FD_ISSET(self->control_socket, &read_fds)) {
+        int nfds = 0;
+        int frame_idx = -1;
+        int timeout_ms = 1000;
+
+        if (self->control_socket >= 0) {
+            fds[nfds].fd = self->control_socket;
+            fds[nfds].events = POLLIN;
+            nfds++;
+        }
+
+        if (self->event_loop) {
+            int frame_fd = g_atomic_int_get(&self->frame_fd);
+            if (frame_fd >= 0) {
+                frame_idx = nfds;
+                fds[nfds].fd = frame_fd;
+                fds[nfds].events = POLLIN;
+                nfds++;
+            }
+
+            if (g_atomic_int_compare_and_exchange(&self->usb_pollfds_changed, 1, 0)) {
+                uvc_free_pollfds(usb_fds);
+                usb_fds = uvc_get_pollfds(self->uvc_ctx);
+            }
+            for (int i = 0; usb_fds && usb_fds[i] && nfds < MAX_EVENT_LOOP_FDS; i++) {
+                fds[nfds].fd = usb_fds[i]->fd;
+                fds[nfds].events = usb_fds[i]->events;
+                nfds++;
+            }
+
+            timeout_ms = EVENT_LOOP_TIMEOUT_MS;
+        }
+
+        int result = poll(fds, nfds, timeout_ms);
+        if (result < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (self->control_running) {
+                GST_WARNING_OBJECT(self, "Poll error in control thread");
+            }
+            break;
+        }
+
+        if (self->event_loop) {
+            // Completes transfers, which queues any frames they finish
+            uvc_handle_events_timeout(self->uvc_ctx, 0);
+
+            if (frame_idx >= 0 && (fds[frame_idx].revents & POLLIN)) {
+                uvc_frame_t *frame;
+                // A reconnect may have closed the stream since the poll
+                g_mutex_lock(&self->control_mutex);
+                while (g_atomic_int_get(&self->frame_fd) >= 0 &&
+                       uvc_stream_get_frame(self->uvc_strmh, &frame, -1) == UVC_SUCCESS && frame) {
+                    frame_callback(frame, self);
+                }
+                g_mutex_unlock(&self->control_mutex);
+            }
+        }
+
+        if (self->control_socket >= 0 && (fds[0].revents & POLLIN)) {
             client_fd = accept(self->control_socket, NULL, NULL);
             if (client_fd > 0) {
                 ssize_t len = read(client_fd, buffer, sizeof(buffer)-1);
@@ -345,16 +1027,10 @@ static gpointer gst_libuvc_h264_src_control_thread(gpointer data) {
                 }
                 close(client_fd);
             }
-        } else if (result == 0) {
-            continue;
-        } else {
-            if (self->control_running) {
-                GST_WARNING_OBJECT(self, "Select error in control thread");
-            }
-            break;
         }
     }
     
+    uvc_free_pollfds(usb_fds);
     GST_DEBUG_OBJECT(self, "Control thread exiting");
     return NULL;
 }
@@ -362,6 +1038,7 @@ static gpointer gst_libuvc_h264_src_control_thread(gpointer data) {
 static char* gst_libuvc_h264_src_process_control_command(GstLibuvcH264Src *self, const char *command) {
     int pan, tilt, zoom;
     uint16_t zoom_abs;
+    guint bitrate, quality;
     
     g_mutex_lock(&self->control_mutex);
     
@@ -394,6 +1071,40 @@ static char* gst_libuvc_h264_src_process_control_command(GstLibuvcH264Src *self,
             }
         }
     }
+    else if (sscanf(command, "BITRATE %u", &bitrate) == 1) {
+        // Applied by the streaming thread, or when the stream starts
+        g_mutex_unlock(&self->control_mutex);
+        g_object_set(self, "bitrate", bitrate, NULL);
+        GST_INFO_OBJECT(self, "Set bitrate to: %u", bitrate);
+        return g_strdup_printf("OK bitrate=%u", bitrate);
+    }
+    else if (sscanf(command, "QUALITY %u", &quality) == 1) {
+        g_mutex_unlock(&self->control_mutex);
+        if (quality > MAX_QUALITY) {
+            return g_strdup_printf("ERROR: quality must be 0-%d", MAX_QUALITY);
+        }
+        g_object_set(self, "quality", quality, NULL);
+        GST_INFO_OBJECT(self, "Set quality to: %u", quality);
+        return g_strdup_printf("OK quality=%u", quality);
+    }
+    else if (strcmp(command, "GET_ENCODER") == 0) {
+        if (self->uvc_devh) {
+            uint32_t current_bitrate;
+            char *response;
+
+            GST_OBJECT_LOCK(self);
+            quality = self->quality;
+            GST_OBJECT_UNLOCK(self);
+
+            if (uvc_get_average_bitrate(self->uvc_devh, &current_bitrate, UVC_GET_CUR) == UVC_SUCCESS) {
+                response = g_strdup_printf("OK bitrate=%u quality=%u", current_bitrate, quality);
+            } else {
+                response = g_strdup_printf("OK bitrate=unknown quality=%u", quality);
+            }
+            g_mutex_unlock(&self->control_mutex);
+            return response;
+        }
+    }
     else if (strcmp(command, "GET_POSITION") == 0) {
         if (self->uvc_devh) {
             int32_t current_pan, current_tilt;
@@ -451,8 +1162,73 @@ static char* gst_libuvc_h264_src_process_control_command(GstLibuvcH264Src *self,
     return g_strdup("ERROR: Unknown command");
 }
 
-static gboolean gst_libuvc_h264_negotiate(GstBaseSrc * basesrc) {
-    GstLibuvcH264Src *self = GST_LIBUVC_H264_SRC(basesrc);
+static GstStateChangeReturn gst_libuvc_h264_src_change_state(GstElement *element,
+                                                             GstStateChange transition) {
+  GstLibuvcH264Src *self = GST_LIBUVC_H264_SRC(element);
+  GstStateChangeReturn ret;
+
+  switch (transition) {
+    case GST_STATE_CHANGE_PAUSED_TO_PLAYING:
+      // base_time is set by now; durations restart with the new segment.
+      // prev_pts belongs to the streaming thread, which clears it.
+      g_atomic_int_set(&self->reset_prev_pts, TRUE);
+      g_atomic_int_set(&self->playing, TRUE);
+      // Frames are dropped while PAUSED, so the stream would otherwise
+      // start at whichever IDR the camera sends next
+      GST_OBJECT_LOCK(self);
+      if (self->fast_start) {
+        self->keyframe_pending = TRUE;
+        g_async_queue_push(self->frame_queue, QUEUE_WAKEUP);
+      }
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case GST_STATE_CHANGE_PLAYING_TO_PAUSED:
+      g_atomic_int_set(&self->playing, FALSE);
+      break;
+    default:
+      break;
+  }
+
+  ret = GST_ELEMENT_CLASS(gst_libuvc_h264_src_parent_class)->change_state(element, transition);
+
+  // Frames captured before the pause would only arrive late after it
+  if (transition == GST_STATE_CHANGE_PLAYING_TO_PAUSED) {
+    gst_libuvc_h264_src_flush_queue(self);
+  }
+
+  return ret;
+}
+
+// Nominal rate for a frame interval in 100 ns units. Descriptors round the
+// period, so 1/30 s is 333333 and 1/29.97 s is 333667; caps want 30/1 and
+// 30000/1001, not the raw quotient.
+static void frame_interval_to_fraction(guint32 interval, gint *num, gint *den) {
+    // Whole rates, half rates (7.5 fps), then the NTSC N*1000/1001 ones
+    static const struct { gint mult; gint den; } forms[] = {
+        { 1, 1 }, { 1, 2 }, { 1000, 1001 },
+    };
+    gdouble rate = 1e7 / interval;
+
+    for (guint i = 0; i < G_N_ELEMENTS(forms); i++) {
+        gint n = (gint)(rate * forms[i].den / forms[i].mult + 0.5) * forms[i].mult;
+        gdouble nominal = (gdouble)n / forms[i].den;
+
+        // One 100 ns step is well under 1e-4 of any sane period; the NTSC
+        // rates are 1e-3 off the whole ones
+        if (n > 0 && ABS(rate - nominal) <= nominal * 1e-4) {
+            *num = n;
+            *den = forms[i].den;
+            return;
+        }
+    }
+    *num = 10000000;
+    *den = (gint)interval;
+}
+
+// Picks the largest, then fastest, H.264 format both the camera and the
+// peer can do and fills in the stream control for it
+static GstCaps *gst_libuvc_h264_src_select_format(GstLibuvcH264Src *self) {
+    GstBaseSrc *basesrc = GST_BASE_SRC(self);
 
     GstCaps *thiscaps = gst_pad_query_caps(GST_BASE_SRC_PAD(basesrc), NULL);
     GST_INFO_OBJECT(basesrc, "caps of src: %" GST_PTR_FORMAT, thiscaps);
@@ -472,13 +1248,12 @@ static gboolean gst_libuvc_h264_negotiate(GstBaseSrc * basesrc) {
     GST_INFO_OBJECT(basesrc, "caps intersection: %" GST_PTR_FORMAT, caps);
 
     gint width = -1, height = -1, framerate = -1;
+    gint fr_num = 0, fr_den = 1;
     GstCaps *best_caps = NULL;
 
-    GstCaps *tmp_caps = gst_caps_new_simple("video/x-h264",
-                                            "stream-format", G_TYPE_STRING, "byte-stream",
-                                            "alignment", G_TYPE_STRING, "au",
-                                            NULL
-                                           );
+    GstCaps *tmp_caps = gst_caps_from_string("video/x-h264, "
+                                             "stream-format=(string){ byte-stream, avc }, "
+                                             "alignment=(string)au");
     GstStructure *tmp_structure = gst_caps_get_structure(tmp_caps, 0);
 
     for (const uvc_format_desc_t *format_desc = uvc_get_format_descs(self->uvc_devh);
@@ -508,17 +1283,23 @@ static gboolean gst_libuvc_h264_negotiate(GstBaseSrc * basesrc) {
                         fps = _fps;
                     }
 
+                    // Snapped rate; uvc_ctrl keeps the exact interval
+                    gint num, den;
+                    frame_interval_to_fraction(*interval, &num, &den);
                     GValue fps = G_VALUE_INIT;
                     g_value_init(&fps, GST_TYPE_FRACTION);
-                    gst_value_set_fraction(&fps, (gint)_fps, 1);
+                    gst_value_set_fraction(&fps, num, den);
                     gst_value_list_append_value(&framerates, &fps);
                 }
 
                 gst_structure_set_value(tmp_structure, "framerate", &framerates);
             } else {
-                gint fps_min = 1e7 / frame_desc->dwMaxFrameInterval;
-                gint fps = 1e7 / frame_desc->dwMinFrameInterval;
-                gst_structure_set(tmp_structure, "framerate", GST_TYPE_FRACTION_RANGE, fps_min, 1, fps, 1, NULL);
+                gint min_num, min_den, max_num, max_den;
+                frame_interval_to_fraction(frame_desc->dwMaxFrameInterval, &min_num, &min_den);
+                frame_interval_to_fraction(frame_desc->dwMinFrameInterval, &max_num, &max_den);
+                gst_structure_set(tmp_structure, "framerate", GST_TYPE_FRACTION_RANGE,
+                                  min_num, min_den, max_num, max_den, NULL);
+                fps = 1e7 / frame_desc->dwMinFrameInterval;
             }
 
             if (gst_caps_can_intersect(caps, tmp_caps)) {
@@ -534,7 +1315,6 @@ static gboolean gst_libuvc_h264_negotiate(GstBaseSrc * basesrc) {
                     GstStructure *s = gst_caps_get_structure(best_caps, 0);
                     gst_structure_fixate_field_nearest_fraction(s, "framerate", fps, 1);
 
-                    gint fr_num, fr_den;
                     gst_structure_get_fraction(s, "framerate", &fr_num, &fr_den);
                     framerate = fr_num / fr_den;
                 }
@@ -543,24 +1323,124 @@ static gboolean gst_libuvc_h264_negotiate(GstBaseSrc * basesrc) {
     }
 
     gst_caps_unref(tmp_caps);
+    gst_caps_unref(caps);
 
     if (width < 0 || height < 0 || framerate < 0 || !best_caps) {
         GST_ERROR_OBJECT(self, "Unable to negotiate common caps\n");
-        return FALSE;
+        if (best_caps) {
+            gst_caps_unref(best_caps);
+        }
+        return NULL;
     }
 
     int res = uvc_get_stream_ctrl_format_size(self->uvc_devh, &self->uvc_ctrl,
                                               UVC_FRAME_FORMAT_H264, width, height, framerate);
     if (res < 0) {
         GST_ERROR_OBJECT(self, "Unable to get stream control: %s", uvc_strerror(res));
+        gst_caps_unref(best_caps);
+        return NULL;
+    }
+
+    // The interval the camera agreed to is exact; the caps rate is the fallback
+    if (self->uvc_ctrl.dwFrameInterval) {
+        self->frame_interval = (gint64)self->uvc_ctrl.dwFrameInterval * 100;
+    } else {
+        self->frame_interval = gst_util_uint64_scale_int(GST_SECOND, fr_den, fr_num);
+    }
+
+    // Until frames are measured, assume assembling one takes a frame interval
+    GST_OBJECT_LOCK(self);
+    if (self->latency == 0) {
+        self->latency = self->latency_peak = self->frame_interval;
+    }
+    GST_OBJECT_UNLOCK(self);
+
+    return best_caps;
+}
+
+static gboolean gst_libuvc_h264_negotiate(GstBaseSrc * basesrc) {
+    GstLibuvcH264Src *self = GST_LIBUVC_H264_SRC(basesrc);
+    GstCaps *best_caps = gst_libuvc_h264_src_select_format(self);
+    gboolean fast_start;
+
+    if (!best_caps) {
         return FALSE;
     }
 
-    self->frame_interval = (1000L * 1000L * 1000L) / framerate;
+    // Whichever format the peer lists first, byte-stream if it does not care.
+    // For avc the cached parameter sets stand in until the camera sends its own;
+    // with none cached, avc caps would lack codec_data, so byte-stream wins
+    // whenever the peer takes it. While streaming, frame_callback() owns the
+    // parameter sets and keeps codec_data current; a renegotiation only takes
+    // a snapshot of it.
+    GstStructure *s = gst_caps_get_structure(best_caps, 0);
+    GstBuffer *codec_data;
+    g_mutex_lock(&self->spspps_lock);
+    if (!self->streaming) {
+        update_codec_data(self);
+        self->codec_data_changed = FALSE;
+    }
+    codec_data = self->codec_data ? gst_buffer_ref(self->codec_data) : NULL;
+    g_mutex_unlock(&self->spspps_lock);
+    if (!codec_data) {
+        gst_structure_fixate_field_string(s, "stream-format", "byte-stream");
+    }
+    gst_structure_fixate_field(s, "stream-format");
+    gboolean avc = g_strcmp0(gst_structure_get_string(s, "stream-format"), "avc") == 0;
+    g_atomic_int_set(&self->avc, avc);
+    g_atomic_int_set(&self->caps_need_sps, TRUE);
+    if (avc) {
+        if (codec_data) {
+            gst_structure_set(s, "codec_data", GST_TYPE_BUFFER, codec_data, NULL);
+        } else {
+            // The first IDR brings codec_data in a caps update
+            GST_WARNING_OBJECT(self, "Peer only takes avc and no SPS/PPS is cached yet, "
+                               "codec_data follows with the first IDR");
+        }
+    }
+    if (codec_data) {
+        gst_buffer_unref(codec_data);
+    }
+
+    // The cached SPS is as good a guess as any for what the camera sends in
+    // the negotiated size, and lets downstream set up before the first IDR.
+    // Only before the stream runs: frame_callback() owns the parameter sets.
+    GST_OBJECT_LOCK(self);
+    fast_start = self->fast_start;
+    GST_OBJECT_UNLOCK(self);
+    if (fast_start && !self->streaming) {
+        h264_sps_t sps;
+        gint width, height;
+        gboolean parsed;
+
+        g_mutex_lock(&self->spspps_lock);
+        gint skip = start_code_length(self->sps, self->sps_length);
+        parsed = self->sps_known && h264_sps_parse(&sps, self->sps + skip, self->sps_length - skip);
+        g_mutex_unlock(&self->spspps_lock);
+
+        if (parsed && gst_structure_get_int(s, "width", &width) &&
+            gst_structure_get_int(s, "height", &height) &&
+            sps.width == width && sps.height == height) {
+            GstStructure *update = build_caps_update(self, &sps, FALSE);
+            // The negotiated rate is what the camera agreed to
+            gst_structure_remove_field(update, "framerate");
+            gst_structure_foreach(update, set_caps_field, s);
+            gst_structure_free(update);
+        }
+    }
 
     gst_base_src_set_caps(basesrc, best_caps);
 
     GST_INFO_OBJECT(basesrc, "Negotiated caps: %" GST_PTR_FORMAT, best_caps);
+    gst_caps_unref(best_caps);
+
+    // Negotiation happens as the element goes to PAUSED; if the stream does
+    // not start here, create() tries again once PLAYING
+    if (fast_start && !self->streaming && !self->disconnect_time) {
+        if (!gst_libuvc_h264_src_start_session(self)) {
+            GST_WARNING_OBJECT(self, "Fast start failed, starting the stream when playing");
+        }
+    }
 
     return TRUE;
 }
@@ -574,12 +1454,141 @@ static void gst_libuvc_h264_src_set_property(GObject *object, guint prop_id,
       g_free(self->index);
       self->index = g_value_dup_string(value);
       break;
+    case PROP_TRANSFER_COUNT:
+      self->transfer_count = g_value_get_int(value);
+      break;
+    case PROP_PACKETS_PER_TRANSFER:
+      self->packets_per_transfer = g_value_get_int(value);
+      break;
+    case PROP_TRANSFER_MEMORY:
+      self->transfer_memory = g_value_get_uint64(value);
+      break;
+    case PROP_DIRECT_DISPATCH:
+      self->direct_dispatch = g_value_get_boolean(value);
+      break;
+    case PROP_EVENT_LOOP:
+      self->event_loop = g_value_get_boolean(value);
+      break;
+    case PROP_TIMESTAMP_MODE:
+      self->timestamp_mode = g_value_get_enum(value);
+      break;
+    case PROP_TIMESTAMP_ESTIMATOR:
+      self->timestamp_estimator = g_value_get_enum(value);
+      break;
+    case PROP_MAX_QUEUE_TIME:
+      GST_OBJECT_LOCK(self);
+      self->max_queue_time = g_value_get_uint64(value);
+      GST_OBJECT_UNLOCK(self);
+      gst_element_post_message(GST_ELEMENT_CAST(self),
+                               gst_message_new_latency(GST_OBJECT_CAST(self)));
+      break;
+    case PROP_MAX_QUEUE_BUFFERS:
+      GST_OBJECT_LOCK(self);
+      self->max_queue_buffers = g_value_get_uint(value);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_STALL_TIMEOUT:
+      GST_OBJECT_LOCK(self);
+      self->stall_timeout = g_value_get_uint64(value);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_STALL_ACTION:
+      GST_OBJECT_LOCK(self);
+      self->stall_action = g_value_get_enum(value);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_RECONNECT_TIMEOUT:
+      GST_OBJECT_LOCK(self);
+      self->reconnect_timeout = g_value_get_uint64(value);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_WATCHDOG_TIMEOUT:
+      GST_OBJECT_LOCK(self);
+      self->watchdog_timeout = g_value_get_uint64(value);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_KEYFRAME_METHOD:
+      GST_OBJECT_LOCK(self);
+      self->keyframe_method = g_value_get_enum(value);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_KEYFRAME_INTERVAL:
+      GST_OBJECT_LOCK(self);
+      self->keyframe_interval = g_value_get_uint64(value);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_KEYFRAME_XU_REQUEST:
+      GST_OBJECT_LOCK(self);
+      g_free(self->keyframe_xu_request);
+      self->keyframe_xu_request = g_value_dup_string(value);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_BITRATE:
+      GST_OBJECT_LOCK(self);
+      self->bitrate = g_value_get_uint(value);
+      self->encoder_changed = TRUE;
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_QUALITY:
+      GST_OBJECT_LOCK(self);
+      self->quality = g_value_get_uint(value);
+      self->encoder_changed = TRUE;
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_FAST_START:
+      GST_OBJECT_LOCK(self);
+      self->fast_start = g_value_get_boolean(value);
+      GST_OBJECT_UNLOCK(self);
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
       break;
   }
 }
 
+static GstStructure *gst_libuvc_h264_src_get_stats(GstLibuvcH264Src *self) {
+  ts_estimator_stats_t stats;
+  guint64 dropped_frames, dropped_gops;
+  guint reconnects;
+  GstClockTime reconnect_time;
+  guint recoveries[WATCHDOG_LEVELS];
+  GstClockTime recovery_time;
+  guint keyframe_requests;
+  GstClockTime first_idr_time;
+
+  GST_OBJECT_LOCK(self);
+  ts_estimator_get_stats(&self->ts_est, &stats);
+  dropped_frames = self->dropped_frames;
+  dropped_gops = self->dropped_gops;
+  reconnects = self->reconnects;
+  reconnect_time = self->reconnect_time;
+  memcpy(recoveries, self->recoveries, sizeof(recoveries));
+  recovery_time = self->recovery_time;
+  keyframe_requests = self->keyframe_requests;
+  first_idr_time = self->first_idr_time;
+  GST_OBJECT_UNLOCK(self);
+
+  return gst_structure_new("libuvch264src-stats",
+                           "frames", G_TYPE_UINT64, stats.frames,
+                           "resyncs", G_TYPE_UINT, stats.resyncs,
+                           "skew-ppm", G_TYPE_DOUBLE, stats.skew_ppm,
+                           "error-mean", G_TYPE_DOUBLE, stats.error_mean_ns,
+                           "error-rms", G_TYPE_DOUBLE, stats.error_rms_ns,
+                           "error-max", G_TYPE_INT64, stats.error_max_ns,
+                           "dropped-frames", G_TYPE_UINT64, dropped_frames,
+                           "dropped-gops", G_TYPE_UINT64, dropped_gops,
+                           "reconnects", G_TYPE_UINT, reconnects,
+                           "reconnect-time", G_TYPE_UINT64, reconnect_time,
+                           "recoveries-resubmit", G_TYPE_UINT, recoveries[UVC_STREAM_RESET_TRANSFERS],
+                           "recoveries-clear-halt", G_TYPE_UINT, recoveries[UVC_STREAM_RESET_CLEAR_HALT],
+                           "recoveries-commit", G_TYPE_UINT, recoveries[UVC_STREAM_RESET_COMMIT],
+                           "recoveries-reset", G_TYPE_UINT, recoveries[UVC_STREAM_RESET_DEVICE],
+                           "recovery-time", G_TYPE_UINT64, recovery_time,
+                           "keyframe-requests", G_TYPE_UINT, keyframe_requests,
+                           "first-idr-time", G_TYPE_UINT64, first_idr_time,
+                           NULL);
+}
+
 static void gst_libuvc_h264_src_get_property(GObject *object, guint prop_id,
                                              GValue *value, GParamSpec *pspec) {
   GstLibuvcH264Src *self = GST_LIBUVC_H264_SRC(object);
@@ -588,6 +1597,90 @@ static void gst_libuvc_h264_src_get_property(GObject *object, guint prop_id,
     case PROP_INDEX:
       g_value_set_string(value, self->index);
       break;
+    case PROP_TRANSFER_COUNT:
+      g_value_set_int(value, self->transfer_count);
+      break;
+    case PROP_PACKETS_PER_TRANSFER:
+      g_value_set_int(value, self->packets_per_transfer);
+      break;
+    case PROP_TRANSFER_MEMORY:
+      g_value_set_uint64(value, self->transfer_memory);
+      break;
+    case PROP_DIRECT_DISPATCH:
+      g_value_set_boolean(value, self->direct_dispatch);
+      break;
+    case PROP_EVENT_LOOP:
+      g_value_set_boolean(value, self->event_loop);
+      break;
+    case PROP_TIMESTAMP_MODE:
+      g_value_set_enum(value, self->timestamp_mode);
+      break;
+    case PROP_TIMESTAMP_ESTIMATOR:
+      g_value_set_enum(value, self->timestamp_estimator);
+      break;
+    case PROP_MAX_QUEUE_TIME:
+      GST_OBJECT_LOCK(self);
+      g_value_set_uint64(value, self->max_queue_time);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_MAX_QUEUE_BUFFERS:
+      GST_OBJECT_LOCK(self);
+      g_value_set_uint(value, self->max_queue_buffers);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_STALL_TIMEOUT:
+      GST_OBJECT_LOCK(self);
+      g_value_set_uint64(value, self->stall_timeout);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_STALL_ACTION:
+      GST_OBJECT_LOCK(self);
+      g_value_set_enum(value, self->stall_action);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_RECONNECT_TIMEOUT:
+      GST_OBJECT_LOCK(self);
+      g_value_set_uint64(value, self->reconnect_timeout);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_WATCHDOG_TIMEOUT:
+      GST_OBJECT_LOCK(self);
+      g_value_set_uint64(value, self->watchdog_timeout);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_KEYFRAME_METHOD:
+      GST_OBJECT_LOCK(self);
+      g_value_set_enum(value, self->keyframe_method);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_KEYFRAME_INTERVAL:
+      GST_OBJECT_LOCK(self);
+      g_value_set_uint64(value, self->keyframe_interval);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_KEYFRAME_XU_REQUEST:
+      GST_OBJECT_LOCK(self);
+      g_value_set_string(value, self->keyframe_xu_request);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_BITRATE:
+      GST_OBJECT_LOCK(self);
+      g_value_set_uint(value, self->bitrate);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_QUALITY:
+      GST_OBJECT_LOCK(self);
+      g_value_set_uint(value, self->quality);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_FAST_START:
+      GST_OBJECT_LOCK(self);
+      g_value_set_boolean(value, self->fast_start);
+      GST_OBJECT_UNLOCK(self);
+      break;
+    case PROP_STATS:
+      g_value_take_boxed(value, gst_libuvc_h264_src_get_stats(self));
+      break;
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID(object, prop_id, pspec);
       break;
@@ -597,58 +1690,79 @@ static void gst_libuvc_h264_src_get_property(GObject *object, guint prop_id,
 static gboolean gst_libuvc_h264_src_start(GstBaseSrc *src) {
   GstLibuvcH264Src *self = GST_LIBUVC_H264_SRC(src);
   uvc_error_t res;
+  gint64 settle_deadline = 0;
 
   GST_DEBUG_OBJECT(self, "Starting libuvc source");
+  self->start_time = g_get_monotonic_time();
+  GST_OBJECT_LOCK(self);
+  self->first_idr_time = 0;
+  GST_OBJECT_UNLOCK(self);
 
   // Check if we need to cleanup a previous session
   if (self->uvc_ctx != NULL || self->uvc_devh != NULL) {
     GST_WARNING_OBJECT(self, "Previous session not fully cleaned up, forcing cleanup");
     gst_libuvc_h264_src_stop(src);
-    usleep(1000000); // Wait 1 second for USB to settle
+    settle_deadline = g_get_monotonic_time() + DEVICE_SETTLE_TIMEOUT;
   }
 
-  // Initialize libuvc context
-  res = uvc_init(&self->uvc_ctx, NULL);
-  if (res < 0) {
-    GST_ERROR_OBJECT(self, "Failed to initialize libuvc: %s", uvc_strerror(res));
-    return FALSE;
+  // Initialize libuvc context; the event loop needs a private one since it
+  // runs the context's libusb events itself
+  if (self->event_loop) {
+    res = uvc_init(&self->uvc_ctx, NULL);
+  } else {
+    res = shared_context_acquire(&self->uvc_ctx);
   }
-  
-  uvc_device_t **dev_list;
-  res = uvc_find_devices(self->uvc_ctx, &dev_list, 0, 0, NULL);
   if (res < 0) {
-    GST_ERROR_OBJECT(self, "Unable to find any UVC devices");
-    uvc_exit(self->uvc_ctx);
-    self->uvc_ctx = NULL;
+    GST_ERROR_OBJECT(self, "Failed to initialize libuvc: %s", uvc_strerror(res));
     return FALSE;
   }
 
-  for (int i = 0; dev_list[i] != NULL; ++i) {
-    uvc_device_t *dev = dev_list[i];
-	if (i == atoi(self->index)) {
-		self->uvc_dev = dev;
-		break;
-	}
+  // The control thread takes over libusb event handling from libuvc
+  if (self->event_loop) {
+    uvc_set_external_events(self->uvc_ctx, 1);
+    uvc_set_pollfd_notifiers(self->uvc_ctx, usb_pollfd_added, usb_pollfd_removed, self);
+    self->usb_pollfds_changed = 1;
   }
   
-  if (!self->uvc_dev) {
-    GST_ERROR_OBJECT(self, "Unable to find UVC device: %s", self->index);
-    uvc_exit(self->uvc_ctx);
-    self->uvc_ctx = NULL;
-    return FALSE;
+  // Open the UVC device. After a forced cleanup it may take a moment to be
+  // usable again: retry until it is rather than sleeping for the worst case.
+  while (TRUE) {
+    self->uvc_dev = context_find_device(self->uvc_ctx, atoi(self->index));
+    if (self->uvc_dev) {
+      res = uvc_open(self->uvc_dev, &self->uvc_devh);
+      if (res >= 0) {
+        break;
+      }
+      uvc_unref_device(self->uvc_dev);
+      self->uvc_dev = NULL;
+    }
+    if (g_get_monotonic_time() >= settle_deadline) {
+      break;
+    }
+    g_usleep(DEVICE_SETTLE_INTERVAL);
   }
-
-  // Open the UVC device
-  res = uvc_open(self->uvc_dev, &self->uvc_devh);
-  if (res < 0) {
-    GST_ERROR_OBJECT(self, "Unable to open UVC device: %s", uvc_strerror(res));
-    uvc_unref_device(self->uvc_dev);
-    self->uvc_dev = NULL;
-    uvc_exit(self->uvc_ctx);
+  if (!self->uvc_dev) {
+    if (res < 0) {
+      GST_ERROR_OBJECT(self, "Unable to open UVC device: %s", uvc_strerror(res));
+    } else {
+      GST_ERROR_OBJECT(self, "Unable to find UVC device: %s", self->index);
+    }
+    context_release(self->uvc_ctx);
     self->uvc_ctx = NULL;
     return FALSE;
   }
 
+  // Remembered to find the camera again if it drops off the bus
+  uvc_device_descriptor_t *desc;
+  if (uvc_get_device_descriptor(self->uvc_dev, &desc) == UVC_SUCCESS) {
+    self->vendor_id = desc->idVendor;
+    self->product_id = desc->idProduct;
+    g_free(self->serial);
+    self->serial = g_strdup(desc->serialNumber);
+    uvc_free_device_descriptor(desc);
+  }
+  self->disconnect_time = 0;
+
   // Start control socket thread
   self->control_running = TRUE;
   self->control_thread = g_thread_new("uvc-control", 
@@ -656,6 +1770,8 @@ static gboolean gst_libuvc_h264_src_start(GstBaseSrc *src) {
                                      self);
 
   load_spspps(self);
+  // One thread at most keeps the writes in order
+  self->spspps_writer = g_thread_pool_new(spspps_store_job, self, 1, FALSE, NULL);
 
   GST_DEBUG_OBJECT(self, "Libuvc source started successfully");
   return TRUE;
@@ -667,6 +1783,13 @@ static gboolean gst_libuvc_h264_src_stop(GstBaseSrc *src) {
 
   GST_DEBUG_OBJECT(self, "Stopping libuvc source");
 
+  // Cancelling the transfers needs the event loop, so stop the stream while
+  // the control thread still runs it; afterwards it no longer polls frames
+  if (self->event_loop && self->uvc_strmh) {
+    g_atomic_int_set(&self->frame_fd, -1);
+    uvc_stream_stop(self->uvc_strmh);
+  }
+
   // Stop control thread
   if (self->control_running) {
     GST_DEBUG_OBJECT(self, "Stopping control thread");
@@ -700,19 +1823,30 @@ static gboolean gst_libuvc_h264_src_stop(GstBaseSrc *src) {
   // CRITICAL FIX: Stop streaming and force USB release
   if (self->streaming && self->uvc_devh) {
     GST_DEBUG_OBJECT(self, "Stopping UVC streaming");
+    if (self->uvc_strmh) {
+      GST_INFO_OBJECT(self, "%u frames dropped by a full frame queue",
+                      uvc_stream_get_dropped_frames(self->uvc_strmh));
+    }
+    GstStructure *stats = gst_libuvc_h264_src_get_stats(self);
+    GST_INFO_OBJECT(self, "Timestamp estimator: %" GST_PTR_FORMAT, stats);
+    gst_structure_free(stats);
+    // Returns once libusb has handed back every transfer
     uvc_stop_streaming(self->uvc_devh);
+    self->uvc_strmh = NULL;
     self->streaming = FALSE;
-    usleep(100000); // 100ms for streaming to stop
   }
 
-  // Clear frame queue
-  if (self->frame_queue) {
-    GstBuffer *buffer;
-    while ((buffer = g_async_queue_try_pop(self->frame_queue)) != NULL) {
-      gst_buffer_unref(buffer);
-    }
+  // Buffers still held downstream go back to the pool when released;
+  // libuvc drops its own reference once its last frame buffer is gone
+  if (self->frame_pool) {
+    gst_buffer_pool_set_active(self->frame_pool, FALSE);
+    gst_object_unref(self->frame_pool);
+    self->frame_pool = NULL;
   }
 
+  // Clear frame queue
+  gst_libuvc_h264_src_flush_queue(self);
+
   // FIXED: Release USB device BEFORE uvc_close
   if (self->uvc_devh) {
     GST_DEBUG_OBJECT(self, "Force releasing USB device");
@@ -723,18 +1857,37 @@ static gboolean gst_libuvc_h264_src_stop(GstBaseSrc *src) {
     self->uvc_devh = NULL;
   }
 
+  if (self->spspps_mem) {
+    gst_memory_unref(self->spspps_mem);
+    self->spspps_mem = NULL;
+  }
+  g_mutex_lock(&self->spspps_lock);
+  gst_buffer_replace(&self->codec_data, NULL);
+  g_mutex_unlock(&self->spspps_lock);
+  self->sps_info_changed = FALSE;
+
+  // Frames no longer arrive; let a pending write finish
+  if (self->spspps_writer) {
+    g_thread_pool_free(self->spspps_writer, FALSE, TRUE);
+    self->spspps_writer = NULL;
+  }
+
   // Unreference UVC device
   if (self->uvc_dev) {
     uvc_unref_device(self->uvc_dev);
     self->uvc_dev = NULL;
   }
 
-  // Exit UVC context
+  // Exit UVC context, or drop this element's share of it
   if (self->uvc_ctx) {
-    uvc_exit(self->uvc_ctx);
+    context_release(self->uvc_ctx);
     self->uvc_ctx = NULL;
   }
 
+  GST_OBJECT_LOCK(self);
+  self->latency = self->latency_peak = 0;
+  GST_OBJECT_UNLOCK(self);
+
   // Clear mutex
   g_mutex_clear(&self->control_mutex);
 
@@ -742,6 +1895,298 @@ static gboolean gst_libuvc_h264_src_stop(GstBaseSrc *src) {
   return TRUE;
 }
 
+// Returns the cached SPS/PPS as one read-only memory block, rebuilding it
+// only when the parameter sets changed since it was last handed out
+static GstMemory *get_spspps_memory(GstLibuvcH264Src *self, gboolean avc) {
+    if (self->spspps_mem && self->spspps_mem_avc != avc) {
+        gst_memory_unref(self->spspps_mem);
+        self->spspps_mem = NULL;
+    }
+    if (!self->spspps_mem) {
+        gsize len = self->sps_length + self->pps_length;
+        guint8 *data = g_malloc(len);
+        if (avc) {
+            // Start codes become 4-byte lengths, which may take a byte more
+            gint sps_skip = start_code_length(self->sps, self->sps_length);
+            gint pps_skip = start_code_length(self->pps, self->pps_length);
+            gsize sps_len = self->sps_length - sps_skip;
+            gsize pps_len = self->pps_length - pps_skip;
+            len = 8 + sps_len + pps_len;
+            data = g_realloc(data, len);
+            GST_WRITE_UINT32_BE(data, sps_len);
+            memcpy(data + 4, self->sps + sps_skip, sps_len);
+            GST_WRITE_UINT32_BE(data + 4 + sps_len, pps_len);
+            memcpy(data + 8 + sps_len, self->pps + pps_skip, pps_len);
+        } else {
+            memcpy(data, self->sps, self->sps_length);
+            memcpy(data + self->sps_length, self->pps, self->pps_length);
+        }
+        self->spspps_mem = gst_memory_new_wrapped(GST_MEMORY_FLAG_READONLY, data, len,
+                                                  0, len, data, g_free);
+        self->spspps_mem_avc = avc;
+    }
+    return gst_memory_ref(self->spspps_mem);
+}
+
+// stream-format=avc: start codes overwritten with 4-byte big-endian NAL
+// lengths. Only possible in place when every start code is 4 bytes long
+// and nothing precedes the first one.
+static gboolean avc_convert_in_place(GArray *units, guint8 *data) {
+    for (guint i = 0; i < units->len; i++) {
+        const nal_scan_unit_t *unit = &g_array_index(units, nal_scan_unit_t, i);
+        if (unit->header != 4 || (i == 0 && unit->offset != 0)) {
+            return FALSE;
+        }
+    }
+
+    for (guint i = 0; i < units->len; i++) {
+        const nal_scan_unit_t *unit = &g_array_index(units, nal_scan_unit_t, i);
+        GST_WRITE_UINT32_BE(data + unit->offset, unit->size - 4);
+    }
+    return TRUE;
+}
+
+// The same into a new buffer, for frames with 3-byte start codes
+static GstBuffer *avc_convert_copy(GArray *units, const guint8 *data) {
+    gsize size = 0;
+    GstMapInfo map;
+
+    for (guint i = 0; i < units->len; i++) {
+        const nal_scan_unit_t *unit = &g_array_index(units, nal_scan_unit_t, i);
+        size += 4 + unit->size - unit->header;
+    }
+
+    GstBuffer *buffer = gst_buffer_new_allocate(NULL, size, NULL);
+    gst_buffer_map(buffer, &map, GST_MAP_WRITE);
+    guint8 *out = map.data;
+    for (guint i = 0; i < units->len; i++) {
+        const nal_scan_unit_t *unit = &g_array_index(units, nal_scan_unit_t, i);
+        gsize len = unit->size - unit->header;
+        GST_WRITE_UINT32_BE(out, len);
+        memcpy(out + 4, data + unit->offset + unit->header, len);
+        out += 4 + len;
+    }
+    gst_buffer_unmap(buffer, &map);
+
+    return buffer;
+}
+
+// libuvc assembles frames straight into buffers from the element's pool;
+// each one stays mapped while libuvc or a borrowed frame still uses it
+typedef struct {
+    GstBuffer *buffer;
+    GstMapInfo map;
+} frame_slot_t;
+
+static void *frame_pool_acquire(size_t size, void **handle, void *user_ptr) {
+    GstBufferPool *pool = user_ptr;
+    frame_slot_t *slot = g_new0(frame_slot_t, 1);
+
+    // Frames larger than the configured size, or requests after the pool was
+    // deactivated, fall back to a one-off allocation
+    if (gst_buffer_pool_acquire_buffer(pool, &slot->buffer, NULL) != GST_FLOW_OK ||
+        gst_buffer_get_size(slot->buffer) < size) {
+        if (slot->buffer) {
+            gst_buffer_unref(slot->buffer);
+        }
+        slot->buffer = gst_buffer_new_allocate(NULL, size, NULL);
+    }
+
+    if (!slot->buffer || !gst_buffer_map(slot->buffer, &slot->map, GST_MAP_WRITE)) {
+        if (slot->buffer) {
+            gst_buffer_unref(slot->buffer);
+        }
+        g_free(slot);
+        return NULL;
+    }
+
+    *handle = slot;
+    return slot->map.data;
+}
+
+static void frame_pool_release(void *data G_GNUC_UNUSED, void *handle, void *user_ptr G_GNUC_UNUSED) {
+    frame_slot_t *slot = handle;
+
+    gst_buffer_unmap(slot->buffer, &slot->map);
+    gst_buffer_unref(slot->buffer);
+    g_free(slot);
+}
+
+static void frame_pool_destroy(void *user_ptr) {
+    gst_object_unref(user_ptr);
+}
+
+static gboolean setup_frame_pool(GstLibuvcH264Src *self) {
+    guint size = self->uvc_ctrl.dwMaxVideoFrameSize;
+    uvc_error_t res;
+
+    if (!self->frame_pool) {
+        self->frame_pool = gst_buffer_pool_new();
+
+        // libuvc always holds one buffer per queue slot plus the one being
+        // assembled, more are taken while downstream holds on to frames
+        GstStructure *config = gst_buffer_pool_get_config(self->frame_pool);
+        gst_buffer_pool_config_set_params(config, NULL, size, FRAME_QUEUE_DEPTH + 1, 0);
+        if (!gst_buffer_pool_set_config(self->frame_pool, config) ||
+            !gst_buffer_pool_set_active(self->frame_pool, TRUE)) {
+            GST_WARNING_OBJECT(self, "Unable to activate frame buffer pool");
+            gst_object_unref(self->frame_pool);
+            self->frame_pool = NULL;
+            return FALSE;
+        }
+    }
+
+    uvc_frame_allocator_t allocator = {
+        frame_pool_acquire,
+        frame_pool_release,
+        NULL,
+        frame_pool_destroy,
+        gst_object_ref(self->frame_pool)
+    };
+
+    // On failure libuvc leaves the reference taken for it with us
+    res = uvc_stream_set_frame_allocator(self->uvc_strmh, &allocator, size);
+    if (res < 0) {
+        GST_WARNING_OBJECT(self, "Unable to use frame buffer pool: %s", uvc_strerror(res));
+        gst_object_unref(allocator.user_ptr);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+// Converts a CLOCK_MONOTONIC capture time into the running time of the
+// element's clock: the clock is read now and set back by the frame's age,
+// which also works for clocks that are not monotonic-based (e.g. audio)
+static GstClockTime capture_to_running_time(GstLibuvcH264Src *self, GstClockTime capture) {
+    GstClock *clock = gst_element_get_clock(GST_ELEMENT_CAST(self));
+    GstClockTime base_time, now;
+    struct timespec mono;
+
+    if (!clock) {
+        return GST_CLOCK_TIME_NONE;
+    }
+
+    base_time = gst_element_get_base_time(GST_ELEMENT_CAST(self));
+    now = gst_clock_get_time(clock);
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    gst_object_unref(clock);
+
+    gint64 age = (gint64)mono.tv_sec * GST_SECOND + mono.tv_nsec - (gint64)capture;
+    if (!GST_CLOCK_TIME_IS_VALID(now) || (gint64)(now - base_time) < age) {
+        return 0;
+    }
+    return now - base_time - age;
+}
+
+// Hands a frame to create(), unless the queue is over its bounds: then the
+// frame and the rest of its GOP are dropped, so downstream never gets a
+// frame whose references are missing. An IDR (which carries SPS/PPS) is
+// always queued; if the queue is full, the older GOPs it would wait behind
+// are flushed to make room.
+static void gst_libuvc_h264_src_queue_frame(GstLibuvcH264Src *self, GstBuffer *buffer) {
+    gboolean is_idr = !GST_BUFFER_FLAG_IS_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    GstClockTime duration = GST_BUFFER_DURATION_IS_VALID(buffer) ? GST_BUFFER_DURATION(buffer) : 0;
+    GstClockTime max_time;
+    guint max_buffers;
+    gboolean full;
+    guint flushed_frames = 0, flushed_gops = 0;
+
+    GST_OBJECT_LOCK(self);
+    max_time = self->max_queue_time;
+    max_buffers = self->max_queue_buffers;
+    GST_OBJECT_UNLOCK(self);
+
+    g_async_queue_lock(self->frame_queue);
+    full = (max_buffers && g_async_queue_length_unlocked(self->frame_queue) >= (gint)max_buffers) ||
+           (max_time && self->queued_time + duration > max_time);
+    if (full && !is_idr) {
+        g_async_queue_unlock(self->frame_queue);
+        gst_buffer_unref(buffer);
+
+        GST_OBJECT_LOCK(self);
+        self->dropped_frames++;
+        self->dropped_gops++;
+        GST_OBJECT_UNLOCK(self);
+        GST_DEBUG_OBJECT(self, "Frame queue full, dropping until the next IDR");
+        self->drop_until_idr = TRUE;
+        return;
+    }
+    if (full) {
+        GstBuffer *old;
+        guint wakeups = 0;
+
+        while ((old = g_async_queue_try_pop_unlocked(self->frame_queue)) != NULL) {
+            if (old == QUEUE_WAKEUP) {
+                wakeups++;
+                continue;
+            }
+            // The head may be the tail end of a GOP; every IDR after it starts one
+            if (!flushed_frames || !GST_BUFFER_FLAG_IS_SET(old, GST_BUFFER_FLAG_DELTA_UNIT)) {
+                flushed_gops++;
+            }
+            flushed_frames++;
+            gst_buffer_unref(old);
+        }
+        // unlock() must still get through
+        while (wakeups--) {
+            g_async_queue_push_unlocked(self->frame_queue, QUEUE_WAKEUP);
+        }
+        self->queued_time = 0;
+        if (flushed_frames) {
+            GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DISCONT);
+        }
+    }
+    self->queued_time += duration;
+    g_async_queue_push_unlocked(self->frame_queue, buffer);
+    g_async_queue_unlock(self->frame_queue);
+
+    if (flushed_frames) {
+        GST_OBJECT_LOCK(self);
+        self->dropped_frames += flushed_frames;
+        self->dropped_gops += flushed_gops;
+        GST_OBJECT_UNLOCK(self);
+        GST_DEBUG_OBJECT(self, "Frame queue full at an IDR, flushed %u frames in %u GOPs",
+                         flushed_frames, flushed_gops);
+    }
+    if (is_idr) {
+        self->drop_until_idr = FALSE;
+    }
+}
+
+// Waits up to timeout for a frame. Returns NULL on timeout, and
+// QUEUE_WAKEUP when unlock() interrupted the wait.
+static GstBuffer *gst_libuvc_h264_src_dequeue_frame(GstLibuvcH264Src *self,
+                                                    GstClockTime timeout) {
+    GstBuffer *buffer;
+
+    g_async_queue_lock(self->frame_queue);
+    buffer = g_async_queue_timeout_pop_unlocked(self->frame_queue, GST_TIME_AS_USECONDS(timeout));
+    if (buffer && buffer != QUEUE_WAKEUP && GST_BUFFER_DURATION_IS_VALID(buffer)) {
+        self->queued_time -= MIN(self->queued_time, GST_BUFFER_DURATION(buffer));
+    }
+    g_async_queue_unlock(self->frame_queue);
+
+    return buffer;
+}
+
+static void gst_libuvc_h264_src_flush_queue(GstLibuvcH264Src *self) {
+    GstBuffer *buffer;
+
+    if (!self->frame_queue) {
+        return;
+    }
+
+    g_async_queue_lock(self->frame_queue);
+    while ((buffer = g_async_queue_try_pop_unlocked(self->frame_queue)) != NULL) {
+        if (buffer != QUEUE_WAKEUP) {
+            gst_buffer_unref(buffer);
+        }
+    }
+    self->queued_time = 0;
+    g_async_queue_unlock(self->frame_queue);
+}
+
 void frame_callback(uvc_frame_t *frame, void *ptr) {
     GstLibuvcH264Src *self = (GstLibuvcH264Src *)ptr;
 
@@ -749,134 +2194,1032 @@ void frame_callback(uvc_frame_t *frame, void *ptr) {
         GST_WARNING_OBJECT(self, "Empty or invalid frame received.");
         return;
     }
+
+    // Counted before anything below may drop the frame, so only frames that
+    // never reached the element show up as a gap
+    guint32 lost = 0;
+    if (self->last_sequence >= 0 && frame->sequence != (guint32)self->last_sequence + 1) {
+        lost = frame->sequence - (guint32)self->last_sequence - 1;
+        GST_DEBUG_OBJECT(self, "%u frames lost before frame %u", lost, frame->sequence);
+        self->pending_gap += lost;
+    }
+    self->last_sequence = frame->sequence;
 	
 	unsigned char* data = frame->data;
     gboolean updated_sps_pps = FALSE;
+    gboolean spspps_changed = FALSE;
+    gboolean sps_changed = FALSE;
+    gboolean has_idr = FALSE;
+    gboolean has_slice = FALSE;
 
-    #define MAX_UNITS_MAIN 10
-    nal_unit_t units[MAX_UNITS_MAIN];
-    int c = parse_nal_units(units, MAX_UNITS_MAIN, data, frame->data_bytes);
-
-    GstClockTime libuvc_ts = ((uint64_t)frame->capture_time_finished.tv_sec) * 1000L * 1000L * 1000L
-                             + frame->capture_time_finished.tv_nsec;
-    if (self->uvc_start_time == G_MAXUINT64) {
-        self->uvc_start_time = libuvc_ts;
-    }
-    libuvc_ts -= self->uvc_start_time;
-
-    for (int i = 0; i < c; i++) {
-        nal_unit_t *unit = &units[i];
-        GstBuffer *buffer = NULL;
-        gsize buffer_offset = 0;
+    // The whole frame goes out as one access unit, so the NAL walk only
+    // needs to find out what the frame carries
+    nal_scan(self->nal_units, data, frame->data_bytes);
+    for (guint i = 0; i < self->nal_units->len; i++) {
+        const nal_scan_unit_t *unit = &g_array_index(self->nal_units, nal_scan_unit_t, i);
 
         switch (unit->type) {
             case 7:
-                self->sps_length = unit->len;
-                memcpy(self->sps, unit->ptr, self->sps_length);
+                if (unit->size > SPSPPSBUFSZ) {
+                    GST_WARNING_OBJECT(self, "Ignoring a %u byte SPS", unit->size);
+                    break;
+                }
+                if (!self->sps_known || unit->size != self->sps_length ||
+                    memcmp(self->sps, &data[unit->offset], unit->size) != 0) {
+                    g_mutex_lock(&self->spspps_lock);
+                    self->sps_length = unit->size;
+                    memcpy(self->sps, &data[unit->offset], self->sps_length);
+                    self->sps_known = TRUE;
+                    g_mutex_unlock(&self->spspps_lock);
+                    spspps_changed = TRUE;
+                    sps_changed = TRUE;
+                }
+                if (g_atomic_int_compare_and_exchange(&self->caps_need_sps, TRUE, FALSE)) {
+                    sps_changed = TRUE;
+                }
                 updated_sps_pps = TRUE;
-                self->send_sps_pps = TRUE;
-                continue;
+                break;
             case 8:
-                self->pps_length = unit->len;
-                memcpy(self->pps, unit->ptr, self->pps_length);
-                updated_sps_pps = TRUE;
-                self->send_sps_pps = TRUE;
-                continue;
-            case 5: {
-                if (!self->had_idr || self->send_sps_pps) {
-                    buffer_offset = self->sps_length + self->pps_length;
-                    buffer = gst_buffer_new_allocate(NULL, buffer_offset + unit->len, NULL);
-                    gst_buffer_fill(buffer, 0, self->sps, self->sps_length);
-                    gst_buffer_fill(buffer, self->sps_length, self->pps, self->pps_length);
-                    self->send_sps_pps = FALSE;
+                if (unit->size > SPSPPSBUFSZ) {
+                    GST_WARNING_OBJECT(self, "Ignoring a %u byte PPS", unit->size);
+                    break;
                 }
-                if (!self->had_idr) {
-                    self->had_idr = TRUE;
+                if (!self->pps_known || unit->size != self->pps_length ||
+                    memcmp(self->pps, &data[unit->offset], unit->size) != 0) {
+                    g_mutex_lock(&self->spspps_lock);
+                    self->pps_length = unit->size;
+                    memcpy(self->pps, &data[unit->offset], self->pps_length);
+                    self->pps_known = TRUE;
+                    g_mutex_unlock(&self->spspps_lock);
+                    spspps_changed = TRUE;
                 }
+                updated_sps_pps = TRUE;
+                break;
+            case 5:
+                has_idr = TRUE;
+                has_slice = TRUE;
+                break;
+            case 1:
+                has_slice = TRUE;
                 break;
-            }
-            default:
-                if (!self->had_idr) {
-                    continue;
-                }
         }
+    }
 
-        if (!buffer) {
-          buffer = gst_buffer_new_allocate(NULL, unit->len, NULL);
+    gboolean avc = g_atomic_int_get(&self->avc);
+    // Cameras repeat the same parameter sets with every IDR; only a change
+    // has anything to rebuild or store
+    if (spspps_changed) {
+        if (self->spspps_mem) {
+            gst_memory_unref(self->spspps_mem);
+            self->spspps_mem = NULL;
         }
-        gst_buffer_fill(buffer, buffer_offset, unit->ptr, unit->len);
+        if (avc) {
+            g_mutex_lock(&self->spspps_lock);
+            update_codec_data(self);
+            g_mutex_unlock(&self->spspps_lock);
+        }
+    }
+    if (updated_sps_pps && (spspps_changed || !self->spspps_stored)) {
+        store_spspps(self);
+    }
+    if (sps_changed) {
+        gint skip = start_code_length(self->sps, self->sps_length);
+        if (h264_sps_parse(&self->sps_info, self->sps + skip, self->sps_length - skip)) {
+            GST_DEBUG_OBJECT(self, "SPS: profile %u level %u, %dx%d", self->sps_info.profile_idc,
+                             self->sps_info.level_idc, self->sps_info.width, self->sps_info.height);
+            self->sps_info_changed = TRUE;
+        } else {
+            GST_WARNING_OBJECT(self, "Unable to parse the SPS, caps left as they are");
+        }
+    }
 
-        if (units[i].type == 1 || units[i].type == 5) {
-            if (self->prev_pts == G_MAXUINT64) {
-                self->prev_pts = libuvc_ts - self->frame_interval;
-            }
+    if (!has_slice) {
+        // Parameter sets sent in a frame of their own: hold them back for
+        // the next IDR rather than pushing a buffer without a picture
+        if (updated_sps_pps) {
+            self->send_sps_pps = TRUE;
+        }
+        return;
+    }
 
-            self->frame_count++;
-            if (units[i].type == 5 && self->frame_count >= MIN_FRAMES_CALC_INTERVAL) {
-                if (self->prev_int_ts != 0) {
-                    #define AVG_DIV 20
-                    #define AVG_MULT 1
-                    #define AVG_ROUNDING (AVG_DIV/2)
+    // A live source drops what it captures while paused; after resuming the
+    // stream starts over at an IDR
+    if (!g_atomic_int_get(&self->playing)) {
+        self->had_idr = FALSE;
+        self->send_sps_pps = TRUE;
+        return;
+    }
 
-                    uint64_t interval = (libuvc_ts - self->prev_int_ts) / self->frame_count;
-                    self->frame_interval = (self->frame_interval * (AVG_DIV-AVG_MULT) +
-                                                interval + AVG_ROUNDING) / AVG_DIV;
-                }
-                self->frame_count = 0;
-                self->prev_int_ts = libuvc_ts;
-            }
+    if (!self->had_idr && !has_idr) {
+        return;
+    }
 
-            GstClockTime timestamp = self->prev_pts + self->frame_interval;
+    // Frames lost inside a GOP leave the rest of it without its references;
+    // skip to an IDR, and ask for one rather than wait out the GOP
+    if (lost && !has_idr && !self->drop_until_idr) {
+        GST_DEBUG_OBJECT(self, "Frames lost mid-GOP, dropping until the next IDR");
+        self->drop_until_idr = TRUE;
+        GST_OBJECT_LOCK(self);
+        self->dropped_gops++;
+        self->keyframe_pending = TRUE;
+        g_async_queue_push(self->frame_queue, QUEUE_WAKEUP);
+        GST_OBJECT_UNLOCK(self);
+    }
 
-            if (self->prev_int_ts != 0) {
-                int64_t diff = libuvc_ts - timestamp;
-                int64_t adj = 0;
-                if (diff < (-2 * self->frame_interval) || diff > (2 * self->frame_interval)) {
-                    adj = diff / 5;
-                    adj = CLAMP(diff, -self->frame_interval / 2, self->frame_interval / 2);
-                }
-                timestamp += adj;
-            }
+    // The rest of a GOP is useless once one of its frames is gone
+    if (self->drop_until_idr && !has_idr) {
+        GST_OBJECT_LOCK(self);
+        self->dropped_frames++;
+        GST_OBJECT_UNLOCK(self);
+        return;
+    }
+
+    // Take the frame over from libuvc instead of copying it; the buffer goes
+    // back to libuvc's pool once downstream drops the last reference. For avc
+    // the start codes are rewritten first, in place where their sizes allow.
+    GstBuffer *buffer;
+    uvc_frame_buffer_t *borrowed = NULL;
+    if (avc && !avc_convert_in_place(self->nal_units, data)) {
+        buffer = avc_convert_copy(self->nal_units, data);
+    } else if ((borrowed = uvc_frame_borrow(frame))) {
+        buffer = gst_buffer_new();
+        gst_buffer_append_memory(buffer,
+            gst_memory_new_wrapped(GST_MEMORY_FLAG_READONLY, data, frame->data_bytes,
+                                   0, frame->data_bytes, borrowed,
+                                   (GDestroyNotify)uvc_frame_return));
+    } else {
+        buffer = gst_buffer_new_allocate(NULL, frame->data_bytes, NULL);
+        gst_buffer_fill(buffer, 0, data, frame->data_bytes);
+    }
+
+    gboolean has_headers = updated_sps_pps;
+    if (has_idr) {
+        if (g_atomic_int_compare_and_exchange(&self->keyframe_headers, TRUE, FALSE)) {
+            self->send_sps_pps = TRUE;
+        }
+        if (!updated_sps_pps && (!self->had_idr || self->send_sps_pps)) {
+            gst_buffer_prepend_memory(buffer, get_spspps_memory(self, avc));
+            has_headers = TRUE;
+        }
+        g_mutex_lock(&self->spspps_lock);
+        if ((avc && self->codec_data_changed) || self->sps_info_changed) {
+            gst_mini_object_set_qdata(GST_MINI_OBJECT(buffer), caps_update_quark,
+                                      build_caps_update(self, &self->sps_info, avc),
+                                      (GDestroyNotify)gst_structure_free);
+            self->codec_data_changed = FALSE;
+            self->sps_info_changed = FALSE;
+        }
+        g_mutex_unlock(&self->spspps_lock);
+        self->send_sps_pps = FALSE;
+        self->had_idr = TRUE;
+    } else {
+        GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DELTA_UNIT);
+    }
+
+    if (has_headers) {
+        GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_HEADER);
+    }
+
+    if (self->pending_gap || (has_idr && self->drop_until_idr)) {
+        GST_BUFFER_FLAG_SET(buffer, GST_BUFFER_FLAG_DISCONT);
+    }
+    gst_buffer_add_uvc_frame_meta(buffer, frame, self->pending_gap);
+    self->pending_gap = 0;
+
+    // libuvc leaves the device time at zero until it has locked on to the
+    // camera clock; those first frames use the arrival time instead, and the
+    // estimator keeps the switch from running backwards
+    gboolean device_ts = self->timestamp_mode == GST_LIBUVC_H264_SRC_TIMESTAMP_DEVICE &&
+                         (frame->capture_time_device.tv_sec || frame->capture_time_device.tv_nsec);
+    const struct timespec *capture_time = &frame->capture_time_finished;
+    if (device_ts) {
+        capture_time = &frame->capture_time_device;
+    } else if (frame->capture_time_started.tv_sec || frame->capture_time_started.tv_nsec) {
+        // The first packet is the closest the host gets to the moment of
+        // capture, and unlike the last one it does not move with frame size
+        capture_time = &frame->capture_time_started;
+    }
+    GstClockTime libuvc_ts = ((uint64_t)capture_time->tv_sec) * 1000L * 1000L * 1000L
+                             + capture_time->tv_nsec;
+
+    // Frame numbers come from libuvc, so frames it dropped keep their slot
+    GST_OBJECT_LOCK(self);
+    GstClockTime timestamp = ts_estimator_push(&self->ts_est, frame->sequence, libuvc_ts);
+    GST_OBJECT_UNLOCK(self);
 
-            GST_BUFFER_PTS(buffer) = timestamp;
-            GST_BUFFER_DTS(buffer) = timestamp;
-            GST_BUFFER_DURATION(buffer) = timestamp - self->prev_pts;
+    if (g_atomic_int_compare_and_exchange(&self->reset_prev_pts, TRUE, FALSE)) {
+        self->prev_pts = G_MAXUINT64;
+    }
 
-            self->prev_pts = timestamp;
+    GstClockTime running_time = capture_to_running_time(self, timestamp);
+    if (GST_CLOCK_TIME_IS_VALID(running_time)) {
+        timestamp = running_time;
+        if (self->prev_pts != G_MAXUINT64 && (gint64)(timestamp - self->prev_pts) <= 0) {
+            timestamp = self->prev_pts + 1;
+        }
+    } else {
+        if (self->uvc_start_time == G_MAXUINT64) {
+            self->uvc_start_time = timestamp;
         }
+        timestamp -= self->uvc_start_time;
+    }
 
-        g_async_queue_push(self->frame_queue, buffer);
+    GST_BUFFER_PTS(buffer) = timestamp;
+    GST_BUFFER_DTS(buffer) = timestamp;
+    GST_BUFFER_DURATION(buffer) = (self->prev_pts == G_MAXUINT64) ? (GstClockTime)self->frame_interval
+                                                                   : timestamp - self->prev_pts;
+
+    self->prev_pts = timestamp;
+
+    gst_libuvc_h264_src_queue_frame(self, buffer);
+}
+
+// Tracks how long after its PTS a frame leaves the element: the USB
+// transfer and the time spent in libuvc's and the element's queues
+static void gst_libuvc_h264_src_update_latency(GstLibuvcH264Src *self, GstBuffer *buf) {
+    GstClock *clock = gst_element_get_clock(GST_ELEMENT_CAST(self));
+    GstClockTime now, measured, diff;
+    gboolean changed;
+
+    if (!clock) {
+        return;
     }
+    now = gst_clock_get_time(clock) - gst_element_get_base_time(GST_ELEMENT_CAST(self));
+    gst_object_unref(clock);
 
-    if (updated_sps_pps) {
-        store_spspps(self);
+    if (!GST_BUFFER_PTS_IS_VALID(buf)) {
+        return;
+    }
+    measured = (gint64)(now - GST_BUFFER_PTS(buf)) > 0 ? now - GST_BUFFER_PTS(buf) : 0;
+
+    GST_OBJECT_LOCK(self);
+    if (measured > self->latency_peak) {
+        self->latency_peak = measured;
+    } else {
+        self->latency_peak -= (self->latency_peak - measured) / LATENCY_DECAY;
+    }
+    diff = self->latency_peak > self->latency ? self->latency_peak - self->latency
+                                              : self->latency - self->latency_peak;
+    changed = diff > MAX(LATENCY_MIN_CHANGE, self->latency * LATENCY_CHANGE_PERCENT / 100);
+    if (changed) {
+        self->latency = self->latency_peak;
+    }
+    GST_OBJECT_UNLOCK(self);
+
+    if (changed) {
+        GST_INFO_OBJECT(self, "Capture latency now %" GST_TIME_FORMAT, GST_TIME_ARGS(self->latency));
+        gst_element_post_message(GST_ELEMENT_CAST(self),
+                                 gst_message_new_latency(GST_OBJECT_CAST(self)));
     }
 }
 
-static GstFlowReturn gst_libuvc_h264_src_create(GstPushSrc *src, GstBuffer **buf) {
+// No frame for a whole stall timeout. The warning goes out once per stall;
+// gaps keep downstream (muxers, compositors) moving while it lasts.
+static void gst_libuvc_h264_src_handle_stall(GstLibuvcH264Src *self, GstClockTime waited) {
+    GstLibuvcH264SrcStallAction action;
+
+    GST_OBJECT_LOCK(self);
+    action = self->stall_action;
+    GST_OBJECT_UNLOCK(self);
+
+    if (!self->stalled) {
+        self->stalled = TRUE;
+        GST_ELEMENT_WARNING(self, RESOURCE, READ, ("Camera stopped sending video"),
+                            ("No frame for %" GST_TIME_FORMAT, GST_TIME_ARGS(waited)));
+    }
+
+    if (action == GST_LIBUVC_H264_SRC_STALL_GAP && GST_CLOCK_TIME_IS_VALID(self->gap_position)) {
+        GST_DEBUG_OBJECT(self, "Gap at %" GST_TIME_FORMAT " for %" GST_TIME_FORMAT,
+                         GST_TIME_ARGS(self->gap_position), GST_TIME_ARGS(waited));
+        gst_pad_push_event(GST_BASE_SRC_PAD(self), gst_event_new_gap(self->gap_position, waited));
+        self->gap_position += waited;
+    }
+}
+
+static gboolean gst_libuvc_h264_src_query(GstBaseSrc *src, GstQuery *query) {
   GstLibuvcH264Src *self = GST_LIBUVC_H264_SRC(src);
+
+  if (GST_QUERY_TYPE(query) == GST_QUERY_LATENCY) {
+    GstClockTime min_latency, max_latency;
+
+    GST_OBJECT_LOCK(self);
+    min_latency = self->latency;
+    max_latency = self->max_queue_time ? min_latency + self->max_queue_time : GST_CLOCK_TIME_NONE;
+    GST_OBJECT_UNLOCK(self);
+
+    // Frames wait in the queue for up to max-queue-time on top of that
+    gst_query_set_latency(query, TRUE, min_latency, max_latency);
+    GST_DEBUG_OBJECT(self, "Reporting latency min %" GST_TIME_FORMAT,
+                     GST_TIME_ARGS(min_latency));
+    return TRUE;
+  }
+
+  return GST_BASE_SRC_CLASS(gst_libuvc_h264_src_parent_class)->query(src, query);
+}
+
+// Upstream force-key-unit events only note the request: the camera is asked
+// from create(), which owns the stream. The requested running time is not
+// honoured, the camera can only do "as soon as possible".
+static gboolean gst_libuvc_h264_src_event(GstBaseSrc *src, GstEvent *event) {
+  GstLibuvcH264Src *self = GST_LIBUVC_H264_SRC(src);
+
+  if (gst_video_event_is_force_key_unit(event)) {
+    GstClockTime running_time;
+    gboolean all_headers;
+    guint count;
+
+    if (!gst_video_event_parse_upstream_force_key_unit(event, &running_time,
+                                                       &all_headers, &count)) {
+      return FALSE;
+    }
+
+    GST_DEBUG_OBJECT(self, "Key unit %u requested for %" GST_TIME_FORMAT "%s", count,
+                     GST_TIME_ARGS(running_time), all_headers ? " with headers" : "");
+    GST_OBJECT_LOCK(self);
+    self->keyframe_pending = TRUE;
+    self->keyframe_announce = TRUE;
+    self->keyframe_all_headers |= all_headers;
+    self->keyframe_count = count;
+    GST_OBJECT_UNLOCK(self);
+    if (all_headers) {
+      g_atomic_int_set(&self->keyframe_headers, TRUE);
+    }
+    return TRUE;
+  }
+
+  return GST_BASE_SRC_CLASS(gst_libuvc_h264_src_parent_class)->event(src, event);
+}
+
+// Opens a stream with the negotiated control and starts it. Per-stream
+// state starts over; the timestamp origin is the session's, so after a
+// reconnect timestamps carry on from before. A resumed stream waits for an
+// IDR and marks it DISCONT.
+static gboolean gst_libuvc_h264_src_start_stream(GstLibuvcH264Src *self, gboolean resume) {
+  uvc_error_t res;
+
+  // Encoder settings made while stopped, or forgotten by a reconnected camera
+  gst_libuvc_h264_src_apply_encoder(self, TRUE);
+
+  res = uvc_stream_open_ctrl(self->uvc_devh, &self->uvc_strmh, &self->uvc_ctrl);
+  if (res < 0) {
+    GST_ERROR_OBJECT(self, "Unable to open stream: %s", uvc_strerror(res));
+    return FALSE;
+  }
+
+  // Queue a few frames inside libuvc so a busy callback does not cost
+  // frames; when it does fall behind, keep the most recent ones
+  res = uvc_stream_set_frame_queue(self->uvc_strmh, FRAME_QUEUE_DEPTH,
+                                   UVC_FRAME_OVERFLOW_DROP_OLDEST);
+  if (res < 0) {
+    GST_WARNING_OBJECT(self, "Unable to set frame queue depth: %s", uvc_strerror(res));
+  }
+
+  // Not fatal: libuvc keeps assembling into its own heap buffers
+  setup_frame_pool(self);
+
+  uvc_stream_set_transfer_config(self->uvc_strmh, self->transfer_count,
+                                 self->packets_per_transfer,
+                                 (size_t)MIN(self->transfer_memory, G_MAXSIZE));
+
+  self->watchdog_armed = FALSE;
+  self->watchdog_level = 0;
+  self->watchdog_silence = 0;
+
+  res = gst_libuvc_h264_src_run_stream(self, resume);
+  if (res < 0) {
+    GST_ERROR_OBJECT(self, "Unable to start streaming: %s", uvc_strerror(res));
+    uvc_stream_close(self->uvc_strmh);
+    self->uvc_strmh = NULL;
+    return FALSE;
+  }
+
+  int num_transfers;
+  size_t transfer_size;
+  uvc_stream_get_transfer_config(self->uvc_strmh, &num_transfers, &transfer_size);
+  GST_INFO_OBJECT(self, "Streaming with %d USB transfers of %" G_GSIZE_FORMAT " bytes",
+                  num_transfers, transfer_size);
+  self->streaming = TRUE;
+  return TRUE;
+}
+
+// Starts the opened stream, from scratch as far as frame numbers and the
+// timestamp estimator are concerned
+static uvc_error_t gst_libuvc_h264_src_run_stream(GstLibuvcH264Src *self, gboolean resume) {
   uvc_error_t res;
 
-  if (!self->streaming) {
-    res = uvc_start_streaming(self->uvc_devh, &self->uvc_ctrl, frame_callback, self, 0);
+  GST_OBJECT_LOCK(self);
+  ts_estimator_init(&self->ts_est, self->timestamp_estimator, self->frame_interval);
+  GST_OBJECT_UNLOCK(self);
+  self->last_sequence = -1;
+  self->pending_gap = 0;
+  self->had_idr = FALSE;
+  self->send_sps_pps = TRUE;
+  self->drop_until_idr = resume;
+
+  if (self->event_loop) {
+    // Polled by the control thread, which calls frame_callback itself
+    int frame_fd = uvc_stream_get_fd(self->uvc_strmh);
+    res = uvc_stream_start(self->uvc_strmh, NULL, NULL, 0);
+    if (res >= 0) {
+      g_atomic_int_set(&self->frame_fd, frame_fd);
+    }
+  } else {
+    res = uvc_stream_start(self->uvc_strmh, frame_callback, self,
+                           self->direct_dispatch ? UVC_STREAM_DIRECT_DISPATCH : 0);
+  }
+  if (res >= 0) {
+    self->watchdog_sequence = uvc_stream_get_sequence(self->uvc_strmh);
+  }
+
+  return res;
+}
+
+// Stops the running stream ahead of a restart with run_stream()
+static void gst_libuvc_h264_src_halt_stream(GstLibuvcH264Src *self) {
+  // Out of the event loop's sight while the stream restarts; the mutex
+  // waits out a frame pickup in progress
+  g_atomic_int_set(&self->frame_fd, -1);
+  g_mutex_lock(&self->control_mutex);
+  g_mutex_unlock(&self->control_mutex);
+
+  uvc_stream_stop(self->uvc_strmh);
+}
+
+// Stops the stream, applies a uvc_stream_reset() level and starts it again,
+// waiting for an IDR. A failed reset short of a lost device is only logged:
+// the stream may well start anyway.
+static uvc_error_t gst_libuvc_h264_src_restart_stream(GstLibuvcH264Src *self,
+                                                      uvc_stream_reset_level_t level) {
+  uvc_error_t res;
+
+  gst_libuvc_h264_src_halt_stream(self);
+  res = uvc_stream_reset(self->uvc_strmh, level);
+  if (res == UVC_ERROR_NO_DEVICE) {
+    return res;
+  }
+  if (res < 0) {
+    GST_WARNING_OBJECT(self, "Stream reset level %d failed: %s", level, uvc_strerror(res));
+  }
+
+  return gst_libuvc_h264_src_run_stream(self, TRUE);
+}
+
+// The camera is gone: release the stream and the handle, keeping the
+// context and the negotiated control for the reconnect
+static void gst_libuvc_h264_src_disconnect(GstLibuvcH264Src *self) {
+  uvc_device_handle_t *devh;
+
+  self->disconnect_time = g_get_monotonic_time();
+
+  // Out of the event loop's sight first; taking the control mutex waits
+  // for a frame pickup or control command still using the old handles
+  g_atomic_int_set(&self->frame_fd, -1);
+  g_mutex_lock(&self->control_mutex);
+  devh = self->uvc_devh;
+  self->uvc_devh = NULL;
+  g_mutex_unlock(&self->control_mutex);
+
+  uvc_stream_close(self->uvc_strmh);
+  self->uvc_strmh = NULL;
+  self->streaming = FALSE;
+
+  uvc_close(devh);
+  uvc_unref_device(self->uvc_dev);
+  self->uvc_dev = NULL;
+}
+
+// Looks for the camera by VID/PID/serial, since it comes back at a new bus
+// address, until reconnect-timeout has passed since it went away. A flush
+// interrupts the search; the next create() picks it up again.
+static GstFlowReturn gst_libuvc_h264_src_reconnect(GstLibuvcH264Src *self) {
+  GstClockTime timeout, elapsed;
+  uvc_device_t *dev = NULL;
+  uvc_device_handle_t *devh = NULL;
+  uvc_error_t res = UVC_ERROR_NO_DEVICE;
+
+  GST_OBJECT_LOCK(self);
+  timeout = self->reconnect_timeout;
+  GST_OBJECT_UNLOCK(self);
+
+  while (TRUE) {
+    GstBuffer *buffer;
+
+    elapsed = (g_get_monotonic_time() - self->disconnect_time) * GST_USECOND;
+    if (elapsed >= timeout) {
+      break;
+    }
+    if (g_atomic_int_get(&self->flushing)) {
+      return GST_FLOW_FLUSHING;
+    }
+
+    // Sleeps on the frame queue so unlock() cuts the wait short; anything
+    // still queued is from before the disconnect
+    buffer = gst_libuvc_h264_src_dequeue_frame(self, RECONNECT_INTERVAL);
+    if (buffer && buffer != QUEUE_WAKEUP) {
+      gst_buffer_unref(buffer);
+    }
+
+    res = uvc_find_device(self->uvc_ctx, &dev, self->vendor_id, self->product_id, self->serial);
+    if (res == UVC_SUCCESS) {
+      res = uvc_open(dev, &devh);
+      if (res < 0) {
+        uvc_unref_device(dev);
+      }
+    }
     if (res < 0) {
-      GST_ERROR_OBJECT(self, "Unable to start streaming: %s", uvc_strerror(res));
-      return GST_FLOW_ERROR;
+      continue;
+    }
+
+    res = uvc_probe_stream_ctrl(devh, &self->uvc_ctrl);
+    if (res == UVC_SUCCESS) {
+      break;
     }
-    self->streaming = TRUE;
-	self->uvc_start_time = G_MAXUINT64;
-	self->prev_pts = G_MAXUINT64;
+    GST_DEBUG_OBJECT(self, "Camera is back but not ready: %s", uvc_strerror(res));
+    uvc_close(devh);
+    uvc_unref_device(dev);
   }
 
-  *buf = g_async_queue_pop(self->frame_queue);
-  if (*buf == NULL) {
-    GST_ERROR_OBJECT(self, "No frame available.");
+  if (res != UVC_SUCCESS) {
+    GST_ELEMENT_ERROR(self, RESOURCE, NOT_FOUND, ("Camera did not come back"),
+                      ("Gave up after %" GST_TIME_FORMAT ": %s",
+                       GST_TIME_ARGS(elapsed), uvc_strerror(res)));
     return GST_FLOW_ERROR;
   }
 
+  self->uvc_dev = dev;
+  g_mutex_lock(&self->control_mutex);
+  self->uvc_devh = devh;
+  g_mutex_unlock(&self->control_mutex);
+
+  if (!gst_libuvc_h264_src_start_stream(self, TRUE)) {
+    return GST_FLOW_ERROR;
+  }
+
+  elapsed = (g_get_monotonic_time() - self->disconnect_time) * GST_USECOND;
+  self->disconnect_time = 0;
+  GST_OBJECT_LOCK(self);
+  self->reconnects++;
+  self->reconnect_time = elapsed;
+  GST_OBJECT_UNLOCK(self);
+  GST_ELEMENT_INFO(self, RESOURCE, READ, ("Camera reconnected"),
+                   ("Streaming again after %" GST_TIME_FORMAT, GST_TIME_ARGS(elapsed)));
+
   return GST_FLOW_OK;
 }
 
+// Frames are coming again, or still are
+static void gst_libuvc_h264_src_watchdog_clear(GstLibuvcH264Src *self) {
+  if (self->watchdog_level) {
+    GstClockTime took = (g_get_monotonic_time() - self->watchdog_start) * GST_USECOND;
+    GST_INFO_OBJECT(self, "Stream recovered after %d restarts in %" GST_TIME_FORMAT,
+                    self->watchdog_level, GST_TIME_ARGS(took));
+    GST_OBJECT_LOCK(self);
+    self->recovery_time = took;
+    GST_OBJECT_UNLOCK(self);
+  }
+  self->watchdog_armed = TRUE;
+  self->watchdog_level = 0;
+  self->watchdog_silence = 0;
+}
+
+// Called while create() gets no frames from a camera that is still on the
+// bus. Frames completing in libuvc but not pushed (waiting for an IDR) still
+// count as life. Otherwise every budget the stream is restarted with the
+// next uvc_stream_reset() level; when even a port reset does not help,
+// stall-action and the reconnect are what is left.
+static GstFlowReturn gst_libuvc_h264_src_watchdog(GstLibuvcH264Src *self, GstClockTime interval) {
+  guint32 sequence = uvc_stream_get_sequence(self->uvc_strmh);
+  GstClockTime budget;
+  uvc_error_t res;
+  gint level;
+
+  if (sequence != self->watchdog_sequence) {
+    self->watchdog_sequence = sequence;
+    gst_libuvc_h264_src_watchdog_clear(self);
+    return GST_FLOW_OK;
+  }
+
+  GST_OBJECT_LOCK(self);
+  budget = self->watchdog_timeout;
+  GST_OBJECT_UNLOCK(self);
+
+  // Until the first frame the camera may just be slow to start
+  if (!budget || !self->watchdog_armed || self->watchdog_level >= WATCHDOG_LEVELS) {
+    return GST_FLOW_OK;
+  }
+  budget = MAX(budget, (GstClockTime)self->frame_interval * WATCHDOG_MIN_FRAMES);
+
+  self->watchdog_silence += interval;
+  if (self->watchdog_silence < budget) {
+    return GST_FLOW_OK;
+  }
+
+  if (!self->watchdog_level) {
+    self->watchdog_start = g_get_monotonic_time() - GST_TIME_AS_USECONDS(self->watchdog_silence);
+  }
+  level = self->watchdog_level++;
+  self->watchdog_silence = 0;
+  GST_WARNING_OBJECT(self, "No frames for %" GST_TIME_FORMAT ", restarting the stream (level %d)",
+                     GST_TIME_ARGS(budget), level);
+
+  GST_OBJECT_LOCK(self);
+  self->recoveries[level]++;
+  GST_OBJECT_UNLOCK(self);
+
+  res = gst_libuvc_h264_src_restart_stream(self, level);
+  if (res < 0) {
+    GST_ELEMENT_WARNING(self, RESOURCE, READ, ("Camera stopped responding"),
+                        ("Reopening it after level %d: %s", level, uvc_strerror(res)));
+    gst_libuvc_h264_src_disconnect(self);
+    return gst_libuvc_h264_src_reconnect(self);
+  }
+
+  return GST_FLOW_OK;
+}
+
+// Brings the camera's encoder in line with bitrate and quality after they
+// changed, or unconditionally with force before a stream opens. The
+// bitrate is an encoding unit control, set on the fly where the camera
+// allows it; quality is part of the committed stream format, so a running
+// stream is stopped and committed again for it.
+static GstFlowReturn gst_libuvc_h264_src_apply_encoder(GstLibuvcH264Src *self, gboolean force) {
+  gboolean running = self->uvc_strmh != NULL;
+  gboolean halted = FALSE;
+  guint bitrate, quality;
+  uvc_error_t res;
+
+  GST_OBJECT_LOCK(self);
+  if (!self->encoder_changed && !force) {
+    GST_OBJECT_UNLOCK(self);
+    return GST_FLOW_OK;
+  }
+  self->encoder_changed = FALSE;
+  bitrate = self->bitrate;
+  quality = self->quality;
+  GST_OBJECT_UNLOCK(self);
+
+  if (bitrate) {
+    if (!uvc_has_encoding_ctrl(self->uvc_devh, UVC_EU_AVERAGE_BITRATE_CONTROL)) {
+      GST_WARNING_OBJECT(self, "Camera has no bitrate control, ignoring bitrate %u", bitrate);
+    } else {
+      if (running && !uvc_has_runtime_encoding_ctrl(self->uvc_devh, UVC_EU_AVERAGE_BITRATE_CONTROL)) {
+        gst_libuvc_h264_src_halt_stream(self);
+        halted = TRUE;
+      }
+      g_mutex_lock(&self->control_mutex);
+      res = uvc_set_average_bitrate(self->uvc_devh, bitrate);
+      g_mutex_unlock(&self->control_mutex);
+      if (res < 0) {
+        GST_WARNING_OBJECT(self, "Unable to set bitrate %u: %s", bitrate, uvc_strerror(res));
+      } else {
+        GST_INFO_OBJECT(self, "Encoder bitrate set to %u", bitrate);
+      }
+    }
+  }
+
+  if (quality && quality != self->uvc_ctrl.wCompQuality) {
+    uvc_stream_ctrl_t ctrl = self->uvc_ctrl;
+
+    if (running && !halted) {
+      gst_libuvc_h264_src_halt_stream(self);
+      halted = TRUE;
+    }
+    if (running) {
+      // Back to alternate setting 0 for the new probe and commit
+      uvc_stream_reset(self->uvc_strmh, UVC_STREAM_RESET_COMMIT);
+    }
+
+    ctrl.bmHint |= (1 << 3); // keep wCompQuality
+    ctrl.wCompQuality = quality;
+    res = uvc_probe_stream_ctrl(self->uvc_devh, &ctrl);
+    if (res == UVC_SUCCESS && running) {
+      res = uvc_stream_ctrl(self->uvc_strmh, &ctrl);
+    }
+    if (res == UVC_SUCCESS) {
+      GST_INFO_OBJECT(self, "Compression quality %u, asked for %u", ctrl.wCompQuality, quality);
+      self->uvc_ctrl = ctrl;
+    } else {
+      GST_WARNING_OBJECT(self, "Camera refused quality %u: %s", quality, uvc_strerror(res));
+    }
+  }
+
+  if (halted) {
+    res = gst_libuvc_h264_src_run_stream(self, TRUE);
+    if (res < 0) {
+      GST_ELEMENT_WARNING(self, RESOURCE, READ, ("Camera stopped responding"),
+                          ("Reopening it after an encoder change: %s", uvc_strerror(res)));
+      gst_libuvc_h264_src_disconnect(self);
+      return gst_libuvc_h264_src_reconnect(self);
+    }
+  }
+
+  return GST_FLOW_OK;
+}
+
+// Sends a keyframe-xu-request, "unit:selector:hexdata", to the camera
+static uvc_error_t gst_libuvc_h264_src_send_xu_request(GstLibuvcH264Src *self,
+                                                       const gchar *request) {
+  gchar **parts = g_strsplit(request, ":", 3);
+  guint8 data[MAX_XU_REQUEST_SIZE];
+  guint64 unit = 0, selector = 0;
+  gsize len = 0, i;
+  gchar *end;
+  gboolean valid = g_strv_length(parts) == 3;
+
+  if (valid) {
+    unit = g_ascii_strtoull(parts[0], &end, 0);
+    valid = *parts[0] && !*end && unit <= G_MAXUINT8;
+  }
+  if (valid) {
+    selector = g_ascii_strtoull(parts[1], &end, 0);
+    valid = *parts[1] && !*end && selector <= G_MAXUINT8;
+  }
+  if (valid) {
+    len = strlen(parts[2]) / 2;
+    valid = len > 0 && len <= sizeof(data) && strlen(parts[2]) % 2 == 0;
+    for (i = 0; valid && i < len; i++) {
+      gint hi = g_ascii_xdigit_value(parts[2][2 * i]);
+      gint lo = g_ascii_xdigit_value(parts[2][2 * i + 1]);
+      valid = hi >= 0 && lo >= 0;
+      data[i] = (guint8)(hi << 4 | lo);
+    }
+  }
+  g_strfreev(parts);
+
+  if (!valid) {
+    GST_WARNING_OBJECT(self, "Invalid keyframe-xu-request '%s'", request);
+    return UVC_ERROR_INVALID_PARAM;
+  }
+
+  int ret = uvc_set_ctrl(self->uvc_devh, unit, selector, data, len);
+  return ret == (int)len ? UVC_SUCCESS : (ret < 0 ? ret : UVC_ERROR_IO);
+}
+
+// Asks the camera for an IDR if a key unit is pending and keyframe-interval
+// allows. Until the IDR shows up further requests just wait for it.
+static GstFlowReturn gst_libuvc_h264_src_request_keyframe(GstLibuvcH264Src *self) {
+  GstLibuvcH264SrcKeyframeMethod method;
+  gchar *xu_request;
+  gint64 now = g_get_monotonic_time();
+  uvc_error_t res = UVC_ERROR_NOT_SUPPORTED;
+
+  GST_OBJECT_LOCK(self);
+  if (!self->keyframe_pending ||
+      (self->keyframe_request_time &&
+       (GstClockTime)(now - self->keyframe_request_time) * GST_USECOND < self->keyframe_interval)) {
+    GST_OBJECT_UNLOCK(self);
+    return GST_FLOW_OK;
+  }
+  self->keyframe_pending = FALSE;
+  method = self->keyframe_method;
+  xu_request = g_strdup(self->keyframe_xu_request);
+  GST_OBJECT_UNLOCK(self);
+
+  switch (method) {
+    case GST_LIBUVC_H264_SRC_KEYFRAME_NONE:
+      g_free(xu_request);
+      return GST_FLOW_OK;
+    case GST_LIBUVC_H264_SRC_KEYFRAME_AUTO:
+      g_mutex_lock(&self->control_mutex);
+      if (self->uvc_devh) {
+        res = uvc_set_sync_ref_frame(self->uvc_devh, UVC_SYNC_FRAME_IDR, 0, 0);
+        if (res == UVC_ERROR_NOT_SUPPORTED && xu_request) {
+          res = gst_libuvc_h264_src_send_xu_request(self, xu_request);
+        }
+      }
+      g_mutex_unlock(&self->control_mutex);
+      break;
+    case GST_LIBUVC_H264_SRC_KEYFRAME_RESTART:
+      res = gst_libuvc_h264_src_restart_stream(self, UVC_STREAM_RESET_COMMIT);
+      if (res < 0) {
+        g_free(xu_request);
+        GST_ELEMENT_WARNING(self, RESOURCE, READ, ("Camera stopped responding"),
+                            ("Reopening it after a keyframe restart: %s", uvc_strerror(res)));
+        gst_libuvc_h264_src_disconnect(self);
+        return gst_libuvc_h264_src_reconnect(self);
+      }
+      break;
+  }
+  g_free(xu_request);
+
+  self->keyframe_request_time = now;
+  if (res == UVC_SUCCESS) {
+    GST_DEBUG_OBJECT(self, "Requested a keyframe from the camera");
+    GST_OBJECT_LOCK(self);
+    self->keyframe_requests++;
+    GST_OBJECT_UNLOCK(self);
+  } else {
+    GST_DEBUG_OBJECT(self, "Unable to request a keyframe, waiting for the next one: %s",
+                     uvc_strerror(res));
+  }
+
+  return GST_FLOW_OK;
+}
+
+// The camera changed its parameter sets: new caps, if the peer takes them
+static void gst_libuvc_h264_src_update_caps(GstLibuvcH264Src *self, GstBuffer *buf) {
+  GstStructure *update = gst_mini_object_steal_qdata(GST_MINI_OBJECT(buf), caps_update_quark);
+  GstPad *pad = GST_BASE_SRC_PAD(self);
+  GstCaps *caps;
+
+  if (!update) {
+    return;
+  }
+
+  caps = gst_pad_get_current_caps(pad);
+  if (caps) {
+    GstCaps *old = gst_caps_ref(caps);
+    GstStructure *s;
+    gint width, height, sps_width, sps_height;
+
+    caps = gst_caps_make_writable(caps);
+    s = gst_caps_get_structure(caps, 0);
+    // The rate the camera agreed to at negotiation beats the VUI's, which
+    // is often 30000/1001 for 30/1 or off by a factor of two; only a new
+    // picture size means the camera switched modes
+    if (gst_structure_get_int(s, "width", &width) && gst_structure_get_int(s, "height", &height) &&
+        gst_structure_get_int(update, "width", &sps_width) &&
+        gst_structure_get_int(update, "height", &sps_height) &&
+        width == sps_width && height == sps_height) {
+      gst_structure_remove_field(update, "framerate");
+    }
+    gst_structure_foreach(update, set_caps_field, s);
+    if (!gst_caps_is_strictly_equal(caps, old)) {
+      if (!gst_pad_peer_query_accept_caps(pad, caps)) {
+        GST_WARNING_OBJECT(self, "Peer refuses caps %" GST_PTR_FORMAT " for the new parameter "
+                           "sets, keeping %" GST_PTR_FORMAT, caps, old);
+      } else if (!gst_base_src_set_caps(GST_BASE_SRC(self), caps)) {
+        GST_WARNING_OBJECT(self, "Unable to set caps %" GST_PTR_FORMAT, caps);
+      } else {
+        GST_INFO_OBJECT(self, "Parameter sets changed, caps now %" GST_PTR_FORMAT, caps);
+      }
+    }
+    gst_caps_unref(old);
+    gst_caps_unref(caps);
+  }
+  gst_structure_free(update);
+}
+
+// An IDR is about to be pushed: it answers any key unit requested so far
+static void gst_libuvc_h264_src_announce_keyframe(GstLibuvcH264Src *self, GstBuffer *buf) {
+  GstClockTime pts = GST_BUFFER_PTS(buf);
+  GstClockTime running_time, stream_time;
+  gboolean all_headers;
+  guint count;
+
+  GST_OBJECT_LOCK(self);
+  if (!self->keyframe_announce) {
+    GST_OBJECT_UNLOCK(self);
+    return;
+  }
+  all_headers = self->keyframe_all_headers;
+  count = self->keyframe_count;
+  self->keyframe_pending = FALSE;
+  self->keyframe_announce = FALSE;
+  self->keyframe_all_headers = FALSE;
+  running_time = gst_segment_to_running_time(&GST_BASE_SRC(self)->segment, GST_FORMAT_TIME, pts);
+  stream_time = gst_segment_to_stream_time(&GST_BASE_SRC(self)->segment, GST_FORMAT_TIME, pts);
+  GST_OBJECT_UNLOCK(self);
+
+  GST_DEBUG_OBJECT(self, "Key unit %u at %" GST_TIME_FORMAT, count, GST_TIME_ARGS(running_time));
+  gst_pad_push_event(GST_BASE_SRC_PAD(self),
+                     gst_video_event_new_downstream_force_key_unit(pts, stream_time, running_time,
+                                                                   all_headers, count));
+}
+
+// Starts the stream for a new session, with the session's counters reset;
+// from create(), or from negotiation for fast-start
+static gboolean gst_libuvc_h264_src_start_session(GstLibuvcH264Src *self) {
+  self->uvc_start_time = G_MAXUINT64;
+  self->prev_pts = G_MAXUINT64;
+  self->stalled = FALSE;
+  self->gap_position = GST_CLOCK_TIME_NONE;
+  GST_OBJECT_LOCK(self);
+  self->dropped_frames = 0;
+  self->dropped_gops = 0;
+  self->reconnects = 0;
+  self->reconnect_time = 0;
+  self->keyframe_requests = 0;
+  GST_OBJECT_UNLOCK(self);
+  self->keyframe_request_time = 0;
+
+  return gst_libuvc_h264_src_start_stream(self, FALSE);
+}
+
+static GstFlowReturn gst_libuvc_h264_src_create(GstPushSrc *src, GstBuffer **buf) {
+  GstLibuvcH264Src *self = GST_LIBUVC_H264_SRC(src);
+  GstClockTime waited = 0;
+
+  if (self->disconnect_time) {
+    GstFlowReturn ret = gst_libuvc_h264_src_reconnect(self);
+    if (ret != GST_FLOW_OK) {
+      return ret;
+    }
+  } else if (!self->streaming) {
+    if (!gst_libuvc_h264_src_start_session(self)) {
+      return GST_FLOW_ERROR;
+    }
+  }
+
+  while (TRUE) {
+    GstClockTime stall_timeout;
+
+    if (g_atomic_int_get(&self->flushing)) {
+      return GST_FLOW_FLUSHING;
+    }
+
+    GST_OBJECT_LOCK(self);
+    stall_timeout = self->stall_timeout;
+    GST_OBJECT_UNLOCK(self);
+
+    GstFlowReturn ret = gst_libuvc_h264_src_apply_encoder(self, FALSE);
+    if (ret != GST_FLOW_OK) {
+      return ret;
+    }
+
+    ret = gst_libuvc_h264_src_request_keyframe(self);
+    if (ret != GST_FLOW_OK) {
+      return ret;
+    }
+
+    *buf = gst_libuvc_h264_src_dequeue_frame(self, STREAM_CHECK_INTERVAL);
+    if (*buf == QUEUE_WAKEUP) {
+      continue;
+    }
+    if (*buf) {
+      break;
+    }
+
+    if (uvc_stream_get_status(self->uvc_strmh) == UVC_ERROR_NO_DEVICE) {
+      GST_ELEMENT_WARNING(self, RESOURCE, READ, ("Camera disconnected"),
+                          ("Trying to reconnect"));
+      gst_libuvc_h264_src_disconnect(self);
+      ret = gst_libuvc_h264_src_reconnect(self);
+      if (ret != GST_FLOW_OK) {
+        return ret;
+      }
+      waited = 0;
+      continue;
+    }
+
+    ret = gst_libuvc_h264_src_watchdog(self, STREAM_CHECK_INTERVAL);
+    if (ret != GST_FLOW_OK) {
+      return ret;
+    }
+
+    waited += STREAM_CHECK_INTERVAL;
+    if (stall_timeout && waited >= stall_timeout) {
+      gst_libuvc_h264_src_handle_stall(self, waited);
+      waited = 0;
+    }
+  }
+  gst_libuvc_h264_src_watchdog_clear(self);
+  if (self->stalled) {
+    GST_INFO_OBJECT(self, "Camera is sending frames again");
+    self->stalled = FALSE;
+  }
+  self->gap_position = GST_BUFFER_PTS(*buf);
+  if (GST_CLOCK_TIME_IS_VALID(self->gap_position) && GST_BUFFER_DURATION_IS_VALID(*buf)) {
+    self->gap_position += GST_BUFFER_DURATION(*buf);
+  }
+
+  gst_libuvc_h264_src_update_latency(self, *buf);
+
+  if (!GST_BUFFER_FLAG_IS_SET(*buf, GST_BUFFER_FLAG_DELTA_UNIT)) {
+    gst_libuvc_h264_src_update_caps(self, *buf);
+    gst_libuvc_h264_src_announce_keyframe(self, *buf);
+
+    GST_OBJECT_LOCK(self);
+    if (!self->first_idr_time) {
+      self->first_idr_time = (g_get_monotonic_time() - self->start_time) * GST_USECOND;
+      GST_INFO_OBJECT(self, "First IDR %" GST_TIME_FORMAT " after start",
+                      GST_TIME_ARGS(self->first_idr_time));
+    }
+    GST_OBJECT_UNLOCK(self);
+  }
+
+  return GST_FLOW_OK;
+}
+
+// Wakes create() up for a flush or state change; frames that keep coming
+// stay queued until unlock_stop() or stop() deals with them
+static gboolean gst_libuvc_h264_src_unlock(GstBaseSrc *src) {
+  GstLibuvcH264Src *self = GST_LIBUVC_H264_SRC(src);
+
+  GST_DEBUG_OBJECT(self, "Unlocking create");
+  g_atomic_int_set(&self->flushing, TRUE);
+  g_async_queue_push(self->frame_queue, QUEUE_WAKEUP);
+  return TRUE;
+}
+
+static gboolean gst_libuvc_h264_src_unlock_stop(GstBaseSrc *src) {
+  GstLibuvcH264Src *self = GST_LIBUVC_H264_SRC(src);
+
+  GST_DEBUG_OBJECT(self, "Unlock stopped");
+  g_atomic_int_set(&self->flushing, FALSE);
+  return TRUE;
+}
+
 static void gst_libuvc_h264_src_finalize(GObject *object) {
     GstLibuvcH264Src *self = GST_LIBUVC_H264_SRC(object);
 
@@ -890,16 +3233,23 @@ static void gst_libuvc_h264_src_finalize(GObject *object) {
         self->index = NULL;
     }
 
+    g_free(self->serial);
+    self->serial = NULL;
+
+    g_free(self->keyframe_xu_request);
+    self->keyframe_xu_request = NULL;
+
     if (self->frame_queue) {
-        GstBuffer *buffer;
-        while ((buffer = g_async_queue_try_pop(self->frame_queue)) != NULL) {
-            gst_buffer_unref(buffer);
-        }
-        
+        gst_libuvc_h264_src_flush_queue(self);
         g_async_queue_unref(self->frame_queue);
         self->frame_queue = NULL;
     }
 
+    g_array_free(self->nal_units, TRUE);
+    self->nal_units = NULL;
+
+    g_mutex_clear(&self->spspps_lock);
+
     GST_DEBUG_OBJECT(self, "Libuvc source finalized");
 
     G_OBJECT_CLASS(gst_libuvc_h264_src_parent_class)->finalize(object);
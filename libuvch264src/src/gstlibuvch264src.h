@@ -5,6 +5,10 @@
 #include <gst/gst.h>
 #include <gst/base/gstpushsrc.h>
 #include <libuvc/libuvc.h>
+#include "tsestimator.h"
+#include "nalscan.h"
+#include "h264sps.h"
+#include "gstuvcframemeta.h"
 
 G_BEGIN_DECLS
 
@@ -13,12 +17,104 @@ G_DECLARE_FINAL_TYPE(GstLibuvcH264Src, gst_libuvc_h264_src, GST, LIBUVC_H264_SRC
 
 #define DEFAULT_DEVICE_INDEX "0"
 #define TIMEOUT_DURATION G_TIME_SPAN_SECOND // 1 second
+// How long elements starting together reuse one bus enumeration
+#define DEVICE_LIST_MAX_AGE (2 * G_TIME_SPAN_SECOND)
 #define DJI_VENDOR_ID 0x2ca3
 #define DJI_PRODUCT_ID 0x0023
 
 #define SPSPPSBUFSZ 1024
 
-#define MIN_FRAMES_CALC_INTERVAL 60
+// Completed frames libuvc queues while frame_callback is busy
+#define FRAME_QUEUE_DEPTH 4
+
+// USB transfer ring; 0 leaves the choice to libuvc
+#define DEFAULT_TRANSFER_COUNT 0
+#define MAX_TRANSFER_COUNT 1000
+#define DEFAULT_PACKETS_PER_TRANSFER 0
+#define MAX_PACKETS_PER_TRANSFER 1024
+#define DEFAULT_TRANSFER_MEMORY 0
+
+#define DEFAULT_DIRECT_DISPATCH FALSE
+
+// Bounds on the frames waiting for create(); 0 disables a bound. Past
+// either one the rest of the GOP is dropped, and an IDR replaces whatever
+// is still queued.
+#define DEFAULT_MAX_QUEUE_TIME (500 * GST_MSECOND)
+#define DEFAULT_MAX_QUEUE_BUFFERS 30
+
+// Latency is the peak of push time minus PTS, easing down by 1/LATENCY_DECAY
+// of the difference per frame. A change of LATENCY_CHANGE_PERCENT, and at
+// least LATENCY_MIN_CHANGE, is announced with a latency message.
+#define LATENCY_DECAY 64
+#define LATENCY_CHANGE_PERCENT 20
+#define LATENCY_MIN_CHANGE (2 * GST_MSECOND)
+
+// Where buffer timestamps come from
+typedef enum {
+  GST_LIBUVC_H264_SRC_TIMESTAMP_HOST,   // frame arrival, smoothed
+  GST_LIBUVC_H264_SRC_TIMESTAMP_DEVICE  // camera PTS mapped through its SCR clock
+} GstLibuvcH264SrcTimestampMode;
+
+// What create() does when no frame arrives within stall-timeout
+typedef enum {
+  GST_LIBUVC_H264_SRC_STALL_WARNING, // post a warning on the bus, once per stall
+  GST_LIBUVC_H264_SRC_STALL_GAP      // also push a gap event per timeout
+} GstLibuvcH264SrcStallAction;
+
+#define DEFAULT_STALL_TIMEOUT (TIMEOUT_DURATION * GST_USECOND)
+#define DEFAULT_STALL_ACTION GST_LIBUVC_H264_SRC_STALL_WARNING
+
+// create() checks on the stream this often while no frames arrive
+#define STREAM_CHECK_INTERVAL (100 * GST_MSECOND)
+
+// After the camera drops off the bus it is looked for every
+// RECONNECT_INTERVAL until reconnect-timeout runs out
+#define RECONNECT_INTERVAL (100 * GST_MSECOND)
+#define DEFAULT_RECONNECT_TIMEOUT (10 * GST_SECOND)
+
+// A stream that delivered frames and then went silent for watchdog-timeout,
+// or WATCHDOG_MIN_FRAMES frame intervals if that is longer, is restarted
+// with the next uvc_stream_reset() level; each level gets the same budget
+#define DEFAULT_WATCHDOG_TIMEOUT (300 * GST_MSECOND)
+#define WATCHDOG_MIN_FRAMES 3
+#define WATCHDOG_LEVELS (UVC_STREAM_RESET_DEVICE + 1)
+
+// How an upstream force-key-unit event gets the camera to send an IDR.
+// Either way the next IDR carries the headers asked for and is announced
+// downstream; the camera is asked at most once per keyframe-interval.
+typedef enum {
+  GST_LIBUVC_H264_SRC_KEYFRAME_NONE,    // wait for the camera's own next IDR
+  GST_LIBUVC_H264_SRC_KEYFRAME_AUTO,    // UVC 1.5 encoding unit, else keyframe-xu-request
+  GST_LIBUVC_H264_SRC_KEYFRAME_RESTART  // commit the stream again, costs a few frames
+} GstLibuvcH264SrcKeyframeMethod;
+
+// Encoder settings pushed to the camera; 0 leaves the camera's own.
+// Quality is wCompQuality, 1 (lowest) to 10000 (highest).
+#define DEFAULT_BITRATE 0
+#define DEFAULT_QUALITY 0
+#define MAX_QUALITY 10000
+
+#define DEFAULT_KEYFRAME_METHOD GST_LIBUVC_H264_SRC_KEYFRAME_AUTO
+#define DEFAULT_KEYFRAME_INTERVAL GST_SECOND
+#define MAX_XU_REQUEST_SIZE 64
+
+#define DEFAULT_TIMESTAMP_MODE GST_LIBUVC_H264_SRC_TIMESTAMP_HOST
+#define DEFAULT_TIMESTAMP_ESTIMATOR TS_ESTIMATOR_LOCKED
+
+// Single-thread mode: the control thread also runs libusb events and
+// picks up frames, waking at least this often for USB timeouts
+#define DEFAULT_EVENT_LOOP FALSE
+#define EVENT_LOOP_TIMEOUT_MS 100
+#define MAX_EVENT_LOOP_FDS 32
+
+// Fast start: the stream runs from negotiation on, in PAUSED, and the
+// camera is asked for an IDR on the way to PLAYING
+#define DEFAULT_FAST_START FALSE
+
+// A camera held by a session that had to be cleaned up forcibly is tried
+// every DEVICE_SETTLE_INTERVAL until it opens or DEVICE_SETTLE_TIMEOUT passes
+#define DEVICE_SETTLE_INTERVAL (20 * G_TIME_SPAN_MILLISECOND)
+#define DEVICE_SETTLE_TIMEOUT G_TIME_SPAN_SECOND
 
 struct _GstLibuvcH264Src {
   GstPushSrc parent_instance;
@@ -27,19 +123,96 @@ struct _GstLibuvcH264Src {
   uvc_device_t *uvc_dev;
   uvc_device_handle_t *uvc_devh;
   uvc_stream_ctrl_t uvc_ctrl;
+  uvc_stream_handle_t *uvc_strmh;
+  GstBufferPool *frame_pool; // backs the buffers libuvc assembles frames into
+  gint transfer_count;
+  gint packets_per_transfer;
+  guint64 transfer_memory;
+  gboolean direct_dispatch; // run frame_callback in the USB event thread
+  gboolean event_loop; // one thread for USB, frames and the control socket
+  gint frame_fd; // readable while libuvc has frames queued, -1 if not streaming
+  gint usb_pollfds_changed;
+  GstLibuvcH264SrcTimestampMode timestamp_mode;
+  ts_estimator_mode_t timestamp_estimator;
+  ts_estimator_t ts_est; // guarded by the object lock
   GAsyncQueue *frame_queue;
+  GstClockTime max_queue_time;
+  guint max_queue_buffers;
+  GstClockTime queued_time; // sum of queued durations, guarded by the queue lock
+  gboolean drop_until_idr;  // shedding load, resume at the next IDR
+  guint64 dropped_frames;   // both counters guarded by the object lock
+  guint64 dropped_gops;
+  gint flushing;               // set by unlock(), create() returns FLUSHING
+  GstClockTime stall_timeout;  // 0 waits forever
+  GstLibuvcH264SrcStallAction stall_action;
+  gboolean stalled;
+  GstClockTime gap_position;   // end of the last buffer or gap pushed
+  guint16 vendor_id;           // identity of the open camera, to find it
+  guint16 product_id;          // again when it comes back
+  gchar *serial;               // NULL if the camera has none
+  gint64 disconnect_time;      // monotonic, 0 while connected
+  GstClockTime reconnect_timeout;
+  guint reconnects;            // both guarded by the object lock
+  GstClockTime reconnect_time; // how long the last reconnect took
+  GstClockTime watchdog_timeout;  // 0 disables the watchdog
+  gboolean watchdog_armed;        // the stream has delivered a frame
+  guint32 watchdog_sequence;      // libuvc frame number last seen
+  GstClockTime watchdog_silence;  // how long it has not changed
+  gint watchdog_level;            // recovery steps taken in this stall
+  gint64 watchdog_start;          // monotonic time the stall began
+  guint recoveries[WATCHDOG_LEVELS]; // both guarded by the object lock
+  GstClockTime recovery_time;     // how long the last recovery took
+  guint bitrate;                  // bits/s
+  guint quality;
+  gboolean encoder_changed;       // the above guarded by the object lock
+  GstLibuvcH264SrcKeyframeMethod keyframe_method;
+  GstClockTime keyframe_interval;
+  gchar *keyframe_xu_request;     // "unit:selector:hexdata", NULL if none
+  gboolean keyframe_pending;      // not yet asked of the camera
+  gboolean keyframe_announce;     // push a force-key-unit event with the next IDR
+  gboolean keyframe_all_headers;
+  guint keyframe_count;           // the above guarded by the object lock
+  gint keyframe_headers;          // frame_callback puts SPS/PPS on the next IDR
+  gint64 keyframe_request_time;   // monotonic, last time the camera was asked
+  guint keyframe_requests;        // guarded by the object lock
+  gboolean fast_start;            // guarded by the object lock
+  gint64 start_time;              // monotonic, when start() was called
+  GstClockTime first_idr_time;    // from start() to the first IDR pushed, 0 before;
+                                  // guarded by the object lock
   gboolean streaming;
-  GstClockTime uvc_start_time;
-  GstClockTime prev_pts;
-  gint64 frame_interval; // in ns
-  guint64 prev_int_ts;
-  gint frame_count;
+  gint playing; // frames are only timestamped and queued while PLAYING
+  GstClockTime uvc_start_time; // origin of timestamps when there is no clock
+  GstClockTime prev_pts; // streaming thread only
+  gint reset_prev_pts;   // set on PAUSED_TO_PLAYING, consumed with the next frame
+  gint64 last_sequence; // libuvc frame number of the last frame seen, -1 before the first
+  guint32 pending_gap;  // frames libuvc lost since the last pushed buffer
+  gint64 frame_interval; // nominal, in ns
+  GstClockTime latency_peak; // measured, see LATENCY_DECAY
+  GstClockTime latency;      // reported; both guarded by the object lock
   gboolean had_idr;
   gboolean send_sps_pps;
-  gint sps_length;
-  gint pps_length;
+  // sps, pps, their lengths and known flags, codec_data and
+  // codec_data_changed are written by frame_callback() while streaming and
+  // by start() and negotiation otherwise; writers and readers off the
+  // libuvc thread take spspps_lock
+  GMutex spspps_lock;
+  guint sps_length;
+  guint pps_length;
   unsigned char sps[SPSPPSBUFSZ];
   unsigned char pps[SPSPPSBUFSZ];
+  gboolean sps_known; // sps came from this camera or its cache file rather
+  gboolean pps_known; // than the built-in defaults; same for pps
+  gboolean spspps_stored; // sps/pps are what the cache file for this camera holds
+  GThreadPool *spspps_writer; // writes the cache file, one job at a time
+  GstMemory *spspps_mem; // cached SPS+PPS chained in front of IDRs
+  gboolean spspps_mem_avc; // ... in length-prefixed form
+  gint avc;              // negotiated stream-format=avc rather than byte-stream
+  GstBuffer *codec_data; // avcC built from sps/pps
+  gboolean codec_data_changed; // goes out as new caps with the next IDR
+  h264_sps_t sps_info;   // the live SPS, parsed
+  gboolean sps_info_changed; // goes out as new caps with the next IDR
+  gint caps_need_sps;    // negotiated caps still carry descriptor values only
+  GArray *nal_units;     // frame_callback's NAL walk, reused frame to frame
   
   // Control socket additions
   gint control_socket;
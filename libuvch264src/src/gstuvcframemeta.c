@@ -0,0 +1,96 @@
+#include "gstuvcframemeta.h"
+
+GType gst_uvc_frame_meta_api_get_type(void) {
+    static gsize type = 0;
+    static const gchar *tags[] = { NULL };
+
+    if (g_once_init_enter(&type)) {
+        GType t = gst_meta_api_type_register("GstUvcFrameMetaAPI", tags);
+        g_once_init_leave(&type, t);
+    }
+    return type;
+}
+
+static gboolean gst_uvc_frame_meta_init(GstMeta *meta, gpointer params G_GNUC_UNUSED,
+                                        GstBuffer *buffer G_GNUC_UNUSED) {
+    GstUvcFrameMeta *fmeta = (GstUvcFrameMeta *)meta;
+
+    fmeta->sequence = 0;
+    fmeta->sequence_gap = 0;
+    fmeta->first_packet = GST_CLOCK_TIME_NONE;
+    fmeta->last_packet = GST_CLOCK_TIME_NONE;
+    fmeta->pts = 0;
+    fmeta->scr = 0;
+    fmeta->scr_sof = 0;
+    fmeta->packet_errors = 0;
+    return TRUE;
+}
+
+// The timing belongs to the frame, so it survives copies of the buffer
+static gboolean gst_uvc_frame_meta_transform(GstBuffer *dest, GstMeta *meta,
+                                             GstBuffer *buffer G_GNUC_UNUSED,
+                                             GQuark type, gpointer data G_GNUC_UNUSED) {
+    GstUvcFrameMeta *src = (GstUvcFrameMeta *)meta;
+    GstUvcFrameMeta *dmeta;
+
+    if (!GST_META_TRANSFORM_IS_COPY(type)) {
+        return FALSE;
+    }
+
+    dmeta = (GstUvcFrameMeta *)gst_buffer_add_meta(dest, GST_UVC_FRAME_META_INFO, NULL);
+    if (!dmeta) {
+        return FALSE;
+    }
+
+    dmeta->sequence = src->sequence;
+    dmeta->sequence_gap = src->sequence_gap;
+    dmeta->first_packet = src->first_packet;
+    dmeta->last_packet = src->last_packet;
+    dmeta->pts = src->pts;
+    dmeta->scr = src->scr;
+    dmeta->scr_sof = src->scr_sof;
+    dmeta->packet_errors = src->packet_errors;
+    return TRUE;
+}
+
+const GstMetaInfo *gst_uvc_frame_meta_get_info(void) {
+    static const GstMetaInfo *info = NULL;
+
+    if (g_once_init_enter((gsize *)&info)) {
+        const GstMetaInfo *mi = gst_meta_register(GST_UVC_FRAME_META_API_TYPE,
+                                                  "GstUvcFrameMeta",
+                                                  sizeof(GstUvcFrameMeta),
+                                                  gst_uvc_frame_meta_init,
+                                                  NULL,
+                                                  gst_uvc_frame_meta_transform);
+        g_once_init_leave((gsize *)&info, (gsize)mi);
+    }
+    return info;
+}
+
+static GstClockTime timespec_to_time(const struct timespec *ts) {
+    if (!ts->tv_sec && !ts->tv_nsec) {
+        return GST_CLOCK_TIME_NONE;
+    }
+    return (GstClockTime)ts->tv_sec * GST_SECOND + ts->tv_nsec;
+}
+
+GstUvcFrameMeta *gst_buffer_add_uvc_frame_meta(GstBuffer *buffer, const uvc_frame_t *frame,
+                                               guint32 sequence_gap) {
+    GstUvcFrameMeta *fmeta =
+        (GstUvcFrameMeta *)gst_buffer_add_meta(buffer, GST_UVC_FRAME_META_INFO, NULL);
+
+    if (!fmeta) {
+        return NULL;
+    }
+
+    fmeta->sequence = frame->sequence;
+    fmeta->sequence_gap = sequence_gap;
+    fmeta->first_packet = timespec_to_time(&frame->capture_time_started);
+    fmeta->last_packet = timespec_to_time(&frame->capture_time_finished);
+    fmeta->pts = frame->pts;
+    fmeta->scr = frame->scr;
+    fmeta->scr_sof = frame->scr_sof;
+    fmeta->packet_errors = frame->packet_errors;
+    return fmeta;
+}
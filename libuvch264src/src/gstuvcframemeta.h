@@ -0,0 +1,38 @@
+#ifndef GST_UVC_FRAME_META_H
+#define GST_UVC_FRAME_META_H
+
+#include <gst/gst.h>
+#include <libuvc/libuvc.h>
+
+G_BEGIN_DECLS
+
+// USB-side history of a frame, for tracers and rate control downstream.
+// Other elements can look the API up by name ("GstUvcFrameMetaAPI").
+typedef struct {
+  GstMeta meta;
+
+  guint32 sequence;      // libuvc frame number
+  guint32 sequence_gap;  // frames lost between the previous buffer and this one
+  GstClockTime first_packet; // CLOCK_MONOTONIC arrival of the first image data
+  GstClockTime last_packet;  // CLOCK_MONOTONIC arrival of the last packet
+  guint32 pts;           // device PTS, 0 if none
+  guint32 scr;           // device source clock of the last SCR, 0 if none
+  guint16 scr_sof;       // USB frame number the SCR was sampled at
+  guint32 packet_errors; // packets dropped while assembling the frame
+} GstUvcFrameMeta;
+
+GType gst_uvc_frame_meta_api_get_type(void);
+const GstMetaInfo *gst_uvc_frame_meta_get_info(void);
+
+#define GST_UVC_FRAME_META_API_TYPE (gst_uvc_frame_meta_api_get_type())
+#define GST_UVC_FRAME_META_INFO (gst_uvc_frame_meta_get_info())
+
+#define gst_buffer_get_uvc_frame_meta(b) \
+  ((GstUvcFrameMeta *)gst_buffer_get_meta((b), GST_UVC_FRAME_META_API_TYPE))
+
+GstUvcFrameMeta *gst_buffer_add_uvc_frame_meta(GstBuffer *buffer, const uvc_frame_t *frame,
+                                               guint32 sequence_gap);
+
+G_END_DECLS
+
+#endif /* GST_UVC_FRAME_META_H */
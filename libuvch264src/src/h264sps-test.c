@@ -0,0 +1,164 @@
+// SPS parsing against parameter sets with known contents: the element's
+// built-in default, an x264 one, and ones written field by field to cover
+// scaling lists, cropping in each chroma format, interlacing, VUI colour
+// and timing, and emulation prevention bytes. Every truncation of each must
+// fail or parse the same, never read past the end.
+
+#include <string.h>
+#include "h264sps.h"
+
+// The element's default: High 5.2 1080p30, cropped from 1088, BT.709
+static const guint8 sps_default[] = {
+    0x67, 0x64, 0x00, 0x34, 0xac, 0x4d, 0x00, 0xf0, 0x04, 0x4f, 0xcb, 0x35,
+    0x01, 0x01, 0x01, 0x40, 0x00, 0x00, 0xfa, 0x00, 0x00, 0x3a, 0x98, 0x03,
+    0xc7, 0x0c, 0xa8,
+};
+
+// x264: High 4 1080p25, 00 00 03 in the timing info
+static const guint8 sps_x264[] = {
+    0x67, 0x64, 0x00, 0x28, 0xac, 0xd9, 0x40, 0x78, 0x02, 0x27, 0xe5, 0xc0,
+    0x44, 0x00, 0x00, 0x03, 0x00, 0x04, 0x00, 0x00, 0x03, 0x00, 0xc8, 0x3c,
+    0x60, 0xc6, 0x58,
+};
+
+// High 4.1 720p29.97: a default, a flat, a custom 4x4 and two 8x8 scaling
+// lists; 4:3 SAR given explicitly, BT.2020 full range
+static const guint8 sps_scaling[] = {
+    0x67, 0x64, 0x00, 0x29, 0xad, 0x84, 0x69, 0x24, 0x92, 0x49, 0x24, 0x92,
+    0x4c, 0xe2, 0xb9, 0x3f, 0xe4, 0xe5, 0x74, 0x43, 0x1c, 0xae, 0x88, 0x63,
+    0x95, 0xd1, 0x0c, 0x72, 0xba, 0x21, 0x8e, 0x57, 0x44, 0x31, 0xca, 0xe8,
+    0x86, 0x39, 0x5d, 0x10, 0xc7, 0x2b, 0xa2, 0x18, 0xe5, 0x74, 0x43, 0x1e,
+    0x03, 0x20, 0x06, 0x4f, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xfb,
+    0x28, 0x0a, 0x00, 0xb7, 0x7f, 0xe0, 0x00, 0x80, 0x00, 0x6d, 0xc2, 0x43,
+    0x82, 0x50, 0x00, 0x00, 0x3e, 0x90, 0x00, 0x0e, 0xa6, 0x08, 0x9a, 0x08,
+    0x84, 0x59, 0x60,
+};
+
+// Constrained baseline 3 640x360, cropped from 368; pic_order_cnt_type 1,
+// timing 1/60 written with escapes
+static const guint8 sps_crop[] = {
+    0x67, 0x42, 0xc0, 0x1e, 0xd1, 0x91, 0x98, 0x59, 0x40, 0xa0, 0x2f, 0xf9,
+    0x70, 0x11, 0x00, 0x00, 0x03, 0x00, 0x01, 0x00, 0x00, 0x03, 0x00, 0x3c,
+    0x89, 0xa0, 0x88, 0x45, 0x96,
+};
+
+// Main 1b (level 1.1 with constraint_set3) 1080i25: field MBs and crop
+// units double, BT.601 limited range
+static const guint8 sps_interlaced[] = {
+    0x67, 0x4d, 0x10, 0x0b, 0xec, 0xa0, 0x3c, 0x02, 0x27, 0xee, 0x6a, 0x0c,
+    0x0c, 0x0c, 0x80, 0x00, 0x00, 0x03, 0x00, 0x80, 0x00, 0x00, 0x19, 0x44,
+    0xd0, 0x44, 0x22, 0xcb,
+};
+
+// High 4:2:2 4, cropped 4 px each side (crop units of 2 across); timing
+// info with num_units_in_tick 0 is no timing info
+static const guint8 sps_high422[] = {
+    0x67, 0x7a, 0x00, 0x28, 0xbc, 0xd9, 0x40, 0x51, 0x05, 0xbd, 0xbe, 0x10,
+    0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x00, 0x00, 0x03, 0x03, 0x28, 0x9a,
+    0x08, 0x84, 0x59, 0x60,
+};
+
+typedef struct {
+    const gchar *name;
+    const guint8 *data;
+    gsize size;
+    const gchar *profile;
+    const gchar *level;
+    gint width, height;
+    gint par_n, par_d;
+    gboolean interlaced;
+    gint fps_n, fps_d; // 0/0 without timing info
+    gboolean colour; // the four below valid
+    gboolean full_range;
+    guint8 primaries, transfer, matrix;
+} sps_case_t;
+
+#define SPS(a) a, sizeof(a)
+
+static const sps_case_t cases[] = {
+    { "default", SPS(sps_default), "high", "5.2", 1920, 1080, 1, 1, FALSE, 30, 1, TRUE, FALSE, 1, 1, 1 },
+    { "x264", SPS(sps_x264), "high", "4", 1920, 1080, 1, 1, FALSE, 25, 1, FALSE, FALSE, 0, 0, 0 },
+    { "scaling", SPS(sps_scaling), "high", "4.1", 1280, 720, 4, 3, FALSE, 30000, 1001, TRUE, TRUE, 9, 14, 9 },
+    { "crop", SPS(sps_crop), "constrained-baseline", "3", 640, 360, 1, 1, FALSE, 30, 1, FALSE, FALSE, 0, 0, 0 },
+    { "interlaced", SPS(sps_interlaced), "main", "1b", 1920, 1080, 1, 1, TRUE, 25, 1, TRUE, FALSE, 6, 6, 6 },
+    { "high422", SPS(sps_high422), "high-4:2:2", "4", 1288, 720, 1, 1, FALSE, 0, 0, FALSE, FALSE, 0, 0, 0 },
+};
+
+static gboolean check(const sps_case_t *c) {
+    h264_sps_t sps, part;
+    gboolean ok = TRUE;
+    gchar *level;
+
+    if (!h264_sps_parse(&sps, c->data, c->size)) {
+        g_printerr("%s: not parsed\n", c->name);
+        return FALSE;
+    }
+
+    level = h264_sps_level(&sps);
+    if (g_strcmp0(h264_sps_profile(&sps), c->profile) != 0 || g_strcmp0(level, c->level) != 0) {
+        g_printerr("%s: profile %s level %s, expected %s %s\n", c->name,
+                   h264_sps_profile(&sps), level, c->profile, c->level);
+        ok = FALSE;
+    }
+    g_free(level);
+    if (sps.width != c->width || sps.height != c->height || sps.interlaced != c->interlaced) {
+        g_printerr("%s: %dx%d%s, expected %dx%d%s\n", c->name, sps.width, sps.height,
+                   sps.interlaced ? "i" : "p", c->width, c->height, c->interlaced ? "i" : "p");
+        ok = FALSE;
+    }
+    if (sps.par_n != c->par_n || sps.par_d != c->par_d) {
+        g_printerr("%s: pixel aspect %d/%d, expected %d/%d\n", c->name, sps.par_n, sps.par_d,
+                   c->par_n, c->par_d);
+        ok = FALSE;
+    }
+    // Two ticks to a frame, as the element takes it
+    if (sps.timing_info != (c->fps_d != 0) ||
+        (sps.timing_info && (guint64)sps.time_scale * c->fps_d !=
+                            (guint64)sps.num_units_in_tick * 2 * c->fps_n)) {
+        g_printerr("%s: timing %u/%u, expected %d/%d fps\n", c->name, sps.time_scale,
+                   sps.num_units_in_tick, c->fps_n, c->fps_d);
+        ok = FALSE;
+    }
+    if (sps.colour_description != c->colour ||
+        (c->colour && (sps.full_range != c->full_range || sps.colour_primaries != c->primaries ||
+                       sps.transfer_characteristics != c->transfer ||
+                       sps.matrix_coefficients != c->matrix))) {
+        g_printerr("%s: colour %d range %d %u/%u/%u\n", c->name, sps.colour_description,
+                   sps.full_range, sps.colour_primaries, sps.transfer_characteristics,
+                   sps.matrix_coefficients);
+        ok = FALSE;
+    }
+
+    // Copies sized to the cut, so a sanitizer build sees any overread
+    for (gsize size = 0; size < c->size; size++) {
+        guint8 *copy = g_malloc(MAX(size, 1));
+
+        memcpy(copy, c->data, size);
+        if (h264_sps_parse(&part, copy, size) && memcmp(&part, &sps, sizeof(sps)) != 0) {
+            g_printerr("%s: cut to %" G_GSIZE_FORMAT " bytes parses differently\n", c->name, size);
+            ok = FALSE;
+        }
+        g_free(copy);
+    }
+
+    g_print("%-10s %s\n", c->name, ok ? "ok" : "FAILED");
+    return ok;
+}
+
+int main(void) {
+    static const guint8 pps[] = { 0x68, 0xEE, 0x3C, 0xB0 };
+    h264_sps_t sps;
+    gboolean ok = TRUE;
+
+    for (guint i = 0; i < G_N_ELEMENTS(cases); i++) {
+        ok &= check(&cases[i]);
+    }
+
+    // Not an SPS at all
+    if (h264_sps_parse(&sps, pps, sizeof(pps))) {
+        g_printerr("a PPS parsed as an SPS\n");
+        ok = FALSE;
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,301 @@
+#include <string.h>
+#include "h264sps.h"
+
+// Bit reader over the RBSP, dropping emulation prevention bytes (00 00 03)
+// as it goes. Reads past the end return zeros and set overrun.
+typedef struct {
+    const guint8 *p;
+    const guint8 *end;
+    guint zeros;     // zero bytes just taken
+    guint32 cache;
+    guint bits;      // valid bits in cache, msb first
+    gboolean overrun;
+} bit_reader_t;
+
+static void br_init(bit_reader_t *br, const guint8 *data, gsize size) {
+    br->p = data;
+    br->end = data + size;
+    br->zeros = 0;
+    br->cache = 0;
+    br->bits = 0;
+    br->overrun = FALSE;
+}
+
+static gboolean br_fill(bit_reader_t *br) {
+    guint8 b;
+
+    if (br->p < br->end && br->zeros >= 2 && *br->p == 3) {
+        br->p++;
+        br->zeros = 0;
+    }
+    if (br->p >= br->end) {
+        br->overrun = TRUE;
+        return FALSE;
+    }
+    b = *br->p++;
+    br->zeros = b ? 0 : br->zeros + 1;
+    br->cache = (br->cache << 8) | b;
+    br->bits += 8;
+    return TRUE;
+}
+
+// n up to 24
+static guint32 br_bits(bit_reader_t *br, guint n) {
+    while (br->bits < n) {
+        if (!br_fill(br)) {
+            return 0;
+        }
+    }
+    br->bits -= n;
+    return (br->cache >> br->bits) & ((1u << n) - 1);
+}
+
+static guint32 br_u32(bit_reader_t *br) {
+    guint32 hi = br_bits(br, 16);
+    return (hi << 16) | br_bits(br, 16);
+}
+
+static guint32 br_ue(bit_reader_t *br) {
+    guint zeros = 0;
+
+    while (!br_bits(br, 1)) {
+        if (br->overrun || ++zeros > 31) {
+            br->overrun = TRUE;
+            return 0;
+        }
+    }
+    if (zeros > 16) {
+        guint32 hi = br_bits(br, zeros - 16);
+        return ((1u << zeros) - 1) + ((hi << 16) | br_bits(br, 16));
+    }
+    return ((1u << zeros) - 1) + br_bits(br, zeros);
+}
+
+static gint32 br_se(bit_reader_t *br) {
+    guint32 v = br_ue(br);
+    return (v & 1) ? (gint32)((v + 1) / 2) : -(gint32)(v / 2);
+}
+
+static void skip_scaling_list(bit_reader_t *br, guint size) {
+    gint last = 8, next = 8;
+
+    for (guint i = 0; i < size && !br->overrun; i++) {
+        if (next) {
+            next = (last + br_se(br) + 256) % 256;
+        }
+        last = next ? next : last;
+    }
+}
+
+// Table E-1
+static const guint8 sar_table[][2] = {
+    {  0,  0 }, {  1,  1 }, { 12, 11 }, { 10, 11 }, { 16, 11 }, { 40, 33 },
+    { 24, 11 }, { 20, 11 }, { 32, 11 }, { 80, 33 }, { 18, 11 }, { 15, 11 },
+    { 64, 33 }, {160, 99 }, {  4,  3 }, {  3,  2 }, {  2,  1 },
+};
+
+static void parse_vui(bit_reader_t *br, h264_sps_t *sps) {
+    if (br_bits(br, 1)) { // aspect_ratio_info_present_flag
+        guint idc = br_bits(br, 8);
+        if (idc == 255) {
+            sps->par_n = br_bits(br, 16);
+            sps->par_d = br_bits(br, 16);
+        } else if (idc && idc < G_N_ELEMENTS(sar_table)) {
+            sps->par_n = sar_table[idc][0];
+            sps->par_d = sar_table[idc][1];
+        }
+        if (!sps->par_n || !sps->par_d) {
+            sps->par_n = sps->par_d = 1;
+        }
+    }
+    if (br_bits(br, 1)) { // overscan_info_present_flag
+        br_bits(br, 1);
+    }
+    if (br_bits(br, 1)) { // video_signal_type_present_flag
+        br_bits(br, 3); // video_format
+        sps->full_range = br_bits(br, 1);
+        if (br_bits(br, 1)) {
+            sps->colour_description = TRUE;
+            sps->colour_primaries = br_bits(br, 8);
+            sps->transfer_characteristics = br_bits(br, 8);
+            sps->matrix_coefficients = br_bits(br, 8);
+        }
+    }
+    if (br_bits(br, 1)) { // chroma_loc_info_present_flag
+        br_ue(br);
+        br_ue(br);
+    }
+    if (br_bits(br, 1)) { // timing_info_present_flag
+        sps->num_units_in_tick = br_u32(br);
+        sps->time_scale = br_u32(br);
+        br_bits(br, 1); // fixed_frame_rate_flag
+        sps->timing_info = sps->num_units_in_tick && sps->time_scale;
+    }
+    // HRD parameters and the rest are of no use for caps
+}
+
+gboolean h264_sps_parse(h264_sps_t *sps, const guint8 *nal, gsize size) {
+    bit_reader_t br;
+    guint separate_colour_plane = 0;
+    guint width_mbs, height_map_units;
+    guint crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+    guint crop_x, crop_y;
+
+    memset(sps, 0, sizeof(*sps));
+    sps->par_n = sps->par_d = 1;
+    sps->chroma_format_idc = 1;
+    sps->bit_depth_luma = 8;
+
+    if (size < 4 || (nal[0] & 0x1F) != 7) {
+        return FALSE;
+    }
+    br_init(&br, nal + 1, size - 1);
+
+    sps->profile_idc = br_bits(&br, 8);
+    sps->constraint_flags = br_bits(&br, 8);
+    sps->level_idc = br_bits(&br, 8);
+    if (br_ue(&br) > 31) { // seq_parameter_set_id
+        return FALSE;
+    }
+
+    switch (sps->profile_idc) {
+    case 100: case 110: case 122: case 244: case 44:
+    case 83: case 86: case 118: case 128: case 138: case 139: case 134: case 135:
+        sps->chroma_format_idc = br_ue(&br);
+        if (sps->chroma_format_idc > 3) {
+            return FALSE;
+        }
+        if (sps->chroma_format_idc == 3) {
+            separate_colour_plane = br_bits(&br, 1);
+        }
+        sps->bit_depth_luma = br_ue(&br) + 8;
+        br_ue(&br); // bit_depth_chroma_minus8
+        br_bits(&br, 1); // qpprime_y_zero_transform_bypass_flag
+        if (br_bits(&br, 1)) { // seq_scaling_matrix_present_flag
+            guint lists = sps->chroma_format_idc == 3 ? 12 : 8;
+            for (guint i = 0; i < lists; i++) {
+                if (br_bits(&br, 1)) {
+                    skip_scaling_list(&br, i < 6 ? 16 : 64);
+                }
+            }
+        }
+        break;
+    default:
+        break;
+    }
+
+    br_ue(&br); // log2_max_frame_num_minus4
+    switch (br_ue(&br)) { // pic_order_cnt_type
+    case 0:
+        br_ue(&br); // log2_max_pic_order_cnt_lsb_minus4
+        break;
+    case 1: {
+        guint cycle;
+        br_bits(&br, 1); // delta_pic_order_always_zero_flag
+        br_se(&br);      // offset_for_non_ref_pic
+        br_se(&br);      // offset_for_top_to_bottom_field
+        cycle = br_ue(&br);
+        if (cycle > 255) {
+            return FALSE;
+        }
+        for (guint i = 0; i < cycle; i++) {
+            br_se(&br);
+        }
+        break;
+    }
+    case 2:
+        break;
+    default:
+        return FALSE;
+    }
+    br_ue(&br);      // max_num_ref_frames
+    br_bits(&br, 1); // gaps_in_frame_num_value_allowed_flag
+
+    width_mbs = br_ue(&br) + 1;
+    height_map_units = br_ue(&br) + 1;
+    sps->interlaced = !br_bits(&br, 1);
+    if (sps->interlaced) {
+        br_bits(&br, 1); // mb_adaptive_frame_field_flag
+    }
+    br_bits(&br, 1); // direct_8x8_inference_flag
+    if (br_bits(&br, 1)) { // frame_cropping_flag
+        crop_left = br_ue(&br);
+        crop_right = br_ue(&br);
+        crop_top = br_ue(&br);
+        crop_bottom = br_ue(&br);
+    }
+    if (br_bits(&br, 1)) { // vui_parameters_present_flag
+        parse_vui(&br, sps);
+    }
+    if (br.overrun || width_mbs > 1024 || height_map_units > 1024) {
+        return FALSE;
+    }
+
+    // 7.4.2.1.1: crop units depend on the chroma subsampling
+    if (separate_colour_plane || sps->chroma_format_idc == 0) {
+        crop_x = 1;
+        crop_y = 1;
+    } else {
+        crop_x = sps->chroma_format_idc == 3 ? 1 : 2;
+        crop_y = sps->chroma_format_idc == 1 ? 2 : 1;
+    }
+    crop_y *= sps->interlaced ? 2 : 1;
+
+    sps->width = width_mbs * 16;
+    sps->height = height_map_units * 16 * (sps->interlaced ? 2 : 1);
+    if ((gint64)(crop_left + crop_right) * crop_x >= sps->width ||
+        (gint64)(crop_top + crop_bottom) * crop_y >= sps->height) {
+        return FALSE;
+    }
+    sps->width -= (crop_left + crop_right) * crop_x;
+    sps->height -= (crop_top + crop_bottom) * crop_y;
+
+    return TRUE;
+}
+
+const gchar *h264_sps_profile(const h264_sps_t *sps) {
+    gboolean set1 = sps->constraint_flags & 0x40;
+    gboolean set3 = sps->constraint_flags & 0x10;
+    gboolean set4 = sps->constraint_flags & 0x08;
+    gboolean set5 = sps->constraint_flags & 0x04;
+
+    switch (sps->profile_idc) {
+    case 66:
+        return set1 ? "constrained-baseline" : "baseline";
+    case 77:
+        return "main";
+    case 88:
+        return "extended";
+    case 100:
+        if (set4) {
+            return set5 ? "constrained-high" : "progressive-high";
+        }
+        return "high";
+    case 110:
+        return set3 ? "high-10-intra" : "high-10";
+    case 122:
+        return set3 ? "high-4:2:2-intra" : "high-4:2:2";
+    case 244:
+        return set3 ? "high-4:4:4-intra" : "high-4:4:4";
+    case 44:
+        return "cavlc-4:4:4-intra";
+    default:
+        return NULL;
+    }
+}
+
+gchar *h264_sps_level(const h264_sps_t *sps) {
+    guint level = sps->level_idc;
+
+    // Level 1b: its own level_idc, or level 1.1 with constraint_set3_flag in
+    // the profiles that predate it
+    if (level == 9 || (level == 11 && (sps->constraint_flags & 0x10) &&
+                       (sps->profile_idc == 66 || sps->profile_idc == 77 ||
+                        sps->profile_idc == 88))) {
+        return g_strdup("1b");
+    }
+    if (level % 10 == 0) {
+        return g_strdup_printf("%u", level / 10);
+    }
+    return g_strdup_printf("%u.%u", level / 10, level % 10);
+}
@@ -0,0 +1,42 @@
+#ifndef H264_SPS_H
+#define H264_SPS_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+// What caps need from an H.264 sequence parameter set (ITU-T H.264 7.3.2.1
+// and E.1.1); colour codes are the ISO/IEC 23091-4 ones
+typedef struct {
+  guint8 profile_idc;
+  guint8 constraint_flags; // constraint_set0_flag in the top bit
+  guint8 level_idc;
+  guint chroma_format_idc;
+  guint bit_depth_luma;
+  gint width;              // after cropping
+  gint height;
+  gboolean interlaced;     // !frame_mbs_only_flag
+  gint par_n;              // sample aspect ratio, 1/1 if not given
+  gint par_d;
+  gboolean timing_info;    // num_units_in_tick and time_scale valid
+  guint32 num_units_in_tick;
+  guint32 time_scale;
+  gboolean colour_description; // the four below valid
+  gboolean full_range;
+  guint8 colour_primaries;
+  guint8 transfer_characteristics;
+  guint8 matrix_coefficients;
+} h264_sps_t;
+
+// Parses an SPS NAL unit, nal pointing at its header byte. Returns FALSE
+// for anything that is not a complete, sane SPS.
+gboolean h264_sps_parse(h264_sps_t *sps, const guint8 *nal, gsize size);
+
+// Caps strings, as h264parse writes them; NULL for unknown profiles
+const gchar *h264_sps_profile(const h264_sps_t *sps);
+// Caller frees
+gchar *h264_sps_level(const h264_sps_t *sps);
+
+G_END_DECLS
+
+#endif /* H264_SPS_H */
@@ -0,0 +1,132 @@
+// Every start code scanner this CPU can run against a byte-by-byte
+// reference: start codes at every offset of buffers from empty to a few
+// vectors long (so at 0, end-3, end-2 and across the 16/32-byte tails),
+// in filler that is mostly zeros and ones. Buffers are allocated to their
+// exact size, so a sanitizer build also catches reads past the end.
+
+#include <string.h>
+#include "nalscan.h"
+
+#define MAX_SIZE 100
+
+static guint32 rng_state = 0x12345678;
+
+static guint8 next_byte(void) {
+    // Bytes a start code is made of, so near misses are everywhere
+    static const guint8 bytes[] = { 0, 0, 0, 1, 1, 2, 3, 0xFF };
+
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return bytes[rng_state >> 29];
+}
+
+static const guint8 *reference_find(const guint8 *p, const guint8 *end) {
+    for (; end - p >= 3; p++) {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1) {
+            return p;
+        }
+    }
+    return end;
+}
+
+// Fills buf with filler and puts a start code at pos, cut off by the end
+static void fill(guint8 *buf, gsize size, gsize pos, gboolean random) {
+    static const guint8 code[] = { 0, 0, 1 };
+
+    for (gsize i = 0; i < size; i++) {
+        buf[i] = random ? next_byte() : 0xAA;
+    }
+    for (gsize i = 0; i < 3 && pos + i < size; i++) {
+        buf[pos + i] = code[i];
+    }
+}
+
+static gboolean check_find(const nal_scan_impl_t *impl, const guint8 *buf, gsize size) {
+    const guint8 *end = buf + size;
+
+    for (gsize from = 0; from <= size; from++) {
+        const guint8 *got = impl->find(buf + from, end);
+        const guint8 *want = reference_find(buf + from, end);
+        if (got != want) {
+            g_printerr("%s: size %" G_GSIZE_FORMAT " from %" G_GSIZE_FORMAT ": start code at %"
+                       G_GSIZE_FORMAT ", expected %" G_GSIZE_FORMAT "\n", impl->name, size, from,
+                       (gsize)(got - buf), (gsize)(want - buf));
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+// nal_scan() against units cut at the reference start codes
+static gboolean check_units(GArray *units, const guint8 *buf, gsize size) {
+    const guint8 *end = buf + size;
+    const guint8 *p = reference_find(buf, end);
+    guint n = 0;
+
+    nal_scan(units, buf, size);
+    for (; p + 3 < end; p = reference_find(p + 3, end), n++) {
+        // A zero in front makes it a 4-byte start code
+        gsize offset = p - buf - (p > buf && p[-1] == 0);
+        const guint8 *next = reference_find(p + 3, end);
+        gsize next_offset = next + 3 < end ? (gsize)(next - buf - (next[-1] == 0)) : size;
+        const nal_scan_unit_t *unit;
+
+        if (n >= units->len) {
+            g_printerr("nal_scan: size %" G_GSIZE_FORMAT ": missed the unit at %" G_GSIZE_FORMAT "\n",
+                       size, offset);
+            return FALSE;
+        }
+        unit = &g_array_index(units, nal_scan_unit_t, n);
+        if (unit->offset != offset || unit->size != next_offset - offset ||
+            unit->header != (p - buf) - offset + 3 || unit->type != (p[3] & 0x1F)) {
+            g_printerr("nal_scan: size %" G_GSIZE_FORMAT ": unit %u at %u+%u, expected %"
+                       G_GSIZE_FORMAT "+%" G_GSIZE_FORMAT "\n", size, n, unit->offset, unit->size,
+                       offset, next_offset - offset);
+            return FALSE;
+        }
+    }
+    if (n != units->len) {
+        g_printerr("nal_scan: size %" G_GSIZE_FORMAT ": %u units, expected %u\n", size,
+                   units->len, n);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+int main(void) {
+    const nal_scan_impl_t *impls = nal_scan_impls();
+    GArray *units = g_array_new(FALSE, FALSE, sizeof(nal_scan_unit_t));
+    gboolean ok = TRUE;
+
+    for (const nal_scan_impl_t *impl = impls; impl->name; impl++) {
+        guint checked = 0;
+
+        for (gsize size = 0; size <= MAX_SIZE && ok; size++) {
+            guint8 *buf = g_malloc(MAX(size, 1));
+
+            for (gsize pos = 0; pos <= size && ok; pos++) {
+                fill(buf, size, pos, FALSE);
+                ok &= check_find(impl, buf, size);
+                fill(buf, size, pos, TRUE);
+                ok &= check_find(impl, buf, size);
+                checked += 2;
+            }
+            g_free(buf);
+        }
+        g_print("%-8s %u buffers%s\n", impl->name, checked, ok ? "" : ", FAILED");
+    }
+
+    for (gsize size = 0; size <= MAX_SIZE && ok; size++) {
+        guint8 *buf = g_malloc(MAX(size, 1));
+
+        for (guint i = 0; i < 64 && ok; i++) {
+            fill(buf, size, i % (size + 1), TRUE);
+            ok &= check_units(units, buf, size);
+        }
+        g_free(buf);
+    }
+
+    g_array_free(units, TRUE);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,183 @@
+#include "nalscan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NAL_SCAN_X86 1
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#define NAL_SCAN_NEON 1
+#include <arm_neon.h>
+#endif
+
+// Skips three bytes whenever the third one rules out a start code at all
+// three positions, which on slice data is nearly always
+static const guint8 *find_start_code_scalar(const guint8 *p, const guint8 *end) {
+    if (end - p < 3) {
+        return end;
+    }
+
+    const guint8 *last = end - 2;
+    while (p < last) {
+        if (p[2] > 1) {
+            p += 3;
+        } else if (p[2] == 0) {
+            p++;
+        } else if (p[0] == 0 && p[1] == 0) {
+            return p;
+        } else {
+            p += 3;
+        }
+    }
+
+    return end;
+}
+
+// The vector scanners test 16 or 32 positions at once: byte i and i+1 zero,
+// byte i+2 one, with three overlapping unaligned loads. The tail shorter
+// than a vector plus two bytes is left to the scalar scanner.
+
+#ifdef NAL_SCAN_X86
+__attribute__((target("sse2")))
+static const guint8 *find_start_code_sse2(const guint8 *p, const guint8 *end) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+
+    while (end - p >= 16 + 2) {
+        __m128i a = _mm_loadu_si128((const __m128i *)p);
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + 1));
+        __m128i c = _mm_loadu_si128((const __m128i *)(p + 2));
+        __m128i m = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero)),
+                                  _mm_cmpeq_epi8(c, one));
+        int mask = _mm_movemask_epi8(m);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+
+    return find_start_code_scalar(p, end);
+}
+
+__attribute__((target("avx2")))
+static const guint8 *find_start_code_avx2(const guint8 *p, const guint8 *end) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+
+    while (end - p >= 32 + 2) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)p);
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + 1));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(p + 2));
+        __m256i m = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(a, zero),
+                                                      _mm256_cmpeq_epi8(b, zero)),
+                                     _mm256_cmpeq_epi8(c, one));
+        guint32 mask = (guint32)_mm256_movemask_epi8(m);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 32;
+    }
+
+    return find_start_code_scalar(p, end);
+}
+#endif
+
+#ifdef NAL_SCAN_NEON
+static const guint8 *find_start_code_neon(const guint8 *p, const guint8 *end) {
+    const uint8x16_t zero = vdupq_n_u8(0);
+    const uint8x16_t one = vdupq_n_u8(1);
+
+    while (end - p >= 16 + 2) {
+        uint8x16_t a = vld1q_u8(p);
+        uint8x16_t b = vld1q_u8(p + 1);
+        uint8x16_t c = vld1q_u8(p + 2);
+        uint8x16_t m = vandq_u8(vandq_u8(vceqq_u8(a, zero), vceqq_u8(b, zero)),
+                                vceqq_u8(c, one));
+        // No movemask on NEON: narrowing keeps four bits per byte
+        uint64_t mask = vget_lane_u64(vreinterpret_u64_u8(vshrn_n_u16(vreinterpretq_u16_u8(m), 4)), 0);
+        if (mask) {
+            return p + (__builtin_ctzll(mask) >> 2);
+        }
+        p += 16;
+    }
+
+    return find_start_code_scalar(p, end);
+}
+#endif
+
+static nal_scan_impl_t impls[4];
+static const guint8 *(*find_start_code)(const guint8 *p, const guint8 *end);
+static gsize impls_selected = 0;
+
+static void select_impls(void) {
+    if (g_once_init_enter(&impls_selected)) {
+        guint n = 0;
+
+#ifdef NAL_SCAN_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            impls[n++] = (nal_scan_impl_t){ "avx2", find_start_code_avx2 };
+        }
+        if (__builtin_cpu_supports("sse2")) {
+            impls[n++] = (nal_scan_impl_t){ "sse2", find_start_code_sse2 };
+        }
+#endif
+#ifdef NAL_SCAN_NEON
+        impls[n++] = (nal_scan_impl_t){ "neon", find_start_code_neon };
+#endif
+        impls[n++] = (nal_scan_impl_t){ "scalar", find_start_code_scalar };
+        impls[n] = (nal_scan_impl_t){ NULL, NULL };
+        find_start_code = impls[0].find;
+
+        g_once_init_leave(&impls_selected, 1);
+    }
+}
+
+const nal_scan_impl_t *nal_scan_impls(void) {
+    select_impls();
+    return impls;
+}
+
+const guint8 *nal_scan_find_start_code(const guint8 *p, const guint8 *end) {
+    select_impls();
+    return find_start_code(p, end);
+}
+
+guint nal_scan(GArray *units, const guint8 *data, gsize size) {
+    const guint8 *end = data + size;
+    const guint8 *p;
+
+    select_impls();
+    g_array_set_size(units, 0);
+
+    p = find_start_code(data, end);
+    while (p + 3 < end) {
+        nal_scan_unit_t unit;
+
+        // A zero byte in front makes it the 4-byte form; zeros trailing a
+        // NAL unit are never part of it
+        unit.offset = p - data;
+        unit.header = 3;
+        if (p > data && p[-1] == 0) {
+            unit.offset--;
+            unit.header = 4;
+        }
+        unit.type = p[3] & 0x1F;
+        unit.size = 0;
+
+        if (units->len) {
+            nal_scan_unit_t *prev = &g_array_index(units, nal_scan_unit_t, units->len - 1);
+            prev->size = unit.offset - prev->offset;
+        }
+        g_array_append_val(units, unit);
+
+        p = find_start_code(p + 3, end);
+    }
+
+    if (units->len) {
+        nal_scan_unit_t *last = &g_array_index(units, nal_scan_unit_t, units->len - 1);
+        last->size = size - last->offset;
+    }
+
+    return units->len;
+}
@@ -0,0 +1,37 @@
+#ifndef NAL_SCAN_H
+#define NAL_SCAN_H
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+// One NAL unit of an Annex B byte stream
+typedef struct {
+  guint offset; // of the start code
+  guint size;   // start code included, up to the next start code
+  guint8 header; // start code length, 3 or 4
+  guint8 type;   // nal_unit_type
+} nal_scan_unit_t;
+
+// A start code scanner; the vectorised ones only exist where the CPU has
+// the instructions
+typedef struct {
+  const gchar *name;
+  const guint8 *(*find)(const guint8 *p, const guint8 *end);
+} nal_scan_impl_t;
+
+// Finds every NAL unit in one pass over the data into units, an array of
+// nal_scan_unit_t, replacing its contents. Bytes before the first start
+// code are not reported. Returns the number of units.
+guint nal_scan(GArray *units, const guint8 *data, gsize size);
+
+// First 00 00 01 at or after p, or end
+const guint8 *nal_scan_find_start_code(const guint8 *p, const guint8 *end);
+
+// Scanners usable on this CPU, fastest first, ending with the scalar one
+// and a NULL name; nal_scan() uses the first
+const nal_scan_impl_t *nal_scan_impls(void);
+
+G_END_DECLS
+
+#endif /* NAL_SCAN_H */
@@ -0,0 +1,122 @@
+// Capture time estimators against jittered, gapped and jumping input:
+// output never runs backwards, a clock jump restarts the estimate and the
+// skew stays within TS_ESTIMATOR_MAX_SKEW_PPM.
+
+#include "tsestimator.h"
+
+#define NOMINAL (33333333) // ns, 30 fps
+#define FRAMES 600
+#define JITTER (2 * GST_MSECOND)
+
+static guint32 rng_state = 0x12345678;
+
+static gint64 next_jitter(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return (gint64)(rng_state % (2 * JITTER + 1)) - JITTER;
+}
+
+typedef struct {
+    gdouble ppm;     // camera clock against the host one
+    guint gap_every; // frames between gaps, 0 for none
+    guint gap;       // frames lost at each gap
+    guint jump_at;   // frame the capture time jumps at, 0 for none
+    gint64 jump;
+} scenario_t;
+
+static const gchar *mode_name(ts_estimator_mode_t mode) {
+    switch (mode) {
+        case TS_ESTIMATOR_SMOOTHED: return "smoothed";
+        case TS_ESTIMATOR_LOCKED: return "locked";
+        default: return "raw";
+    }
+}
+
+static gboolean run(const gchar *name, ts_estimator_mode_t mode, const scenario_t *sc) {
+    ts_estimator_t est;
+    ts_estimator_stats_t stats;
+    GstClockTime prev = GST_CLOCK_TIME_NONE;
+    guint32 seq = 1000;
+    gint64 offset = 0;
+    gboolean ok = TRUE;
+
+    ts_estimator_init(&est, mode, NOMINAL);
+    for (guint i = 0; i < FRAMES; i++, seq++) {
+        if (sc->gap_every && i && i % sc->gap_every == 0) {
+            seq += sc->gap;
+        }
+        if (sc->jump_at && i == sc->jump_at) {
+            offset = sc->jump;
+        }
+
+        GstClockTime ideal = 10 * GST_SECOND +
+                             (GstClockTime)((gdouble)(seq - 1000) * NOMINAL * (1 + sc->ppm / 1e6));
+        GstClockTime capture = ideal + offset + next_jitter();
+        GstClockTime out = ts_estimator_push(&est, seq, capture);
+
+        if (GST_CLOCK_TIME_IS_VALID(prev) && out <= prev) {
+            g_printerr("%s/%s: frame %u at %" G_GUINT64_FORMAT " after %" G_GUINT64_FORMAT "\n",
+                       name, mode_name(mode), i, out, prev);
+            ok = FALSE;
+        }
+        // Right after a restart the estimate starts from the capture time;
+        // a jump back is held up by monotonicity instead
+        if (sc->jump > 0 && i == sc->jump_at + 1 && mode != TS_ESTIMATOR_RAW &&
+            ABS((gint64)(out - capture)) > NOMINAL) {
+            g_printerr("%s/%s: %" G_GINT64_FORMAT " ns off after the jump\n",
+                       name, mode_name(mode), (gint64)(out - capture));
+            ok = FALSE;
+        }
+        prev = out;
+    }
+
+    ts_estimator_get_stats(&est, &stats);
+    if (ABS(stats.skew_ppm) > TS_ESTIMATOR_MAX_SKEW_PPM + 1) {
+        g_printerr("%s/%s: skew %.0f ppm\n", name, mode_name(mode), stats.skew_ppm);
+        ok = FALSE;
+    }
+    // Jitter and gaps alone must not restart the estimate, a jump must
+    if (mode != TS_ESTIMATOR_RAW && ABS(sc->ppm) < TS_ESTIMATOR_MAX_SKEW_PPM &&
+        (sc->jump_at ? stats.resyncs == 0 : stats.resyncs != 0)) {
+        g_printerr("%s/%s: %u resyncs\n", name, mode_name(mode), stats.resyncs);
+        ok = FALSE;
+    }
+    // The estimate follows the camera's real rate up to the clamp
+    if (mode != TS_ESTIMATOR_RAW && !sc->jump_at &&
+        ABS(stats.skew_ppm - CLAMP(sc->ppm, -TS_ESTIMATOR_MAX_SKEW_PPM, TS_ESTIMATOR_MAX_SKEW_PPM)) > 1000) {
+        g_printerr("%s/%s: skew %.0f ppm, camera at %.0f\n", name, mode_name(mode),
+                   stats.skew_ppm, sc->ppm);
+        ok = FALSE;
+    }
+
+    g_print("%-10s %-8s skew %7.0f ppm  resyncs %u  error rms %6.0f us  max %6" G_GINT64_FORMAT " us\n",
+            name, mode_name(mode), stats.skew_ppm, stats.resyncs, stats.error_rms_ns / 1000,
+            stats.error_max_ns / 1000);
+    return ok;
+}
+
+int main(void) {
+    static const struct {
+        const gchar *name;
+        scenario_t sc;
+    } scenarios[] = {
+        { "jitter",    { 300, 0, 0, 0, 0 } },
+        { "slow",      { -1500, 0, 0, 0, 0 } },
+        { "gaps",      { 300, 40, 3, 0, 0 } },
+        { "jump",      { 300, 0, 0, 300, 2 * GST_SECOND } },
+        { "jump-back", { 300, 0, 0, 300, -(gint64)GST_SECOND / 2 } },
+        { "off-clamp", { 20000, 0, 0, 0, 0 } },
+    };
+    static const ts_estimator_mode_t modes[] = {
+        TS_ESTIMATOR_RAW, TS_ESTIMATOR_SMOOTHED, TS_ESTIMATOR_LOCKED,
+    };
+    gboolean ok = TRUE;
+
+    for (guint i = 0; i < G_N_ELEMENTS(scenarios); i++) {
+        for (guint m = 0; m < G_N_ELEMENTS(modes); m++) {
+            ok &= run(scenarios[i].name, modes[m], &scenarios[i].sc);
+        }
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+#include <math.h>
+#include <string.h>
+#include "tsestimator.h"
+
+// Loop gains of the locked estimator: a type-2 PLL that corrects 1/16 of
+// the phase error per frame and folds 1/256 of it into the rate
+#define PLL_PHASE_GAIN (1.0 / 16)
+#define PLL_RATE_GAIN (1.0 / 256)
+
+void ts_estimator_init(ts_estimator_t *est, ts_estimator_mode_t mode,
+                       GstClockTime nominal_interval) {
+    memset(est, 0, sizeof(*est));
+    est->mode = mode;
+    est->nominal = (gdouble)nominal_interval;
+    est->interval = est->nominal;
+}
+
+static gdouble clamp_interval(const ts_estimator_t *est, gdouble interval) {
+    gdouble max_dev = est->nominal * TS_ESTIMATOR_MAX_SKEW_PPM / 1e6;
+
+    if (est->nominal <= 0) {
+        return interval;
+    }
+    return CLAMP(interval, est->nominal - max_dev, est->nominal + max_dev);
+}
+
+// Start over from this frame, e.g. after a gap or a clock jump
+static void restart(ts_estimator_t *est, guint32 seq, GstClockTime capture) {
+    est->count = 0;
+    est->head = 0;
+    est->base_seq = seq;
+    est->base_time = capture;
+    est->interval = est->nominal;
+}
+
+// Least-squares line through the capture times of the window, evaluated
+// at this frame; frame numbers rather than arrival order are the abscissa,
+// so frames dropped upstream leave their gap in the timeline
+static gdouble fit_window(ts_estimator_t *est, gdouble x, gdouble y) {
+    gdouble mean_x = 0, mean_y = 0, sxx = 0, sxy = 0;
+
+    est->x[est->head] = x;
+    est->y[est->head] = y;
+    est->head = (est->head + 1) % TS_ESTIMATOR_WINDOW;
+    if (est->count < TS_ESTIMATOR_WINDOW) {
+        est->count++;
+    }
+
+    if (est->count < 2) {
+        return y;
+    }
+
+    for (guint i = 0; i < est->count; i++) {
+        mean_x += est->x[i];
+        mean_y += est->y[i];
+    }
+    mean_x /= est->count;
+    mean_y /= est->count;
+
+    for (guint i = 0; i < est->count; i++) {
+        sxx += (est->x[i] - mean_x) * (est->x[i] - mean_x);
+        sxy += (est->x[i] - mean_x) * (est->y[i] - mean_y);
+    }
+    if (sxx > 0) {
+        est->interval = clamp_interval(est, sxy / sxx);
+    }
+
+    return mean_y + est->interval * (x - mean_x);
+}
+
+GstClockTime ts_estimator_push(ts_estimator_t *est, guint32 seq, GstClockTime capture) {
+    GstClockTime out;
+    gint64 error;
+
+    if (!est->started) {
+        restart(est, seq, capture);
+    } else if (est->mode != TS_ESTIMATOR_RAW && est->interval > 0) {
+        // Check the capture time against where the current estimate puts it
+        gdouble expected = (gdouble)(gint64)(est->last_out - est->base_time) +
+                           est->interval * (guint32)(seq - est->last_seq);
+        gdouble off = (gdouble)(gint64)(capture - est->base_time) - expected;
+        if (fabs(off) > est->interval * TS_ESTIMATOR_RESYNC_FRAMES) {
+            restart(est, seq, capture);
+            est->resyncs++;
+        }
+    }
+
+    gdouble x = (guint32)(seq - est->base_seq);
+    gdouble y = (gint64)(capture - est->base_time);
+
+    switch (est->mode) {
+        case TS_ESTIMATOR_SMOOTHED:
+            out = est->base_time + (gint64)llround(fit_window(est, x, y));
+            break;
+        case TS_ESTIMATOR_LOCKED:
+            if (est->count == 0 || est->nominal <= 0) {
+                out = capture;
+                est->count = 1;
+            } else {
+                guint32 frames = seq - est->last_seq;
+                gdouble predicted = (gdouble)(gint64)(est->last_out - est->base_time) +
+                                    est->interval * frames;
+                gdouble phase_error = y - predicted;
+
+                out = est->base_time + (gint64)llround(predicted + phase_error * PLL_PHASE_GAIN);
+                est->interval = clamp_interval(est, est->interval +
+                                               phase_error * PLL_RATE_GAIN / MAX(frames, 1));
+            }
+            break;
+        case TS_ESTIMATOR_RAW:
+        default:
+            out = capture;
+            break;
+    }
+
+    // Never let timestamps run backwards, whatever the input does
+    if (est->started && (gint64)(out - est->last_out) <= 0) {
+        out = est->last_out + 1;
+    }
+
+    error = (gint64)(capture - out);
+    est->frames++;
+    est->error_sum += error;
+    est->error_sq_sum += (gdouble)error * error;
+    if (ABS(error) > est->error_max) {
+        est->error_max = ABS(error);
+    }
+
+    est->started = TRUE;
+    est->last_seq = seq;
+    est->last_out = out;
+
+    return out;
+}
+
+void ts_estimator_get_stats(const ts_estimator_t *est, ts_estimator_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    stats->frames = est->frames;
+    stats->resyncs = est->resyncs;
+    if (est->nominal > 0 && est->interval > 0) {
+        stats->skew_ppm = (est->interval / est->nominal - 1.0) * 1e6;
+    }
+    if (est->frames > 0) {
+        stats->error_mean_ns = est->error_sum / est->frames;
+        stats->error_rms_ns = sqrt(est->error_sq_sum / est->frames);
+    }
+    stats->error_max_ns = est->error_max;
+}
@@ -0,0 +1,63 @@
+#ifndef TS_ESTIMATOR_H
+#define TS_ESTIMATOR_H
+
+#include <glib.h>
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+// How capture times (host arrival or device clock) become buffer timestamps
+typedef enum {
+  TS_ESTIMATOR_RAW,      // capture time as is
+  TS_ESTIMATOR_SMOOTHED, // least-squares line through the recent frames
+  TS_ESTIMATOR_LOCKED,   // nominal frame rate, phase and skew tracked by a PLL
+} ts_estimator_mode_t;
+
+// Frames the least-squares fit runs over
+#define TS_ESTIMATOR_WINDOW 64
+// A capture time this many frame intervals off the estimate restarts it
+#define TS_ESTIMATOR_RESYNC_FRAMES 8
+// Largest rate deviation from nominal the estimators accept
+#define TS_ESTIMATOR_MAX_SKEW_PPM 5000
+
+typedef struct {
+  guint64 frames;
+  guint resyncs;
+  gdouble skew_ppm;      // estimated frame rate against the nominal one
+  gdouble error_mean_ns; // capture time minus output timestamp
+  gdouble error_rms_ns;
+  gint64 error_max_ns;   // largest absolute error
+} ts_estimator_stats_t;
+
+typedef struct {
+  ts_estimator_mode_t mode;
+  gdouble nominal;  // ns per frame, 0 if unknown
+  gdouble interval; // current estimate of the frame interval
+
+  // fit window, relative to the first frame after a (re)start
+  gdouble x[TS_ESTIMATOR_WINDOW];
+  gdouble y[TS_ESTIMATOR_WINDOW];
+  guint head;
+  guint count;
+  guint32 base_seq;
+  GstClockTime base_time;
+
+  gboolean started;
+  guint32 last_seq;
+  GstClockTime last_out;
+
+  guint64 frames;
+  guint resyncs;
+  gdouble error_sum;
+  gdouble error_sq_sum;
+  gint64 error_max;
+} ts_estimator_t;
+
+void ts_estimator_init(ts_estimator_t *est, ts_estimator_mode_t mode,
+                       GstClockTime nominal_interval);
+GstClockTime ts_estimator_push(ts_estimator_t *est, guint32 seq, GstClockTime capture);
+void ts_estimator_get_stats(const ts_estimator_t *est, ts_estimator_stats_t *stats);
+
+G_END_DECLS
+
+#endif /* TS_ESTIMATOR_H */